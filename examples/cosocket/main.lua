@@ -0,0 +1,28 @@
+-- talks to a line based echo server on 127.0.0.1:7000, e.g.
+--   ncat -l 7000 -k -c 'cat'
+-- the connection goes back into the pool and is reused by the next request
+
+function luarest_init(app)
+  app:register(luarest.HTTP_METHOD_GET, "/echo/:msg", on_echo)
+end
+
+function on_echo(headers, params, body)
+  local sock = luarest.tcp()
+  sock:settimeout(1000)
+
+  local ok, err = sock:connect("127.0.0.1", 7000)
+  if not ok then
+    return luarest.HTTP_RESPONSE_SERVER_ERROR, luarest.CONTENT_TYPE_PLAIN, "connect: " .. err
+  end
+  local reused = sock:getreusedtimes()
+
+  sock:send(params.msg .. "\n")
+  local line, err = sock:receive("*l")
+  if not line then
+    sock:close()
+    return luarest.HTTP_RESPONSE_SERVER_ERROR, luarest.CONTENT_TYPE_PLAIN, "receive: " .. err
+  end
+  sock:setkeepalive()
+
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, line .. " (reused " .. reused .. " times)"
+end
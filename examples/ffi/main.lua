@@ -0,0 +1,21 @@
+-- request and response access through the LuaJIT FFI
+
+local ffi = require("ffi")
+local lr = require("luarest.ffi")
+
+function luarest_init(app)
+  app:register(luarest.HTTP_METHOD_GET, "/echo", on_echo)
+end
+
+function on_echo(headers, params, body)
+  local req = lr.request()
+  lr.write("path: ")
+  lr.write(req.path.base, req.path.len)
+  local agent = lr.header("User-Agent")
+  if agent ~= nil then
+    lr.write("\nuser-agent: ")
+    lr.write(agent.base, agent.len)
+  end
+  -- a nil body sends what was written to the output buffer
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, nil
+end
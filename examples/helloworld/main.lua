@@ -2,9 +2,63 @@
 
 function luarest_init(app)
   app:register(luarest.HTTP_METHOD_GET, "/hello", on_hello)
+  app:register(luarest.HTTP_METHOD_GET, "/hello/:name", on_hello_name)
+  app:register(luarest.HTTP_METHOD_GET, "/version", on_version)
+  app:register(luarest.HTTP_METHOD_GET, "/logo", on_logo)
+  -- bodies larger than 64k are answered with 413 before they are read
+  app:register(luarest.HTTP_METHOD_POST, "/echo", on_echo, { max_body = 64 * 1024 })
+  app:register(luarest.HTTP_METHOD_POST, "/form", on_form)
+  -- served from the cache for 5 seconds after the first request, requests
+  -- arriving while it is rendered with the same Accept header wait for it
+  -- instead of rendering it too
+  app:register(luarest.HTTP_METHOD_GET, "/stats", on_stats,
+    { cache = { ttl = 5000, vary = { "Accept" } }, coalesce = { vary = { "Accept" } } })
 end
 
 function on_hello(headers, params, body)
   local msg = "hello luarest"
   return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, msg
 end
+
+function on_hello_name(headers, params, body)
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, "hello " .. params.name
+end
+
+-- responses get an ETag hashed from the body unless the callback sets one,
+-- clients revalidating with If-None-Match or If-Modified-Since get a 304
+local started = os.time()
+
+function on_version(headers, params, body, res)
+  res:etag("v1")
+  res:last_modified(started)
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, "1.0"
+end
+
+-- any status code and media type, further headers are added with res:header
+function on_logo(headers, params, body, res)
+  res:header("Location", "/assets/logo.svg")
+  res:header("Cache-Control", "public, max-age=86400")
+  return 301, "text/plain; charset=utf-8", "moved to /assets/logo.svg"
+end
+
+function on_echo(headers, params, body)
+  return luarest.HTTP_RESPONSE_OK, headers["Content-Type"] or luarest.CONTENT_TYPE_PLAIN, tostring(body)
+end
+
+-- curl -d "tag=a&tag=b&name=hello+world" "localhost:8000/form?page=2"
+function on_form(headers, params, body)
+  local form = body and luarest.form(body) or {}
+  local query = luarest.form(params)
+  local tags = form.tag
+  if type(tags) == "table" then
+    tags = table.concat(tags, ",")
+  end
+  local msg = string.format("name %s, tags %s, page %s", form.name or "-", tags or "-", query.page or "-")
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, msg
+end
+
+function on_stats(headers, params, body)
+  local stats = luarest.cache_stats()
+  local msg = string.format("hits %d, misses %d, evictions %d", stats.hits, stats.misses, stats.evictions)
+  return luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN, msg
+end
@@ -0,0 +1,8 @@
+-- /proxy/api/... is forwarded to two local backends, e.g.
+--   python3 -m http.server 9000 & python3 -m http.server 9001
+-- without the request ever entering Lua
+
+function luarest_init(app)
+  app:proxy(luarest.HTTP_METHOD_GET, "/api", { "127.0.0.1:9000", "127.0.0.1:9001" },
+    { connect_timeout = 1000, read_timeout = 5000 })
+end
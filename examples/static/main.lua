@@ -0,0 +1,8 @@
+-- /static/assets/... serves the files below public/ with sendfile, without
+-- the request ever entering Lua. Clients accepting gzip get app.js.gz for
+-- app.js if it exists, e.g. after
+--   gzip -k public/app.js
+
+function luarest_init(app)
+  app:static("/assets", "public")
+end
@@ -0,0 +1,23 @@
+-- streams a large export in chunks, res:write suspends the callback while
+-- the client is reading slower than the export is produced
+
+function luarest_init(app)
+  app:register(luarest.HTTP_METHOD_GET, "/export/:rows", on_export)
+  app:register(luarest.HTTP_METHOD_GET, "/ticker", on_ticker)
+end
+
+function on_export(headers, params, body, res)
+  res:start(luarest.HTTP_RESPONSE_OK, luarest.CONTENT_TYPE_PLAIN)
+  for i = 1, tonumber(params.rows) or 0 do
+    res:write(string.format("%d,row %d\n", i, i))
+  end
+  res:finish()
+end
+
+-- luarest.sleep suspends only this request, the worker keeps serving others
+function on_ticker(headers, params, body, res)
+  for i = 1, 5 do
+    res:write("tick " .. i .. "\n")
+    luarest.sleep(1000)
+  end
+end
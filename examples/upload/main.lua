@@ -0,0 +1,19 @@
+-- POST /upload/files with a multipart/form-data body, e.g.
+--   curl -F title=holiday -F photo=@photo.jpg http://localhost:8080/upload/files
+-- The files are written to the spool directory (luarest -t <dir>) while
+-- they arrive, the callback runs once the last one is on disk. Spooled
+-- files are removed after the callback, so keep them by moving them away
+
+function luarest_init(app)
+  app:register(luarest.HTTP_METHOD_POST, "/files", on_upload, { upload = true, max_body = 2 * 1024 * 1024 * 1024 })
+end
+
+function on_upload(headers, params, parts)
+  if parts == nil or parts.photo == nil or parts.photo.path == nil then
+    return 400, luarest.CONTENT_TYPE_PLAIN, "photo missing"
+  end
+  local title = parts.title and parts.title.value or "untitled"
+  os.rename(parts.photo.path, "/tmp/" .. title .. ".jpg")
+  return luarest.HTTP_RESPONSE_CREATED, luarest.CONTENT_TYPE_PLAIN,
+    string.format("stored %s (%d bytes)", parts.photo.filename, parts.photo.size)
+end
@@ -2,10 +2,30 @@
 #define __LUAREST_APP_H__
 
 #include "luarest.h"
+#include "arena.h"
+#include "router.h"
+#include "luarest_ffi.h"
+#include "cache.h"
+#include "compress.h"
+#include "pool.h"
+
+/* Application names are short, FNV hashes them in a fraction of the time 
+   Jenkins' hash needs. Has to be the same in every file using the hashes */
+#define HASH_FUNCTION HASH_FNV
 #include "thirdparty/uthash.h"
 #include "thirdparty/utstring.h"
 
 #include <lua.h>
+#include <uv.h>
+#include <time.h>
+
+/* Upper bound of an entity-tag set by a service-callback, quotes included */
+#define RESPONSE_ETAG_MAX 128
+
+/* Upper bound of a Content-Type set by a service-callback and of the header
+   lines it adds with res:header, CRLFs included */
+#define RESPONSE_MIME_MAX 128
+#define RESPONSE_HEADERS_MAX 768
 
 /*-----------------------------------------------------------------------------
  * Data structures
@@ -27,7 +47,42 @@ typedef enum luarest_response {
 	HTTP_RESPONSE_NOT_MODIFIED = 5,
 	HTTP_RESPONSE_SEE_OTHER = 6,
 	HTTP_RESPONSE_SERVER_ERROR = 7,
-	HTTP_RESPONSE_TEMPORARY_REDIRECT = 8
+	HTTP_RESPONSE_TEMPORARY_REDIRECT = 8,
+	HTTP_RESPONSE_PARTIAL_CONTENT = 9,
+	HTTP_RESPONSE_NOT_FOUND = 10,
+	HTTP_RESPONSE_RANGE_NOT_SATISFIABLE = 11,
+	HTTP_RESPONSE_CONTINUE = 12,
+	HTTP_RESPONSE_SWITCHING_PROTOCOLS = 13,
+	HTTP_RESPONSE_ACCEPTED = 14,
+	HTTP_RESPONSE_NON_AUTHORITATIVE_INFORMATION = 15,
+	HTTP_RESPONSE_RESET_CONTENT = 16,
+	HTTP_RESPONSE_MULTIPLE_CHOICES = 17,
+	HTTP_RESPONSE_MOVED_PERMANENTLY = 18,
+	HTTP_RESPONSE_FOUND = 19,
+	HTTP_RESPONSE_USE_PROXY = 20,
+	HTTP_RESPONSE_PERMANENT_REDIRECT = 21,
+	HTTP_RESPONSE_BAD_REQUEST = 22,
+	HTTP_RESPONSE_UNAUTHORIZED = 23,
+	HTTP_RESPONSE_PAYMENT_REQUIRED = 24,
+	HTTP_RESPONSE_FORBIDDEN = 25,
+	HTTP_RESPONSE_METHOD_NOT_ALLOWED = 26,
+	HTTP_RESPONSE_PROXY_AUTHENTICATION_REQUIRED = 27,
+	HTTP_RESPONSE_REQUEST_TIMEOUT = 28,
+	HTTP_RESPONSE_CONFLICT = 29,
+	HTTP_RESPONSE_GONE = 30,
+	HTTP_RESPONSE_LENGTH_REQUIRED = 31,
+	HTTP_RESPONSE_PRECONDITION_FAILED = 32,
+	HTTP_RESPONSE_PAYLOAD_TOO_LARGE = 33,
+	HTTP_RESPONSE_URI_TOO_LONG = 34,
+	HTTP_RESPONSE_UNSUPPORTED_MEDIA_TYPE = 35,
+	HTTP_RESPONSE_EXPECTATION_FAILED = 36,
+	HTTP_RESPONSE_UPGRADE_REQUIRED = 37,
+	HTTP_RESPONSE_TOO_MANY_REQUESTS = 38,
+	HTTP_RESPONSE_NOT_IMPLEMENTED = 39,
+	HTTP_RESPONSE_BAD_GATEWAY = 40,
+	HTTP_RESPONSE_SERVICE_UNAVAILABLE = 41,
+	HTTP_RESPONSE_GATEWAY_TIMEOUT = 42,
+	HTTP_RESPONSE_HTTP_VERSION_NOT_SUPPORTED = 43
 } luarest_response;
 
 typedef enum luarest_content_type {
@@ -36,32 +91,237 @@ typedef enum luarest_content_type {
 	CONTENT_TYPE_JSON = 3
 } luarest_content_type;
 
+struct proxy_route;
+struct static_route;
+struct static_file;
+struct flight;
+struct upload_part;
+
+/* The request headers identical requests to a coalescing route have to 
+   agree on, besides method, path and query */
+typedef struct coalesce_policy {
+	int num_vary;
+	char* vary[CACHE_MAX_VARY];
+} coalesce_policy;
+
+/* A route handled by a service-callback or, if proxy is set, forwarded to
+   an upstream without involving Lua, as are the files of a directory served
+   by a route with files set. Responses of a route with a cache 
+   policy are served from the application's cache while they are fresh, 
+   identical requests to a coalescing route share one callback's response */
 typedef struct service {
-	UT_string* key;
 	luarest_method method;
 	UT_string* path;
 	int callback_ref;
-	UT_hash_handle hh;
+	struct proxy_route* proxy;
+	struct static_route* files;
+	cache_policy* cache;
+	coalesce_policy* coalesce;
+	/* upper bound of a request body, 0 for the server's limit */
+	size_t max_body;
+	/* multipart/form-data bodies are spooled to disk while they arrive */
+	bool upload;
 } service;
 
+typedef struct header_t {
+	slice_t field;
+	slice_t value;
+} header_t;
+
+/* Response body owned by a lua_State, the string is kept alive by a registry
+   reference until the response has been written to the socket. Bodies
+   written through the FFI output buffer are owned by the response instead,
+   and handed back to owned_pool if it is set rather than freed. Cached 
+   ones hold a reference of their cache entry. A body sent from a 
+   file has no data, len bytes are sent from offset of fd, which stays open
+   while file is referenced */
+typedef struct response_body {
+	const char* data;
+	size_t len;
+	lua_State* lua_state;
+	int ref;
+	char* owned;
+	pool_t* owned_pool;
+	cache_entry* cached;
+	struct static_file* file;
+	uv_file fd;
+	int64_t offset;
+} response_body;
+
+struct request;
+struct application;
+
+/* What a suspended service-callback is waiting for */
+typedef enum request_wait {
+	REQUEST_WAIT_NONE = 0,
+	REQUEST_WAIT_WRITE = 1, /* the connection's write queue to drain */
+	REQUEST_WAIT_EVENT = 2  /* a libuv callback calling resume_application */
+} request_wait;
+
+/* Implemented by the server. complete is called when a service-callback 
+   which was suspended has finished, the stream functions send a response 
+   in chunks while the callback is running, a NULL chunk ends the stream.
+   send writes data which is already framed, e.g. a proxied response */
+typedef struct request_ops {
+	void (*complete)(struct request* req, luarest_status status);
+	void (*stream_start)(struct request* req);
+	void (*stream_write)(struct request* req, response_body* chunk);
+	void (*send)(struct request* req, response_body* data);
+	bool (*congested)(struct request* req);
+} request_ops;
+
+/* The parsed request as handed to an application, all slices live in the 
+   connection's request arena and are only valid until the request is done.
+   The fields up to body are mirrored by the FFI module (luarest_ffi.c) */
+typedef struct request {
+	luarest_method method;
+	slice_t path;
+	slice_t query;
+	header_t* headers;
+	int num_headers;
+	slice_t body;
+	arena_t* arena;
+	route_match match;
+	unsigned short http_minor;
+	/* the encoding the client prefers, identity if compression is off */
+	content_encoding accept_encoding;
+	const request_ops* ops;
+	/* outcome, filled in by the application */
+	luarest_response res_code;
+	luarest_content_type con_type;
+	response_body* res_body;
+	bool streaming;
+	bool stream_finished;
+	bool close_connection;
+	/* whether the client's connection stays open after the response, and
+	   if the client asked for that with a Connection: Keep-Alive header */
+	bool keep_alive;
+	bool keep_alive_header;
+	/* validators of the response, etag is quoted and empty unless set by 
+	   the callback or computed from the body, last_modified is 0 if unset */
+	slice_t etag;
+	time_t last_modified;
+	content_encoding con_encoding;
+	bool vary_encoding;
+	/* overrides con_type if set */
+	const char* mime;
+	/* further header lines, each terminated by CRLF, added with 
+	   request_add_header to a buffer of RESPONSE_HEADERS_MAX bytes */
+	slice_t res_headers;
+	/* set if the response is to be cached under cache_key or shared with
+	   the requests waiting on the same flight */
+	cache_policy* cache;
+	slice_t cache_key;
+	struct flight* flight;
+	struct request* next_waiter;
+	/* the parts of a spooled multipart body, which then isn't in body */
+	struct upload_part* parts;
+	/* the running service-callback and its FFI output */
+	struct application* app;
+	lua_State* co;
+	int co_ref;
+	ffi_output ffi_out;
+	request_wait waiting;
+	void (*wait_cancel)(struct request* req);
+	void (*wait_resume)(struct request* req);
+	void* wait_data;
+} request;
+
+/* An idle coroutine, kept alive by its registry reference */
+typedef struct app_thread {
+	lua_State* co;
+	int ref;
+} app_thread;
+
+/* Finished coroutines are reused, up to this many per application */
+#define APP_THREAD_POOL_MAX 64
+
 typedef struct application {
 	UT_string* name;
 	lua_State* lua_state;
-	service* s;
+	ffi_context* ffi;
+	router routes;
+	uv_loop_t* loop;
+	request* running;
+	app_thread idle_threads[APP_THREAD_POOL_MAX];
+	int num_idle_threads;
+	response_cache cache;
+	struct flight* flights;
+	/* the directory of the application's main.lua */
+	UT_string* dir;
 	UT_hash_handle hh;
 } application;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
  *----------------------------------------------------------------------------*/
-luarest_status create_applications(application** apps, char* app_dir);
+luarest_status create_applications(application** apps, char* app_dir, uv_loop_t* loop);
 luarest_status free_applications(application* apps);
-luarest_status invoke_application(application* apps, UT_string* url, luarest_method m, luarest_response* res_code, 
-	luarest_content_type* con_type, UT_string* res_buf);
+luarest_status invoke_application(application* apps, request* req);
+luarest_status application_body_options(application* apps, request* req, size_t* limit, bool* upload);
+void resume_application(request* req, int nresults);
+void cancel_application(request* req);
+request* current_request(lua_State* state);
+int suspend_request(lua_State* state, request* req, void (*cancel)(request* req), void* data);
+void release_response_body(response_body* body);
+const slice_t* request_header(const request* req, const char* name, size_t len);
+luarest_status request_add_header(request* req, const char* name, size_t name_len, const char* value,
+	size_t value_len);
+bool request_not_modified(const request* req, const slice_t* etag, time_t last_modified);
+luarest_status share_response(request* req, luarest_status status, bool keep_alive_header, 
+	const char* header, size_t header_len, response_body* body);
 
 /*-----------------------------------------------------------------------------
  * Globals
  *----------------------------------------------------------------------------*/
+/* Status lines, indexed by luarest_response */
+static const char luarest_response_str[][36] = {
+	"", /* Sentinel */
+	"200 OK",
+	"201 Created",
+	"204 No Content",
+	"406 Not Acceptable",
+	"304 Not Modified",
+	"303 See Other",
+	"500 Internal Server Error",
+	"307 Temporary Redirect",
+	"206 Partial Content",
+	"404 Not Found",
+	"416 Range Not Satisfiable",
+	"100 Continue",
+	"101 Switching Protocols",
+	"202 Accepted",
+	"203 Non-Authoritative Information",
+	"205 Reset Content",
+	"300 Multiple Choices",
+	"301 Moved Permanently",
+	"302 Found",
+	"305 Use Proxy",
+	"308 Permanent Redirect",
+	"400 Bad Request",
+	"401 Unauthorized",
+	"402 Payment Required",
+	"403 Forbidden",
+	"405 Method Not Allowed",
+	"407 Proxy Authentication Required",
+	"408 Request Timeout",
+	"409 Conflict",
+	"410 Gone",
+	"411 Length Required",
+	"412 Precondition Failed",
+	"413 Payload Too Large",
+	"414 URI Too Long",
+	"415 Unsupported Media Type",
+	"417 Expectation Failed",
+	"426 Upgrade Required",
+	"429 Too Many Requests",
+	"501 Not Implemented",
+	"502 Bad Gateway",
+	"503 Service Unavailable",
+	"504 Gateway Timeout",
+	"505 HTTP Version Not Supported"
+};
+
 static const char luarest_content_type_str[][18] = {
 	"", /* Sentinel */
 	"text/plain",
@@ -69,4 +329,7 @@ static const char luarest_content_type_str[][18] = {
 	"application/json"
 };
 
+#define LUAREST_NUM_RESPONSES (sizeof(luarest_response_str) / sizeof(luarest_response_str[0]))
+#define LUAREST_NUM_CONTENT_TYPES (sizeof(luarest_content_type_str) / sizeof(luarest_content_type_str[0]))
+
 #endif
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef __LUAREST_ARENA_H__
+#define __LUAREST_ARENA_H__
+
+#include "luarest.h"
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+typedef struct arena_block {
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+} arena_block;
+
+/* Bump-pointer allocator for per-request data, everything allocated from it
+   is released at once by arena_reset. The blocks are kept across resets so 
+   a warmed up arena doesn't call malloc anymore */
+typedef struct arena_t {
+	arena_block* first;
+	arena_block* current;
+	size_t block_size;
+	char* last;
+	size_t last_size;
+} arena_t;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void arena_init(arena_t* arena, size_t block_size);
+void* arena_alloc(arena_t* arena, size_t size);
+luarest_status arena_append(arena_t* arena, slice_t* str, const char* data, size_t len);
+void arena_reset(arena_t* arena);
+void arena_destroy(arena_t* arena);
+
+#endif
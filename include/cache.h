@@ -0,0 +1,77 @@
+#ifndef __LUAREST_CACHE_H__
+#define __LUAREST_CACHE_H__
+
+#include "luarest.h"
+
+#include <time.h>
+
+/* Must match the hash function of every other file using uthash */
+#define HASH_FUNCTION HASH_FNV
+#include "thirdparty/uthash.h"
+
+/* Upper bound of all entries of an application's cache and of a single
+   entry unless the route sets max_size */
+#define CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+
+/* Request headers a cached route may vary on */
+#define CACHE_MAX_VARY 8
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* A response in wire format, status line and headers followed by the body.
+   The cache holds one reference, every response being written another, so
+   an entry evicted while it is written stays alive until the write is done.
+   The Date line at date_offset is replaced by the current one when the 
+   entry is sent, date_len is 0 if the header has none */
+typedef struct cache_entry {
+	char* key;
+	size_t key_len;
+	char* data;
+	size_t len;
+	size_t date_offset;
+	size_t date_len;
+	uint64_t expires;
+	int refs;
+	/* validators of the response, for answering conditional requests */
+	char* etag;
+	size_t etag_len;
+	time_t last_modified;
+	UT_hash_handle hh;
+} cache_entry;
+
+/* Entries are kept in least recently used order, the hash keeps the order
+   of insertion and a hit moves the entry to the end */
+typedef struct response_cache {
+	cache_entry* entries;
+	size_t size;
+	size_t max_size;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} response_cache;
+
+/* The cache options of a route */
+typedef struct cache_policy {
+	response_cache* cache;
+	int ttl_ms;
+	size_t max_entry_size;
+	int num_vary;
+	char* vary[CACHE_MAX_VARY];
+} cache_policy;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void cache_init(response_cache* cache, size_t max_size);
+cache_entry* cache_entry_new(const char* header, size_t header_len, const char* body, size_t body_len);
+cache_entry* cache_lookup(response_cache* cache, const char* key, size_t key_len, uint64_t now);
+cache_entry* cache_store(response_cache* cache, const char* key, size_t key_len, const char* header,
+	size_t header_len, const char* body, size_t body_len, uint64_t expires);
+luarest_status cache_entry_set_validators(cache_entry* entry, const char* etag, size_t etag_len, 
+	time_t last_modified);
+void cache_entry_release(cache_entry* entry);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __LUAREST_COMPRESS_H__
+#define __LUAREST_COMPRESS_H__
+
+#include "luarest.h"
+
+/* Defaults of the response compression, bodies below the minimum size 
+   aren't worth the CPU and the gzip header */
+#ifdef LUAREST_HAVE_ZLIB
+#define COMPRESS_LEVEL 6
+#else
+#define COMPRESS_LEVEL 0
+#endif
+#define COMPRESS_MIN_SIZE 1024
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* Without zlib (LUAREST_HAVE_ZLIB) responses are only sent compressed if
+   they have been compressed ahead, like the .gz siblings of static files */
+typedef enum content_encoding {
+	CONTENT_ENCODING_IDENTITY = 0,
+	CONTENT_ENCODING_GZIP = 1,
+	CONTENT_ENCODING_DEFLATE = 2
+} content_encoding;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+content_encoding compress_negotiate(const char* accept_encoding, size_t len);
+char* compress_body(content_encoding encoding, int level, const char* data, size_t len, size_t* out_len);
+
+/*-----------------------------------------------------------------------------
+ * Globals
+ *----------------------------------------------------------------------------*/
+static const char content_encoding_str[][8] = {
+	"identity",
+	"gzip",
+	"deflate"
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __LUAREST_COSOCKET_H__
+#define __LUAREST_COSOCKET_H__
+
+#include "luarest.h"
+
+#include <uv.h>
+#include <lua.h>
+
+/* Timeout of connect, send and receive unless set with sock:settimeout */
+#define COSOCKET_TIMEOUT_MS 60000
+
+/* Defaults of sock:setkeepalive, how long an idle connection is kept and
+   how many are kept per host:port */
+#define COSOCKET_KEEPALIVE_TIMEOUT_MS 60000
+#define COSOCKET_KEEPALIVE_POOL_SIZE 32
+
+/* Upper bound of "host:port" */
+#define COSOCKET_KEY_MAX 128
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+struct cosocket_pool;
+
+/* Per application state of luarest.tcp(), the connections kept alive by
+   sock:setkeepalive wait in one pool per host:port */
+typedef struct cosocket_ctx {
+	lua_State* lua_state;
+	uv_loop_t* loop;
+	struct cosocket_pool* pools;
+} cosocket_ctx;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+cosocket_ctx* luaopen_cosocket(lua_State* state, uv_loop_t* loop);
+
+#endif
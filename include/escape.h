@@ -8,5 +8,10 @@
  *----------------------------------------------------------------------------*/
 luarest_status url_escape(const char* src, char* target);
 luarest_status url_unescape(const char* src, char* target);
+size_t url_decode(const char* src, size_t len, char* target);
+bool url_decoded_equals(const char* src, size_t len, const char* s, size_t s_len);
+size_t url_count_pairs(const char* src, size_t len);
+bool url_next_pair(const char** p, const char* end, const char** key, size_t* key_len,
+	const char** value, size_t* value_len);
 
 #endif
\ No newline at end of file
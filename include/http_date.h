@@ -0,0 +1,17 @@
+#ifndef __LUAREST_HTTP_DATE_H__
+#define __LUAREST_HTTP_DATE_H__
+
+#include "luarest.h"
+
+#include <time.h>
+
+/* Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void http_date_format(time_t t, char* target);
+luarest_status http_date_parse(const char* src, size_t len, time_t* t);
+
+#endif
@@ -1,5 +1,5 @@
 #ifndef __LUAREST_H__
-#define __LUATEST_H__
+#define __LUAREST_H__
 
 #ifdef WIN32
 #include <windows.h>
@@ -21,6 +21,7 @@ typedef int bool;
  *----------------------------------------------------------------------------*/
 #define LUAREST_SUCCESS 0
 #define LUAREST_ERROR   1
+#define LUAREST_PENDING 2
 
 /*-----------------------------------------------------------------------------
  * Macros
@@ -42,4 +43,10 @@ typedef int bool;
  *----------------------------------------------------------------------------*/
 typedef int luarest_status;
 
+/* A string which is not owned and not necessarily NUL-terminated */
+typedef struct slice_t {
+	char* base;
+	size_t len;
+} slice_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef __LUAREST_FFI_H__
+#define __LUAREST_FFI_H__
+
+#include "luarest.h"
+
+#include <lua.h>
+
+struct request;
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* Shared between C and the "luarest.ffi" module, which reads the request of
+   the running service-callback and appends to the output buffer through 
+   cdata pointers. The layout is mirrored by the cdef in luarest_ffi.c. The
+   output buffer is the one of the running request, it is swapped in and out
+   whenever a service-callback is resumed or suspended */
+typedef struct ffi_context {
+	struct request* req;
+	char* out_data;
+	size_t out_len;
+	size_t out_cap;
+} ffi_context;
+
+/* The FFI output of a request while its service-callback isn't running */
+typedef struct ffi_output {
+	char* data;
+	size_t len;
+	size_t cap;
+} ffi_output;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+ffi_context* luaopen_luarest_ffi(lua_State* state);
+void ffi_swap_output(ffi_context* ctx, ffi_output* out);
+
+#endif
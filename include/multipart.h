@@ -0,0 +1,67 @@
+#ifndef __LUAREST_MULTIPART_H__
+#define __LUAREST_MULTIPART_H__
+
+#include "luarest.h"
+
+/* RFC 2046 limits a boundary to 70 characters */
+#define MULTIPART_BOUNDARY_MAX 70
+
+/* Upper bound of a header line of a part and of the name, filename and
+   content type taken from its headers */
+#define MULTIPART_HEADER_MAX 1024
+#define MULTIPART_VALUE_MAX 256
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+typedef enum multipart_state {
+	MULTIPART_PREAMBLE = 0,
+	MULTIPART_BOUNDARY_END = 1, /* after a delimiter, padding, CRLF or "--" follow */
+	MULTIPART_BOUNDARY_LF = 2,
+	MULTIPART_CLOSE_DASH = 3,
+	MULTIPART_HEADER = 4,
+	MULTIPART_HEADER_LF = 5,
+	MULTIPART_DATA = 6,
+	MULTIPART_END = 7
+} multipart_state;
+
+struct multipart_parser;
+
+/* Called as the parser makes progress, a callback returning LUAREST_ERROR
+   stops it. The data of a part may be handed out in any number of pieces */
+typedef struct multipart_callbacks {
+	luarest_status (*on_part_begin)(struct multipart_parser* parser);
+	luarest_status (*on_part_data)(struct multipart_parser* parser, const char* data, size_t len);
+	luarest_status (*on_part_end)(struct multipart_parser* parser);
+} multipart_callbacks;
+
+/* An incremental parser of a multipart/form-data body, it never buffers
+   more than a header line. name, filename and content_type describe the
+   current part from on_part_begin on, has_filename tells a file from a
+   field */
+typedef struct multipart_parser {
+	multipart_state state;
+	char delimiter[MULTIPART_BOUNDARY_MAX + 4];
+	size_t delimiter_len;
+	size_t match;
+	char header[MULTIPART_HEADER_MAX];
+	size_t header_len;
+	char name[MULTIPART_VALUE_MAX];
+	char filename[MULTIPART_VALUE_MAX];
+	char content_type[MULTIPART_VALUE_MAX];
+	bool has_filename;
+	const multipart_callbacks* callbacks;
+	void* data;
+} multipart_parser;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+luarest_status multipart_boundary(const char* content_type, size_t len, const char** boundary,
+	size_t* boundary_len);
+luarest_status multipart_init(multipart_parser* parser, const char* boundary, size_t len,
+	const multipart_callbacks* callbacks, void* data);
+luarest_status multipart_execute(multipart_parser* parser, const char* data, size_t len);
+bool multipart_complete(const multipart_parser* parser);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __LUAREST_POOL_H__
+#define __LUAREST_POOL_H__
+
+#include "luarest.h"
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* A freelist of fixed-size blocks. Pools are owned by a single worker and
+   therefore not thread-safe, blocks which are handed back while the 
+   freelist is full are returned to the system allocator. Fresh blocks of a
+   zeroed pool are cleared, those of other pools are left uninitialized */
+typedef struct pool_t {
+	size_t block_size;
+	bool zeroed;
+	int max_free;
+	int num_free;
+	void* free_list;
+	unsigned long hits;
+	unsigned long misses;
+} pool_t;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void pool_init(pool_t* pool, size_t block_size, int max_free, bool zeroed);
+void* pool_get(pool_t* pool);
+void pool_put(pool_t* pool, void* block);
+void pool_destroy(pool_t* pool);
+
+#endif
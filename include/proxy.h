@@ -0,0 +1,60 @@
+#ifndef __LUAREST_PROXY_H__
+#define __LUAREST_PROXY_H__
+
+#include "luarest.h"
+#include "app.h"
+
+#include <uv.h>
+
+/* Default timeouts of app:proxy, connecting to an upstream and waiting for
+   the next bytes of its response */
+#define PROXY_CONNECT_TIMEOUT_MS 5000
+#define PROXY_READ_TIMEOUT_MS 30000
+
+/* An upstream failing this many times in a row is ejected from the
+   round-robin for PROXY_EJECT_MS */
+#define PROXY_MAX_FAILS 3
+#define PROXY_EJECT_MS 10000
+
+/* Idle keep-alive connections kept per upstream and for how long */
+#define PROXY_KEEPALIVE_POOL_SIZE 32
+#define PROXY_KEEPALIVE_TIMEOUT_MS 60000
+
+#define PROXY_UPSTREAM_NAME_MAX 64
+#define PROXY_MAX_UPSTREAMS 16
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+struct upstream_conn;
+
+typedef struct upstream_peer {
+	char name[PROXY_UPSTREAM_NAME_MAX];
+	struct sockaddr_in address;
+	int fails;
+	uint64_t down_until;
+	struct upstream_conn* idle;
+	int num_idle;
+} upstream_peer;
+
+/* A route registered with app:proxy, requests are forwarded round-robin to
+   the peers which are not ejected. Routes belong to the worker of their 
+   loop, responses are read into buffers of its pool */
+typedef struct proxy_route {
+	uv_loop_t* loop;
+	upstream_peer* peers;
+	int num_peers;
+	int next_peer;
+	int connect_timeout_ms;
+	int read_timeout_ms;
+	pool_t buffers;
+} proxy_route;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+proxy_route* proxy_route_new(uv_loop_t* loop, const char** upstreams, int num_upstreams);
+void proxy_route_free(proxy_route* route);
+luarest_status proxy_request(proxy_route* route, request* req);
+
+#endif
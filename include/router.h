@@ -0,0 +1,56 @@
+#ifndef __LUAREST_ROUTER_H__
+#define __LUAREST_ROUTER_H__
+
+#include "luarest.h"
+
+/*-----------------------------------------------------------------------------
+ * Constants
+ *----------------------------------------------------------------------------*/
+
+/* Methods are indexed by their luarest_method value */
+#define ROUTER_MAX_METHODS 8
+#define ROUTER_MAX_PARAMS 16
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* A node of the compressed radix tree. Static children are keyed by the 
+   first byte of their prefix, a node has at most one ":param" child, which
+   captures up to the next '/', and one trailing "*" child capturing the rest */
+typedef struct router_node {
+	char* prefix;
+	size_t prefix_len;
+	struct router_node** children;
+	int num_children;
+	struct router_node* param;
+	struct router_node* wildcard;
+	char* name;
+	size_t name_len;
+	void* data;
+} router_node;
+
+typedef struct router {
+	router_node* roots[ROUTER_MAX_METHODS];
+} router;
+
+typedef struct route_param {
+	slice_t name;
+	slice_t value;
+} route_param;
+
+/* Captured parameters point into the route names and the matched path */
+typedef struct route_match {
+	int num_params;
+	route_param params[ROUTER_MAX_PARAMS];
+} route_match;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void router_init(router* r);
+luarest_status router_add(router* r, int method, const char* pattern, void* data);
+void* router_lookup(router* r, int method, const char* path, size_t len, route_match* match);
+void router_free(router* r);
+
+#endif
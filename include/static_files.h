@@ -0,0 +1,58 @@
+#ifndef __LUAREST_STATIC_FILES_H__
+#define __LUAREST_STATIC_FILES_H__
+
+#include "luarest.h"
+#include "app.h"
+
+#include <uv.h>
+
+/* Open files kept per route, the least recently used one is closed first */
+#define STATIC_CACHE_MAX 1024
+
+/* Served for a request of a directory */
+#define STATIC_INDEX "index.html"
+
+/* Upper bound of the path of a served file */
+#define STATIC_PATH_MAX 1024
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+struct static_dir;
+
+/* An open file and what fstat said about it. The route's cache holds one 
+   reference, every response sending from it another. gz is the sibling
+   precompressed with gzip, opened along with the file */
+typedef struct static_file {
+	uv_loop_t* loop;
+	char* path;
+	size_t path_len;
+	uv_file fd;
+	uint64_t size;
+	time_t mtime;
+	struct static_file* gz;
+	int refs;
+	UT_hash_handle hh;
+} static_file;
+
+/* A route registered with app:static. Cached files are dropped as soon as
+   the watch of their directory reports a change, files of a directory which 
+   can't be watched are opened for each request */
+typedef struct static_route {
+	uv_loop_t* loop;
+	char* root;
+	size_t root_len;
+	static_file* files;
+	int num_files;
+	struct static_dir* dirs;
+} static_route;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+static_route* static_route_new(uv_loop_t* loop, const char* root);
+void static_route_free(static_route* route);
+luarest_status static_request(static_route* route, request* req);
+void static_file_release(static_file* file);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __LUAREST_TIMER_WHEEL_H__
+#define __LUAREST_TIMER_WHEEL_H__
+
+#include "luarest.h"
+
+/*-----------------------------------------------------------------------------
+ * Constants
+ *----------------------------------------------------------------------------*/
+
+/* The first level covers 256 ticks, every slot of the second level covers 
+   a whole turn of the first level. Timeouts beyond the range of the second
+   level are clamped to it */
+#define TIMER_WHEEL_L0_BITS 8
+#define TIMER_WHEEL_L1_BITS 6
+#define TIMER_WHEEL_L0_SLOTS (1 << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_L1_SLOTS (1 << TIMER_WHEEL_L1_BITS)
+#define TIMER_WHEEL_MAX_TICKS ((TIMER_WHEEL_L1_SLOTS - 1) * TIMER_WHEEL_L0_SLOTS)
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+struct wheel_timer;
+
+typedef void (*wheel_timer_cb)(struct wheel_timer* timer);
+
+/* Meant to be embedded into the object it times out */
+typedef struct wheel_timer {
+	unsigned long expires;
+	wheel_timer_cb cb;
+	void* data;
+	struct wheel_timer** slot;
+	struct wheel_timer* prev;
+	struct wheel_timer* next;
+} wheel_timer;
+
+typedef struct timer_wheel {
+	unsigned long current;
+	unsigned int tick_ms;
+	wheel_timer* level0[TIMER_WHEEL_L0_SLOTS];
+	wheel_timer* level1[TIMER_WHEEL_L1_SLOTS];
+} timer_wheel;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+void timer_wheel_init(timer_wheel* wheel, unsigned int tick_ms);
+void wheel_timer_init(wheel_timer* timer, wheel_timer_cb cb, void* data);
+void timer_wheel_add(timer_wheel* wheel, wheel_timer* timer, unsigned int timeout_ms);
+void timer_wheel_remove(timer_wheel* wheel, wheel_timer* timer);
+void timer_wheel_advance(timer_wheel* wheel, unsigned long ticks);
+
+#endif
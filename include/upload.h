@@ -0,0 +1,68 @@
+#ifndef __LUAREST_UPLOAD_H__
+#define __LUAREST_UPLOAD_H__
+
+#include "luarest.h"
+#include "multipart.h"
+
+#include <uv.h>
+
+/* File parts are written in buffers of this size, a connection stops
+   reading while UPLOAD_MAX_WRITES of them are in flight */
+#define UPLOAD_BUFFER_SIZE (64 * 1024)
+#define UPLOAD_MAX_WRITES 4
+
+/* Upper bound of the fields of a form, which are kept in memory */
+#define UPLOAD_FIELDS_MAX (64 * 1024)
+
+#define UPLOAD_PATH_MAX 1024
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+/* A part of a multipart/form-data body. A file part is spooled to path,
+   a field keeps its value in memory. size is the length of either */
+typedef struct upload_part {
+	char* name;
+	char* filename;
+	char* content_type;
+	char* path;
+	char* value;
+	size_t size;
+	uv_file fd;
+	int writes;
+	bool ended;
+	struct upload_part* next;
+} upload_part;
+
+struct upload_write;
+
+/* The body of a request to an upload route, written to disk on the
+   threadpool while it arrives. on_write is called whenever a write has
+   completed, until the upload is released */
+typedef struct upload {
+	uv_loop_t* loop;
+	const char* dir;
+	multipart_parser parser;
+	upload_part* parts;
+	upload_part* last;
+	size_t fields_size;
+	struct upload_write* current;
+	struct upload_write* spare;
+	int writes;
+	bool failed;
+	bool released;
+	void (*on_write)(struct upload* upload);
+	void* data;
+} upload;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+upload* upload_new(uv_loop_t* loop, const char* dir, const char* content_type, size_t len,
+	void (*on_write)(upload* upload), void* data);
+luarest_status upload_feed(upload* upload, const char* data, size_t len);
+luarest_status upload_finish(upload* upload);
+bool upload_congested(const upload* upload);
+void upload_release(upload* upload);
+
+#endif
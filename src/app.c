@@ -8,13 +8,21 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
+#define TEXT(s) s
 #endif
 
+#include <ctype.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "app.h"
+#include "escape.h"
+#include "cosocket.h"
+#include "proxy.h"
+#include "http_date.h"
+#include "static_files.h"
+#include "upload.h"
 
 #define LUA_ENUM(L, name, val) \
   lua_pushlstring(L, #name, sizeof(#name)-1); \
@@ -22,12 +30,73 @@
   lua_settable(L, -3);
 
 #define LUA_USERDATA_APPLICATION "luarest.application"
+#define LUA_USERDATA_HEADERS "luarest.headers"
+#define LUA_USERDATA_PARAMS "luarest.params"
+#define LUA_USERDATA_BODY "luarest.body"
+#define LUA_USERDATA_RESPONSE "luarest.response"
+#define LUA_REGISTRY_APPLICATION "luarest.app"
+
+/* Headers, params, body and response proxies sit at the bottom of the
+   coroutine's stack, the results of the service-callback follow them */
+#define REQUEST_PROXIES 4
+
+/* Identical requests to a coalescing route which arrive while the first of
+   them (the leader) runs its callback wait on its flight and get the same 
+   response */
+typedef struct flight {
+	char* key;
+	size_t key_len;
+	request* leader;
+	request* waiters;
+	application* app;
+	service* service;
+	UT_hash_handle hh;
+} flight;
+
+/* Headers, params, body and response are handed to a callback as proxies 
+   which only look at the request when they are used. The request is detached
+   from the proxies once the callback returned. values tells whether the 
+   environment of the proxy is its own table of the values read so far */
+typedef struct request_proxy {
+	request* req;
+	bool values;
+} request_proxy;
 
 /* forward decls */
 static int l_register(lua_State* state);
+static int l_cache_stats(lua_State* state);
+static int l_proxy(lua_State* state);
+static int l_static(lua_State* state);
+static int l_sleep(lua_State* state);
+static int l_form(lua_State* state);
+static int l_response_start(lua_State* state);
+static int l_response_write(lua_State* state);
+static int l_response_finish(lua_State* state);
+static int l_response_etag(lua_State* state);
+static int l_response_last_modified(lua_State* state);
+static int l_response_header(lua_State* state);
 
 static const struct luaL_Reg l_application [] = {
 	{"register", l_register},
+	{"proxy", l_proxy},
+	{"static", l_static},
+	{NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg l_luarest [] = {
+	{"sleep", l_sleep},
+	{"cache_stats", l_cache_stats},
+	{"form", l_form},
+	{NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg l_response [] = {
+	{"start", l_response_start},
+	{"write", l_response_write},
+	{"finish", l_response_finish},
+	{"etag", l_response_etag},
+	{"last_modified", l_response_last_modified},
+	{"header", l_response_header},
 	{NULL, NULL} /* sentinel */
 };
 
@@ -64,39 +133,27 @@ static void stackDump(lua_State *L)
     printf("\n");
 }
 /**
- *
+ * Accepts a luarest.HTTP_RESPONSE_* value or the status code itself. An
+ * informational status can't be the final response
  *
  */
 static luarest_status map_response(luarest_response* lr, int res)
 {
-	switch (res) {
-		case 1:
-			*lr = HTTP_RESPONSE_OK;
-			break;
-		case 2:
-			*lr = HTTP_RESPONSE_CREATED;
-			break;
-		case 3:
-			*lr = HTTP_RESPONSE_NO_CONTENT;
-			break;
-		case 4:
-			*lr = HTTP_RESPONSE_NOT_ACCEPTABLE;
-			break;
-		case 5:
-			*lr = HTTP_RESPONSE_NOT_MODIFIED;
-			break;
-		case 6:
-			*lr = HTTP_RESPONSE_SEE_OTHER;
-			break;
-		case 7:
-			*lr = HTTP_RESPONSE_SERVER_ERROR;
-			break;
-		case 8:
-			*lr = HTTP_RESPONSE_TEMPORARY_REDIRECT;
-			break;
-		default:
+	size_t i;
+
+	if (res > 0 && res < (int)LUAREST_NUM_RESPONSES) {
+		i = (size_t)res;
+	}
+	else {
+		for (i = 1; i < LUAREST_NUM_RESPONSES && atoi(luarest_response_str[i]) != res; i++);
+		if (i == LUAREST_NUM_RESPONSES) {
 			return(LUAREST_ERROR);
+		}
+	}
+	if (i == HTTP_RESPONSE_CONTINUE || i == HTTP_RESPONSE_SWITCHING_PROTOCOLS) {
+		return(LUAREST_ERROR);
 	}
+	*lr = (luarest_response)i;
 	return(LUAREST_SUCCESS);
 }
 /**
@@ -120,9 +177,172 @@ static luarest_status map_contype(luarest_content_type *ct, int type)
 	}
 	return(LUAREST_SUCCESS);
 }
+/**
+ * Field-value characters, which keeps a header value on its line
+ *
+ */
+static bool valid_header_value(const char* value, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (((unsigned char)value[i] < 0x20 && value[i] != '\t') || value[i] == 0x7f) {
+			return(false);
+		}
+	}
+	return(true);
+}
+/**
+ * Keeps a copy of a media type in the request's arena, it overrides the
+ * content type of the response
+ *
+ */
+static luarest_status set_mime_type(request* req, const char* mime, size_t len)
+{
+	char* copy;
+
+	if (len == 0 || len > RESPONSE_MIME_MAX || !valid_header_value(mime, len)) {
+		return(LUAREST_ERROR);
+	}
+	copy = (char*)arena_alloc(req->arena, len + 1);
+	if (copy == NULL) {
+		return(LUAREST_ERROR);
+	}
+	memcpy(copy, mime, len);
+	copy[len] = '\0';
+	req->mime = copy;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Accepts a luarest.CONTENT_TYPE_* value or any media type as a string
+ *
+ */
+static luarest_status map_content_type(request* req, lua_State* state, int index)
+{
+	const char* mime;
+	size_t len;
+
+	if (lua_type(state, index) == LUA_TSTRING) {
+		mime = lua_tolstring(state, index, &len);
+		return(set_mime_type(req, mime, len));
+	}
+	return(map_contype(&req->con_type, (int)lua_tointeger(state, index)));
+}
+/**
+ * Collects the header names of the vary list of the table at index, they 
+ * stay valid while the list is left on the stack
+ *
+ */
+static int check_vary(lua_State* state, int index, const char** names)
+{
+	int num = 0;
+	int i;
+
+	lua_getfield(state, index, "vary");
+	if (lua_istable(state, -1)) {
+		for (i = 1; ; i++) {
+			lua_rawgeti(state, -1, i);
+			if (lua_isnil(state, -1)) {
+				lua_pop(state, 1);
+				break;
+			}
+			luaL_argcheck(state, num < CACHE_MAX_VARY, 5, "too many vary headers");
+			luaL_argcheck(state, lua_type(state, -1) == LUA_TSTRING, 5, "vary headers have to be strings");
+			names[num++] = lua_tostring(state, -1);
+			lua_pop(state, 1);
+		}
+	}
+	return(num);
+}
+/**
+ * Reads the cache options of a route from the table at index, they are
+ * validated before anything is allocated since errors don't return
+ *
+ */
+static cache_policy* check_cache_policy(lua_State* state, application* app, int index)
+{
+	cache_policy* policy;
+	const char* vary[CACHE_MAX_VARY];
+	int num_vary;
+	int ttl_ms;
+	size_t max_entry_size;
+	int i;
+
+	lua_getfield(state, index, "ttl");
+	ttl_ms = luaL_checkint(state, -1);
+	lua_getfield(state, index, "max_size");
+	max_entry_size = (size_t)luaL_optinteger(state, -1, CACHE_MAX_ENTRY_SIZE);
+	lua_pop(state, 2);
+	luaL_argcheck(state, ttl_ms > 0, 5, "cache ttl must be positive");
+	num_vary = check_vary(state, index, vary);
+
+	policy = (cache_policy*)calloc(1, sizeof(cache_policy));
+	if (policy == NULL) {
+		luaL_error(state, "out of memory");
+	}
+	policy->cache = &app->cache;
+	policy->ttl_ms = ttl_ms;
+	policy->max_entry_size = max_entry_size;
+	for (i = 0; i < num_vary; i++) {
+		policy->vary[i] = (char*)malloc(strlen(vary[i]) + 1);
+		strcpy(policy->vary[i], vary[i]);
+	}
+	policy->num_vary = num_vary;
+	lua_pop(state, 1);
+	return(policy);
+}
+/**
+ *
+ *
+ */
+static void free_cache_policy(cache_policy* policy)
+{
+	int i;
+
+	if (policy == NULL) {
+		return;
+	}
+	for (i = 0; i < policy->num_vary; i++) {
+		free(policy->vary[i]);
+	}
+	free(policy);
+}
+/**
+ * Copies the header names of a coalescing route's vary list
+ *
+ */
+static coalesce_policy* new_coalesce_policy(const char** vary, int num_vary)
+{
+	coalesce_policy* policy = (coalesce_policy*)calloc(1, sizeof(coalesce_policy));
+	int i;
+
+	if (policy == NULL) {
+		return(NULL);
+	}
+	for (i = 0; i < num_vary; i++) {
+		policy->vary[i] = (char*)malloc(strlen(vary[i]) + 1);
+		strcpy(policy->vary[i], vary[i]);
+	}
+	policy->num_vary = num_vary;
+	return(policy);
+}
 /**
  * LUA syntax: application.register(method, url, callback)
  *
+ * The url may contain ":name" segments and end with "*", the captured 
+ * values are passed to the callback in its params table. options.cache 
+ * caches the responses of the route: { ttl = ms, vary = { header names },
+ * max_size = bytes }. With options.coalesce = { vary = { header names } } 
+ * identical requests arriving while the callback runs wait for its response
+ * instead of running it too, requests are identical if they agree on the 
+ * headers of both vary lists. Requests with an Authorization or Cookie 
+ * header which isn't in a vary list are neither answered from the cache nor
+ * coalesced, responses setting a cookie or a private or no-store 
+ * Cache-Control are neither cached nor shared.
+ * options.max_body overrides the server's limit of the request body in bytes.
+ * With options.upload a multipart/form-data body is spooled to disk and the
+ * callback gets a table of its parts instead of the body
+ *
  * Return: boolean true on success
  *
  */
@@ -132,184 +352,1208 @@ static int l_register(lua_State* state)
 	application* a = (application*)luaL_checkudata(state, 1, LUA_USERDATA_APPLICATION);
 	int method = luaL_checkint(state, 2);
 	const char* url = luaL_checkstring(state, 3);
-	int ref = luaL_ref(state, LUA_REGISTRYINDEX);
+	cache_policy* cache = NULL;
+	coalesce_policy* coalesce = NULL;
+	const char* coalesce_vary[CACHE_MAX_VARY];
+	int num_coalesce_vary = -1;
+	size_t max_body = 0;
+	bool upload = false;
+	int ref;
+	int i;
 
-	s = (service*)malloc(sizeof(service));
-	utstring_new(s->key);
-	utstring_printf(s->key, "M%d#P%s", method, url);
-	switch (method)
-	{
-		case 1:
-			s->method = HTTP_METHOD_GET;
-			break;
-		case 2:
-			s->method = HTTP_METHOD_POST;
-			break;
-		case 3:
-			s->method = HTTP_METHOD_PUT;
-			break;
-		case 4:
-			s->method = HTTP_METHOD_DELETE;
-			break;
-		case 5:
-			s->method = HTTP_METHOD_OPTION;
-			break;
-		case 6:
-			s->method = HTTP_METHOD_HEAD;
-			break;
+	luaL_checktype(state, 4, LUA_TFUNCTION);
+	luaL_argcheck(state, method >= HTTP_METHOD_GET && method <= HTTP_METHOD_HEAD, 2, "unknown method");
+	if (lua_istable(state, 5)) {
+		lua_getfield(state, 5, "coalesce");
+		if (!lua_isnil(state, -1)) {
+			/* sharing a response is only safe for requests which agree on the
+			   headers the response depends on, they have to be named */
+			luaL_argcheck(state, lua_istable(state, -1), 5, "coalesce has to be { vary = { header names } }");
+			lua_getfield(state, -1, "vary");
+			luaL_argcheck(state, lua_istable(state, -1), 5, "coalesce has to be { vary = { header names } }");
+			lua_pop(state, 1);
+			/* the names stay on the stack until they are copied */
+			num_coalesce_vary = check_vary(state, lua_gettop(state), coalesce_vary);
+		}
+		lua_getfield(state, 5, "max_body");
+		luaL_argcheck(state, lua_isnil(state, -1) || lua_tointeger(state, -1) > 0, 5, "invalid max_body");
+		max_body = (size_t)lua_tointeger(state, -1);
+		lua_getfield(state, 5, "upload");
+		upload = lua_toboolean(state, -1);
+		/* last, nothing raises an error once the policy is allocated */
+		lua_getfield(state, 5, "cache");
+		if (lua_istable(state, -1)) {
+			cache = check_cache_policy(state, a, lua_gettop(state));
+		}
+		if (num_coalesce_vary >= 0) {
+			coalesce = new_coalesce_policy(coalesce_vary, num_coalesce_vary);
+		}
 	}
+	lua_settop(state, 4);
+	ref = luaL_ref(state, LUA_REGISTRYINDEX);
+
+	s = (service*)malloc(sizeof(service));
+	s->method = (luarest_method)method;
 	utstring_new(s->path);
-	utstring_printf(s->path, url);
+	utstring_printf(s->path, "%s", url);
 	s->callback_ref = ref;
-	HASH_ADD_KEYPTR(hh, a->s, utstring_body(s->key), utstring_len(s->key), s);
+	s->proxy = NULL;
+	s->files = NULL;
+	s->cache = cache;
+	s->coalesce = coalesce;
+	s->max_body = max_body;
+	s->upload = upload;
+	if (router_add(&a->routes, method, url, s) != LUAREST_SUCCESS) {
+		luaL_unref(state, LUA_REGISTRYINDEX, ref);
+		utstring_free(s->path);
+		free_cache_policy(s->cache);
+		if (s->coalesce != NULL) {
+			for (i = 0; i < s->coalesce->num_vary; i++) {
+				free(s->coalesce->vary[i]);
+			}
+			free(s->coalesce);
+		}
+		free(s);
+		return(luaL_error(state, "route %s is already registered or invalid", url));
+	}
 
+	lua_pushboolean(state, 1);
 	return(1);
 }
 /**
+ * LUA syntax: application.proxy(method, prefix, upstreams[, options])
+ *
+ * Forwards requests below prefix to upstreams, a "a.b.c.d:port" string or 
+ * a table of them which are used round-robin. The path below the 
+ * application is sent upstream and the response is relayed without 
+ * entering Lua. options may set connect_timeout and read_timeout in ms
  *
+ * Return: boolean true on success
  *
  */
-static int luaopen_luarestlibs(lua_State *state)
+static int l_proxy(lua_State* state)
 {
-	lua_newtable(state);
-	lua_setglobal(state, "luarest");
-	lua_getglobal(state, "luarest");
-	{
-		int i = 1;
-		
-		/* register HTTP_METHODS */
-		LUA_ENUM(state, HTTP_METHOD_GET, i++);
-		LUA_ENUM(state, HTTP_METHOD_POST, i++);
-		LUA_ENUM(state, HTTP_METHOD_PUT, i++);
-		LUA_ENUM(state, HTTP_METHOD_DELETE, i++);
-		LUA_ENUM(state, HTTP_METHOD_OPTION, i++);
-		LUA_ENUM(state, HTTP_METHOD_HEAD, i++);
+	application* a = (application*)luaL_checkudata(state, 1, LUA_USERDATA_APPLICATION);
+	int method = luaL_checkint(state, 2);
+	size_t len;
+	const char* prefix = luaL_checklstring(state, 3, &len);
+	const char* upstreams[PROXY_MAX_UPSTREAMS];
+	int num_upstreams = 0;
+	int connect_timeout = PROXY_CONNECT_TIMEOUT_MS;
+	int read_timeout = PROXY_READ_TIMEOUT_MS;
+	proxy_route* route;
+	service* s[2];
+	UT_string* pattern;
+	int i;
 
-		/* register HTTP_RESPONSE */
-		i = 1;
-		LUA_ENUM(state, HTTP_RESPONSE_OK, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_CREATED, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_NO_CONTENT, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_NOT_ACCEPTABLE, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_NOT_MODIFIED, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_SEE_OTHER, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_SERVER_ERROR, i++);
-		LUA_ENUM(state, HTTP_RESPONSE_TEMPORARY_REDIRECT, i++);
+	luaL_argcheck(state, method >= HTTP_METHOD_GET && method <= HTTP_METHOD_HEAD, 2, "unknown method");
+	luaL_argcheck(state, len > 0 && prefix[0] == '/', 3, "prefix has to start with /");
+	if (lua_istable(state, 5)) {
+		lua_getfield(state, 5, "connect_timeout");
+		connect_timeout = luaL_optint(state, -1, PROXY_CONNECT_TIMEOUT_MS);
+		lua_getfield(state, 5, "read_timeout");
+		read_timeout = luaL_optint(state, -1, PROXY_READ_TIMEOUT_MS);
+		lua_pop(state, 2);
+	}
+	if (lua_istable(state, 4)) {
+		for (i = 1; num_upstreams < PROXY_MAX_UPSTREAMS; i++) {
+			lua_rawgeti(state, 4, i);
+			if (lua_isnil(state, -1)) {
+				lua_pop(state, 1);
+				break;
+			}
+			upstreams[num_upstreams++] = luaL_checkstring(state, -1);
+			lua_pop(state, 1);
+		}
+	}
+	else {
+		upstreams[num_upstreams++] = luaL_checkstring(state, 4);
+	}
 
-		i = 1;
-		LUA_ENUM(state, CONTENT_TYPE_PLAIN, i++);
-		LUA_ENUM(state, CONTENT_TYPE_HTML, i++);
-		LUA_ENUM(state, CONTENT_TYPE_JSON, i++);
+	/* last, only a failed router_add raises an error once the route is allocated */
+	route = proxy_route_new(a->loop, upstreams, num_upstreams);
+	if (route == NULL) {
+		return(luaL_argerror(state, 4, "expected upstreams like \"127.0.0.1:9000\""));
+	}
+	route->connect_timeout_ms = connect_timeout;
+	route->read_timeout_ms = read_timeout;
+
+	/* the prefix itself and everything below it */
+	if (prefix[len - 1] == '/') {
+		len--;
+	}
+	for (i = 0; i < 2; i++) {
+		utstring_new(pattern);
+		utstring_bincpy(pattern, prefix, len);
+		if (i == 1 || len == 0) {
+			utstring_printf(pattern, "/*");
+		}
+		s[i] = (service*)malloc(sizeof(service));
+		s[i]->method = (luarest_method)method;
+		s[i]->path = pattern;
+		s[i]->callback_ref = LUA_NOREF;
+		s[i]->proxy = route;
+		s[i]->files = NULL;
+		s[i]->cache = NULL;
+		s[i]->coalesce = NULL;
+		s[i]->max_body = 0;
+		s[i]->upload = false;
+		if (router_add(&a->routes, method, utstring_body(pattern), s[i]) != LUAREST_SUCCESS) {
+			lua_pushfstring(state, "route %s is already registered or invalid", utstring_body(pattern));
+			utstring_free(pattern);
+			free(s[i]);
+			if (i == 0) {
+				/* no registered service refers to the route yet */
+				proxy_route_free(route);
+			}
+			return(lua_error(state));
+		}
+		if (len == 0) {
+			break;
+		}
 	}
-	
-	luaL_newmetatable(state, LUA_USERDATA_APPLICATION);
-	lua_pushvalue(state, -1);
-	lua_setfield(state, -2, "__index");
-	luaL_register(state, NULL, l_application);
 
+	lua_pushboolean(state, 1);
 	return(1);
 }
 /**
+ * LUA syntax: application.static(prefix, dir)
+ *
+ * Serves the files below dir, relative to the application's directory 
+ * unless it is absolute, for GET and HEAD requests below prefix without 
+ * entering Lua. A request of a directory gets its index.html
  *
+ * Return: boolean true on success
  *
  */
-static luarest_status invoke_lua(lua_State* state, int ref_cb, luarest_response* res_code, 
-	luarest_content_type* con_type, UT_string* res_buf)
+static int l_static(lua_State* state)
 {
-	lua_rawgeti(state, LUA_REGISTRYINDEX, ref_cb);
-	lua_pushnil(state);
-	lua_pushnil(state);
-	lua_pushnil(state);
-	if (lua_pcall(state, 3, 3, 0) != 0) {
-		printf("Error calling service-callback: %s\n!", lua_tostring(state, -1));
-		return(LUAREST_ERROR);
+	application* a = (application*)luaL_checkudata(state, 1, LUA_USERDATA_APPLICATION);
+	size_t len;
+	const char* prefix = luaL_checklstring(state, 2, &len);
+	const char* dir = luaL_checkstring(state, 3);
+	static_route* route;
+	service* s;
+	UT_string* root;
+	UT_string* pattern;
+	static const luarest_method methods[] = { HTTP_METHOD_GET, HTTP_METHOD_HEAD };
+	int num_added = 0;
+	int i;
+	int j;
+
+	luaL_argcheck(state, len > 0 && prefix[0] == '/', 2, "prefix has to start with /");
+	utstring_new(root);
+#ifdef WIN32
+	if (dir[0] != '\\' && dir[0] != '/' && (dir[0] == '\0' || dir[1] != ':')) {
+#else
+	if (dir[0] != '/') {
+#endif
+		utstring_printf(root, "%s/", utstring_body(a->dir));
 	}
-	map_response(res_code, luaL_checkint(state, -3));
-	map_contype(con_type, luaL_checkint(state, -2));
-	utstring_printf(res_buf, luaL_checkstring(state, -1));
-	lua_pop(state, 3);
-	return(LUAREST_SUCCESS);
+	utstring_printf(root, "%s", dir);
+	route = static_route_new(a->loop, utstring_body(root));
+	utstring_free(root);
+	if (route == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+
+	/* the prefix itself and everything below it */
+	if (prefix[len - 1] == '/') {
+		len--;
+	}
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < 2; i++) {
+			utstring_new(pattern);
+			utstring_bincpy(pattern, prefix, len);
+			if (i == 1 || len == 0) {
+				utstring_printf(pattern, "/*");
+			}
+			s = (service*)malloc(sizeof(service));
+			s->method = methods[j];
+			s->path = pattern;
+			s->callback_ref = LUA_NOREF;
+			s->proxy = NULL;
+			s->files = route;
+			s->cache = NULL;
+			s->coalesce = NULL;
+			s->max_body = 0;
+			s->upload = false;
+			if (router_add(&a->routes, methods[j], utstring_body(pattern), s) != LUAREST_SUCCESS) {
+				lua_pushfstring(state, "route %s is already registered or invalid", utstring_body(pattern));
+				utstring_free(pattern);
+				free(s);
+				if (num_added == 0) {
+					/* no registered service refers to the route yet */
+					static_route_free(route);
+				}
+				return(lua_error(state));
+			}
+			num_added++;
+			if (len == 0) {
+				break;
+			}
+		}
+	}
+
+	lua_pushboolean(state, 1);
+	return(1);
 }
 /**
  *
  *
  */
-static luarest_status verify_application(application** apps, const char* appName, UT_string* path)
+static request* check_request(lua_State* state, const char* type)
 {
-	int ret;
-	lua_State* ls = luaL_newstate();
-	application* app;
-	
-	luaL_openlibs(ls);
-	luaopen_luarestlibs(ls);
-        
-    ret = luaL_loadfile(ls, utstring_body(path));
-    if (ret != 0) {
-		printf("Couldn't load file: %s\n", lua_tostring(ls, -1));
-		lua_close(ls);
-		return(LUAREST_ERROR);
-    }
-	ret = lua_pcall(ls, 0, 0, 0);
-    if (ret != 0) {
-        printf("Couldn't execute LUA Script %s\n", lua_tostring(ls, -1));
-		lua_close(ls);
-		return(LUAREST_ERROR);
-    }
-	lua_getglobal(ls, "luarest_init");
-    if (lua_isfunction(ls, -1) == 0) {
-		printf("Couln'd find 'luarest_init' table in LUA script!\n");
-		lua_close(ls);
-		return(LUAREST_ERROR);
+	request_proxy* proxy = (request_proxy*)luaL_checkudata(state, 1, type);
+
+	if (proxy->req == NULL) {
+		luaL_error(state, "request data is only valid while the service-callback runs");
 	}
-	app = (application*)lua_newuserdata(ls, sizeof(application));
-	luaL_getmetatable(ls, LUA_USERDATA_APPLICATION);
-	lua_setmetatable(ls, -2);
-	app->s = NULL;
-	utstring_new(app->name);
-	utstring_printf(app->name, appName);
-	if (lua_pcall(ls, 1, 0, 0) != 0) {
-		printf("Error calling luarest_init: %s\n!", lua_tostring(ls, -1));
-		lua_close(ls);
-		return(LUAREST_ERROR);
+	return(proxy->req);
+}
+/**
+ *
+ *
+ */
+static bool field_equals(const slice_t* field, const char* name, size_t len)
+{
+	size_t i;
+
+	if (field->len != len) {
+		return(false);
 	}
-	app->lua_state = ls;
-	HASH_ADD_KEYPTR(hh, *apps, utstring_body(app->name), utstring_len(app->name), app);
-	return(LUAREST_SUCCESS);
+	for (i = 0; i < len; i++) {
+		if (tolower((unsigned char)field->base[i]) != tolower((unsigned char)name[i])) {
+			return(false);
+		}
+	}
+	return(true);
 }
 /**
+ * LUA syntax: headers[name]
  *
+ * Return: the value of the header, names are compared case-insensitive
  *
  */
-static luarest_status parse_apps(application** apps, char* directory_path)
+static int l_headers_index(lua_State* state)
 {
-#ifdef WIN32
-	WIN32_FIND_DATA ffd;
-	WIN32_FIND_DATA fap;
-	size_t length_of_arg;
-	TCHAR szDir[MAX_PATH];
-	TCHAR appFile[MAX_PATH];
-	HANDLE hFind = INVALID_HANDLE_VALUE;
-	HANDLE hApp = INVALID_HANDLE_VALUE;
-	luarest_status ret;
-	// Check that the input path plus 2 is not longer than MAX_PATH.
-	StringCchLength(directory_path, MAX_PATH, &length_of_arg);
-	if (length_of_arg > (MAX_PATH - 2)) {
-		_tprintf(TEXT("\nDirectory path is too long.\n"));
-		return(LUAREST_ERROR);
+	request* req = check_request(state, LUA_USERDATA_HEADERS);
+	size_t len;
+	const char* name = luaL_checklstring(state, 2, &len);
+	const slice_t* value = request_header(req, name, len);
+
+	if (value != NULL) {
+		lua_pushlstring(state, value->base, value->len);
 	}
-	// Prepare string for use with FindFile functions.  First, copy the
-	// string to a buffer, then append '\*' to the directory name.
-	StringCchCopy(szDir, MAX_PATH, directory_path);
-	StringCchCat(szDir, MAX_PATH, TEXT("\\*"));
-	// Find the first file in the directory.
-	hFind = FindFirstFile(szDir, &ffd);
-	if (INVALID_HANDLE_VALUE == hFind) {
-      return(LUAREST_ERROR);
+	else {
+		lua_pushnil(state);
 	}
-	// List all the files in the directory with some info about them.
-	do {
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			StringCchCopy(appFile, MAX_PATH, directory_path);
+	return(1);
+}
+/**
+ * LUA syntax: params[name]
+ *
+ * Return: the captured path parameter or the unescaped query parameter,
+ * query keys are compared unescaped. A query value is decoded the first 
+ * time it is read and kept in the proxy's environment
+ *
+ */
+static int l_params_index(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_PARAMS);
+	request_proxy* proxy = (request_proxy*)lua_touserdata(state, 1);
+	size_t len;
+	const char* name = luaL_checklstring(state, 2, &len);
+	const char* p = req->query.base;
+	const char* end = p + req->query.len;
+	const char* key;
+	const char* value;
+	size_t key_len;
+	size_t value_len;
+	char* decoded;
+	int i;
+
+	for (i = 0; i < req->match.num_params; i++) {
+		if (req->match.params[i].name.len == len && memcmp(req->match.params[i].name.base, name, len) == 0) {
+			lua_pushlstring(state, req->match.params[i].value.base, req->match.params[i].value.len);
+			return(1);
+		}
+	}
+	if (proxy->values) {
+		lua_getfenv(state, 1);
+		lua_pushvalue(state, 2);
+		lua_rawget(state, -2);
+		if (!lua_isnil(state, -1)) {
+			return(1);
+		}
+		lua_settop(state, 2);
+	}
+	while (url_next_pair(&p, end, &key, &key_len, &value, &value_len)) {
+		if (!url_decoded_equals(key, key_len, name, len)) {
+			continue;
+		}
+		/* the query stays as it is, the value is decoded into a copy which
+		   goes away with the request */
+		decoded = (char*)arena_alloc(req->arena, value_len + 1);
+		if (decoded == NULL) {
+			return(luaL_error(state, "out of memory"));
+		}
+		if (!proxy->values) {
+			lua_newtable(state);
+			lua_setfenv(state, 1);
+			proxy->values = true;
+		}
+		lua_getfenv(state, 1);
+		lua_pushvalue(state, 2);
+		lua_pushlstring(state, decoded, url_decode(value, value_len, decoded));
+		lua_pushvalue(state, -1);
+		lua_insert(state, -4);
+		lua_rawset(state, -3);
+		lua_pop(state, 1);
+		return(1);
+	}
+	lua_pushnil(state);
+	return(1);
+}
+/**
+ * LUA syntax: tostring(body)
+ *
+ */
+static int l_body_tostring(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_BODY);
+
+	lua_pushlstring(state, req->body.base, req->body.len);
+	return(1);
+}
+/**
+ * LUA syntax: #body
+ *
+ */
+static int l_body_len(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_BODY);
+
+	lua_pushinteger(state, req->body.len);
+	return(1);
+}
+/**
+ * Pushes a table of the pairs of a form-urlencoded string, the values of a
+ * key which occurs more than once are collected in an array. scratch takes
+ * the decoded keys and values and has to hold len bytes
+ *
+ */
+static void push_form(lua_State* state, const char* data, size_t len, char* scratch)
+{
+	const char* p = data;
+	const char* end = data + len;
+	const char* key;
+	const char* value;
+	size_t key_len;
+	size_t value_len;
+	size_t n;
+
+	lua_createtable(state, 0, (int)url_count_pairs(data, len));
+	while (url_next_pair(&p, end, &key, &key_len, &value, &value_len)) {
+		n = url_decode(key, key_len, scratch);
+		lua_pushlstring(state, scratch, n);
+		n = url_decode(value, value_len, scratch);
+		lua_pushvalue(state, -1);
+		lua_rawget(state, -3);
+		if (lua_isnil(state, -1)) {
+			lua_pop(state, 1);
+			lua_pushlstring(state, scratch, n);
+			lua_rawset(state, -3);
+		}
+		else if (lua_istable(state, -1)) {
+			lua_pushlstring(state, scratch, n);
+			lua_rawseti(state, -2, (int)lua_objlen(state, -2) + 1);
+			lua_pop(state, 2);
+		}
+		else {
+			/* a repeated key, its value becomes the first of an array */
+			lua_createtable(state, 2, 0);
+			lua_insert(state, -2);
+			lua_rawseti(state, -2, 1);
+			lua_pushlstring(state, scratch, n);
+			lua_rawseti(state, -2, 2);
+			lua_rawset(state, -3);
+		}
+	}
+}
+/**
+ * Whether the value at index is a proxy of the given type
+ *
+ */
+static bool is_proxy(lua_State* state, int index, const char* type)
+{
+	bool equal;
+
+	if (!lua_getmetatable(state, index)) {
+		return(false);
+	}
+	luaL_getmetatable(state, type);
+	equal = lua_rawequal(state, -1, -2) != 0;
+	lua_pop(state, 2);
+	return(equal);
+}
+/**
+ * LUA syntax: luarest.form(body | params | string)
+ *
+ * Return: table of the pairs of a form-urlencoded body, the query string of
+ * the request or a string, keys which occur more than once map to an array
+ *
+ */
+static int l_form(lua_State* state)
+{
+	request* req;
+	const slice_t* data;
+	const char* s;
+	size_t len;
+	char* scratch;
+
+	if (lua_type(state, 1) == LUA_TSTRING) {
+		s = lua_tolstring(state, 1, &len);
+		scratch = (char*)lua_newuserdata(state, len);
+		push_form(state, s, len, scratch);
+		return(1);
+	}
+	if (is_proxy(state, 1, LUA_USERDATA_BODY)) {
+		req = check_request(state, LUA_USERDATA_BODY);
+		data = &req->body;
+	}
+	else {
+		luaL_argcheck(state, is_proxy(state, 1, LUA_USERDATA_PARAMS), 1, "body, params or string expected");
+		req = check_request(state, LUA_USERDATA_PARAMS);
+		data = &req->query;
+	}
+	scratch = data->len > 0 ? (char*)arena_alloc(req->arena, data->len) : NULL;
+	if (data->len > 0 && scratch == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+	push_form(state, data->base, data->len, scratch);
+	return(1);
+}
+/**
+ * Sends the status line and headers of a streamed response
+ *
+ */
+static void start_stream(request* req)
+{
+	req->streaming = true;
+	req->ops->stream_start(req);
+}
+/**
+ * LUA syntax: res:start([response[, content_type]])
+ *
+ * The response is a luarest.HTTP_RESPONSE_* value or a status code, the
+ * content type a luarest.CONTENT_TYPE_* value or a media type.
+ * Starts a streamed response, the body is sent in chunks by res:write. 
+ * Calling it is optional, the first res:write starts the response with
+ * HTTP_RESPONSE_OK and CONTENT_TYPE_PLAIN
+ *
+ */
+static int l_response_start(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+
+	if (req->streaming) {
+		return(luaL_error(state, "response already started"));
+	}
+	if (map_response(&req->res_code, luaL_optint(state, 2, HTTP_RESPONSE_OK)) != LUAREST_SUCCESS ||
+		(!lua_isnoneornil(state, 3) && map_content_type(req, state, 3) != LUAREST_SUCCESS)) {
+		return(luaL_error(state, "invalid response or content type"));
+	}
+	start_stream(req);
+	return(0);
+}
+/**
+ * The connection's write queue drained below its low-water mark
+ *
+ */
+static void resume_stream(request* req)
+{
+	resume_application(req, 0);
+}
+/**
+ * LUA syntax: res:write(chunk)
+ *
+ * Sends chunk without copying it, the string is pinned until it has been
+ * written to the socket. While the connection's write queue is above its 
+ * high-water mark the service-callback is suspended
+ *
+ */
+static int l_response_write(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+	response_body chunk;
+
+	luaL_checkstring(state, 2);
+	if (req->stream_finished) {
+		return(luaL_error(state, "response already finished"));
+	}
+	if (!req->streaming) {
+		start_stream(req);
+	}
+	if (lua_objlen(state, 2) > 0) {
+		lua_pushvalue(state, 2);
+		chunk.data = lua_tolstring(state, -1, &chunk.len);
+		chunk.lua_state = req->app->lua_state;
+		chunk.ref = luaL_ref(state, LUA_REGISTRYINDEX);
+		chunk.owned = NULL;
+		chunk.owned_pool = NULL;
+		chunk.cached = NULL;
+		chunk.file = NULL;
+		req->ops->stream_write(req, &chunk);
+	}
+	if (req->ops->congested(req)) {
+		/* resume_stream is called once the queue has drained */
+		req->waiting = REQUEST_WAIT_WRITE;
+		req->wait_resume = resume_stream;
+		return(lua_yield(state, 0));
+	}
+	return(0);
+}
+/**
+ * LUA syntax: res:finish()
+ *
+ * Ends a streamed response, a callback which returns without calling it
+ * finishes the response implicitly
+ *
+ */
+static int l_response_finish(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+
+	if (req->stream_finished) {
+		return(luaL_error(state, "response already finished"));
+	}
+	if (!req->streaming) {
+		start_stream(req);
+	}
+	req->stream_finished = true;
+	req->ops->stream_write(req, NULL);
+	return(0);
+}
+/**
+ * LUA syntax: res:etag(value[, weak])
+ *
+ * Sets the entity-tag of the response, value is the opaque tag without 
+ * quotes. Without it a response with a body gets a hash of the body as 
+ * entity-tag
+ *
+ */
+static int l_response_etag(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+	size_t len;
+	const char* value = luaL_checklstring(state, 2, &len);
+	bool weak = lua_toboolean(state, 3);
+	char* p;
+	size_t i;
+
+	if (req->streaming) {
+		return(luaL_error(state, "response already started"));
+	}
+	luaL_argcheck(state, len + 4 <= RESPONSE_ETAG_MAX, 2, "entity-tag too long");
+	for (i = 0; i < len; i++) {
+		/* etagc, which keeps the header free of quotes and line breaks */
+		luaL_argcheck(state, (unsigned char)value[i] > 0x20 && value[i] != '"' && value[i] != 0x7f, 
+			2, "invalid entity-tag");
+	}
+	p = (char*)arena_alloc(req->arena, len + 4);
+	if (p == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+	req->etag.base = p;
+	if (weak) {
+		*p++ = 'W';
+		*p++ = '/';
+	}
+	*p++ = '"';
+	memcpy(p, value, len);
+	p += len;
+	*p++ = '"';
+	req->etag.len = p - req->etag.base;
+	return(0);
+}
+/**
+ * LUA syntax: res:last_modified(time)
+ *
+ * Sets the modification date of the response in seconds since the epoch, 
+ * as returned by os.time()
+ *
+ */
+static int l_response_last_modified(lua_State* state)
+{
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+	lua_Number t = luaL_checknumber(state, 2);
+
+	if (req->streaming) {
+		return(luaL_error(state, "response already started"));
+	}
+	luaL_argcheck(state, t > 0, 2, "invalid time");
+	req->last_modified = (time_t)t;
+	return(0);
+}
+/**
+ * LUA syntax: res:header(name, value)
+ *
+ * Adds a header line to the response, a Content-Type replaces the content
+ * type the callback returns. Headers the server writes itself can't be set
+ *
+ */
+static int l_response_header(lua_State* state)
+{
+	static const char* reserved[] = {
+		"Content-Length", "Transfer-Encoding", "Connection", "Date", "ETag", "Last-Modified",
+		"Content-Encoding", NULL
+	};
+	request* req = check_request(state, LUA_USERDATA_RESPONSE);
+	slice_t field;
+	const char* value;
+	size_t value_len;
+	size_t i;
+
+	field.base = (char*)luaL_checklstring(state, 2, &field.len);
+	value = luaL_checklstring(state, 3, &value_len);
+	if (req->streaming) {
+		return(luaL_error(state, "response already started"));
+	}
+	luaL_argcheck(state, field.len > 0, 2, "invalid header name");
+	for (i = 0; i < field.len; i++) {
+		/* tchar */
+		luaL_argcheck(state, isalnum((unsigned char)field.base[i]) || (field.base[i] != '\0' &&
+			strchr("!#$%&'*+-.^_`|~", field.base[i]) != NULL), 2, "invalid header name");
+	}
+	for (i = 0; reserved[i] != NULL; i++) {
+		luaL_argcheck(state, !field_equals(&field, reserved[i], strlen(reserved[i])), 2, 
+			"header is set by the server");
+	}
+	if (field_equals(&field, "Content-Type", sizeof("Content-Type") - 1)) {
+		luaL_argcheck(state, set_mime_type(req, value, value_len) == LUAREST_SUCCESS, 3, 
+			"invalid content type");
+		return(0);
+	}
+	luaL_argcheck(state, valid_header_value(value, value_len), 3, "invalid header value");
+	if (request_add_header(req, field.base, field.len, value, value_len) != LUAREST_SUCCESS) {
+		return(luaL_error(state, "response headers too long"));
+	}
+	return(0);
+}
+/**
+ *
+ *
+ */
+static void on_sleep_close(uv_handle_t* handle)
+{
+	free(handle);
+}
+/**
+ *
+ *
+ */
+static void on_sleep_timeout(uv_timer_t* timer, int status)
+{
+	request* req = (request*)timer->data;
+
+	uv_close((uv_handle_t*)timer, on_sleep_close);
+	resume_application(req, 0);
+}
+/**
+ * The request went away while its callback was sleeping
+ *
+ */
+static void cancel_sleep(request* req)
+{
+	uv_timer_t* timer = (uv_timer_t*)req->wait_data;
+
+	uv_timer_stop(timer);
+	uv_close((uv_handle_t*)timer, on_sleep_close);
+}
+/**
+ * LUA syntax: luarest.sleep(ms)
+ *
+ * Suspends the service-callback for ms milliseconds, other requests are 
+ * served in the meantime
+ *
+ */
+static int l_sleep(lua_State* state)
+{
+	request* req = current_request(state);
+	lua_Integer ms = luaL_checkinteger(state, 1);
+	uv_timer_t* timer;
+
+	if (req == NULL) {
+		return(luaL_error(state, "luarest.sleep can only be called by a service-callback"));
+	}
+	timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+	if (timer == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+	uv_timer_init(req->app->loop, timer);
+	timer->data = req;
+	uv_timer_start(timer, on_sleep_timeout, ms > 0 ? ms : 0, 0);
+	return(suspend_request(state, req, cancel_sleep, timer));
+}
+/**
+ * LUA syntax: luarest.cache_stats()
+ *
+ * Return: table with hits, misses, evictions, entries and size of the 
+ * application's response cache
+ *
+ */
+static int l_cache_stats(lua_State* state)
+{
+	application* app;
+
+	lua_getfield(state, LUA_REGISTRYINDEX, LUA_REGISTRY_APPLICATION);
+	app = (application*)lua_touserdata(state, -1);
+	lua_pop(state, 1);
+	if (app == NULL) {
+		return(luaL_error(state, "no application"));
+	}
+
+	lua_createtable(state, 0, 5);
+	lua_pushnumber(state, app->cache.hits);
+	lua_setfield(state, -2, "hits");
+	lua_pushnumber(state, app->cache.misses);
+	lua_setfield(state, -2, "misses");
+	lua_pushnumber(state, app->cache.evictions);
+	lua_setfield(state, -2, "evictions");
+	lua_pushnumber(state, HASH_COUNT(app->cache.entries));
+	lua_setfield(state, -2, "entries");
+	lua_pushnumber(state, app->cache.size);
+	lua_setfield(state, -2, "size");
+	return(1);
+}
+/**
+ *
+ *
+ */
+static void push_proxy(lua_State* state, request* req, const char* type)
+{
+	request_proxy* proxy = (request_proxy*)lua_newuserdata(state, sizeof(request_proxy));
+
+	proxy->req = req;
+	proxy->values = false;
+	luaL_getmetatable(state, type);
+	lua_setmetatable(state, -2);
+}
+/**
+ *
+ *
+ */
+static void register_proxy(lua_State* state, const char* type, const char* event, lua_CFunction fn)
+{
+	luaL_newmetatable(state, type);
+	lua_pushcfunction(state, fn);
+	lua_setfield(state, -2, event);
+	lua_pop(state, 1);
+}
+/**
+ *
+ *
+ */
+static int luaopen_luarestlibs(lua_State *state)
+{
+	lua_newtable(state);
+	lua_setglobal(state, "luarest");
+	lua_getglobal(state, "luarest");
+	{
+		int i = 1;
+		
+		/* register HTTP_METHODS */
+		LUA_ENUM(state, HTTP_METHOD_GET, i++);
+		LUA_ENUM(state, HTTP_METHOD_POST, i++);
+		LUA_ENUM(state, HTTP_METHOD_PUT, i++);
+		LUA_ENUM(state, HTTP_METHOD_DELETE, i++);
+		LUA_ENUM(state, HTTP_METHOD_OPTION, i++);
+		LUA_ENUM(state, HTTP_METHOD_HEAD, i++);
+
+		/* register HTTP_RESPONSE */
+		i = 1;
+		LUA_ENUM(state, HTTP_RESPONSE_OK, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_CREATED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NO_CONTENT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NOT_ACCEPTABLE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NOT_MODIFIED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_SEE_OTHER, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_SERVER_ERROR, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_TEMPORARY_REDIRECT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PARTIAL_CONTENT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NOT_FOUND, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_RANGE_NOT_SATISFIABLE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_CONTINUE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_SWITCHING_PROTOCOLS, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_ACCEPTED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NON_AUTHORITATIVE_INFORMATION, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_RESET_CONTENT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_MULTIPLE_CHOICES, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_MOVED_PERMANENTLY, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_FOUND, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_USE_PROXY, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PERMANENT_REDIRECT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_BAD_REQUEST, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_UNAUTHORIZED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PAYMENT_REQUIRED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_FORBIDDEN, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_METHOD_NOT_ALLOWED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PROXY_AUTHENTICATION_REQUIRED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_REQUEST_TIMEOUT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_CONFLICT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_GONE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_LENGTH_REQUIRED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PRECONDITION_FAILED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_PAYLOAD_TOO_LARGE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_URI_TOO_LONG, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_UNSUPPORTED_MEDIA_TYPE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_EXPECTATION_FAILED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_UPGRADE_REQUIRED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_TOO_MANY_REQUESTS, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_NOT_IMPLEMENTED, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_BAD_GATEWAY, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_SERVICE_UNAVAILABLE, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_GATEWAY_TIMEOUT, i++);
+		LUA_ENUM(state, HTTP_RESPONSE_HTTP_VERSION_NOT_SUPPORTED, i++);
+
+		i = 1;
+		LUA_ENUM(state, CONTENT_TYPE_PLAIN, i++);
+		LUA_ENUM(state, CONTENT_TYPE_HTML, i++);
+		LUA_ENUM(state, CONTENT_TYPE_JSON, i++);
+	}
+	luaL_register(state, NULL, l_luarest);
+	lua_pop(state, 1);
+
+	register_proxy(state, LUA_USERDATA_HEADERS, "__index", l_headers_index);
+	register_proxy(state, LUA_USERDATA_PARAMS, "__index", l_params_index);
+	register_proxy(state, LUA_USERDATA_BODY, "__tostring", l_body_tostring);
+	register_proxy(state, LUA_USERDATA_BODY, "__len", l_body_len);
+
+	luaL_newmetatable(state, LUA_USERDATA_RESPONSE);
+	lua_pushvalue(state, -1);
+	lua_setfield(state, -2, "__index");
+	luaL_register(state, NULL, l_response);
+	lua_pop(state, 1);
+	
+	luaL_newmetatable(state, LUA_USERDATA_APPLICATION);
+	lua_pushvalue(state, -1);
+	lua_setfield(state, -2, "__index");
+	luaL_register(state, NULL, l_application);
+
+	return(1);
+}
+/**
+ * Detaches the proxies of a request and puts its coroutine back into the 
+ * application's pool. A coroutine which failed or is still suspended can't
+ * be resumed with a new function, it is left to the garbage collector
+ *
+ */
+static void release_coroutine(request* req, bool finished)
+{
+	application* app = req->app;
+	app_thread* thread;
+	int i;
+
+	for (i = 1; i <= REQUEST_PROXIES; i++) {
+		if (lua_isuserdata(req->co, i)) {
+			((request_proxy*)lua_touserdata(req->co, i))->req = NULL;
+		}
+	}
+	if (finished && app->num_idle_threads < APP_THREAD_POOL_MAX) {
+		lua_settop(req->co, 0);
+		thread = &app->idle_threads[app->num_idle_threads++];
+		thread->co = req->co;
+		thread->ref = req->co_ref;
+	}
+	else {
+		luaL_unref(app->lua_state, LUA_REGISTRYINDEX, req->co_ref);
+	}
+	req->co = NULL;
+	/* output of a callback which failed or was cancelled */
+	free(req->ffi_out.data);
+	req->ffi_out.data = NULL;
+	req->ffi_out.len = 0;
+	req->ffi_out.cap = 0;
+}
+/**
+ * Takes response, content type and body from the values the service-callback
+ * returned, a streamed response only needs to be finished
+ *
+ */
+static luarest_status collect_response(request* req)
+{
+	lua_State* co = req->co;
+	response_body* body = req->res_body;
+
+	if (req->streaming) {
+		if (!req->stream_finished) {
+			req->stream_finished = true;
+			req->ops->stream_write(req, NULL);
+		}
+		return(LUAREST_SUCCESS);
+	}
+
+	lua_settop(co, REQUEST_PROXIES + 3);
+	if (map_response(&req->res_code, (int)lua_tointeger(co, -3)) != LUAREST_SUCCESS ||
+		map_content_type(req, co, -2) != LUAREST_SUCCESS) {
+		printf("Error: service-callback returned an invalid response or content type\n");
+		return(LUAREST_ERROR);
+	}
+	if (lua_isstring(co, -1)) {
+		/* hand out the string itself, pinned in the registry, instead of a copy */
+		body->data = lua_tolstring(co, -1, &body->len);
+		body->lua_state = req->app->lua_state;
+		body->ref = luaL_ref(co, LUA_REGISTRYINDEX);
+	}
+	else if (lua_isnil(co, -1)) {
+		/* whatever was written to the FFI output buffer, possibly nothing */
+		body->owned = req->ffi_out.data;
+		body->len = req->ffi_out.len;
+		body->data = body->owned;
+		req->ffi_out.data = NULL;
+		req->ffi_out.len = 0;
+		req->ffi_out.cap = 0;
+	}
+	else {
+		return(LUAREST_ERROR);
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Runs the request's coroutine until it finishes or waits for the socket.
+ * The request's FFI output is swapped into the application's context while
+ * the coroutine runs, so callbacks which are suspended don't write into
+ * each other's output
+ *
+ */
+static luarest_status run_coroutine(request* req, int nargs)
+{
+	application* app = req->app;
+	request* running = app->running;
+	luarest_status status;
+	int ret;
+
+	app->ffi->req = req;
+	app->running = req;
+	req->waiting = REQUEST_WAIT_NONE;
+	req->wait_cancel = NULL;
+	req->wait_resume = NULL;
+	req->wait_data = NULL;
+	ffi_swap_output(app->ffi, &req->ffi_out);
+	ret = lua_resume(req->co, nargs);
+	ffi_swap_output(app->ffi, &req->ffi_out);
+	app->running = running;
+	app->ffi->req = running;
+
+	if (ret == LUA_YIELD && req->waiting != REQUEST_WAIT_NONE) {
+		return(LUAREST_PENDING);
+	}
+	if (ret == 0) {
+		status = collect_response(req);
+	}
+	else {
+		if (ret == LUA_YIELD) {
+			printf("Error calling service-callback: yielded outside of luarest\n");
+		}
+		else {
+			printf("Error calling service-callback: %s\n", lua_tostring(req->co, -1));
+		}
+		status = LUAREST_ERROR;
+	}
+	release_coroutine(req, ret == 0);
+	return(status);
+}
+/**
+ * Pushes the parts of a spooled body, an array of tables which is indexed
+ * by the name of the parts as well, the first part of a name wins. A file
+ * part has filename, path and size, a field its value
+ *
+ */
+static void push_parts(lua_State* state, upload_part* parts)
+{
+	upload_part* part;
+	int n = 0;
+
+	for (part = parts; part != NULL; part = part->next) {
+		n++;
+	}
+	lua_createtable(state, n, n);
+	for (part = parts, n = 1; part != NULL; part = part->next, n++) {
+		lua_createtable(state, 0, 5);
+		lua_pushstring(state, part->name);
+		lua_setfield(state, -2, "name");
+		if (part->content_type != NULL) {
+			lua_pushstring(state, part->content_type);
+			lua_setfield(state, -2, "content_type");
+		}
+		if (part->path != NULL) {
+			lua_pushstring(state, part->filename);
+			lua_setfield(state, -2, "filename");
+			lua_pushstring(state, part->path);
+			lua_setfield(state, -2, "path");
+			lua_pushnumber(state, (lua_Number)part->size);
+			lua_setfield(state, -2, "size");
+		}
+		else {
+			lua_pushlstring(state, part->value ? part->value : "", part->size);
+			lua_setfield(state, -2, "value");
+		}
+		lua_getfield(state, -2, part->name);
+		if (lua_isnil(state, -1)) {
+			lua_pushvalue(state, -2);
+			lua_setfield(state, -4, part->name);
+		}
+		lua_pop(state, 1);
+		lua_rawseti(state, -2, n);
+	}
+}
+/**
+ * Starts the service-callback in a coroutine of the application's state,
+ * returns LUAREST_PENDING if it has been suspended. The outcome of a 
+ * suspended callback is reported through req->ops->complete
+ *
+ */
+static luarest_status invoke_lua(application* app, int ref_cb, request* req)
+{
+	lua_State* state = app->lua_state;
+	lua_State* co;
+	int i;
+
+	if (app->num_idle_threads > 0) {
+		app->num_idle_threads--;
+		co = app->idle_threads[app->num_idle_threads].co;
+		req->co_ref = app->idle_threads[app->num_idle_threads].ref;
+	}
+	else {
+		co = lua_newthread(state);
+		req->co_ref = luaL_ref(state, LUA_REGISTRYINDEX);
+	}
+	req->co = co;
+	req->app = app;
+	req->res_code = HTTP_RESPONSE_OK;
+	req->con_type = CONTENT_TYPE_PLAIN;
+	req->streaming = false;
+	req->stream_finished = false;
+	req->ffi_out.data = NULL;
+	req->ffi_out.len = 0;
+	req->ffi_out.cap = 0;
+
+	/* the proxies stay on the stack below the call, so they can't be collected 
+	   before they are detached from the request */
+	push_proxy(co, req, LUA_USERDATA_HEADERS);
+	push_proxy(co, req, LUA_USERDATA_PARAMS);
+	if (req->parts != NULL) {
+		push_parts(co, req->parts);
+	}
+	else if (req->body.len > 0) {
+		push_proxy(co, req, LUA_USERDATA_BODY);
+	}
+	else {
+		lua_pushnil(co);
+	}
+	push_proxy(co, req, LUA_USERDATA_RESPONSE);
+
+	lua_rawgeti(co, LUA_REGISTRYINDEX, ref_cb);
+	for (i = 1; i <= REQUEST_PROXIES; i++) {
+		lua_pushvalue(co, i);
+	}
+	return(run_coroutine(req, REQUEST_PROXIES));
+}
+/**
+ *
+ *
+ */
+static luarest_status verify_application(application** apps, const char* appName, UT_string* path, uv_loop_t* loop)
+{
+	int ret;
+	lua_State* ls = luaL_newstate();
+	application* app;
+	ffi_context* ffi;
+	
+	luaL_openlibs(ls);
+	luaopen_luarestlibs(ls);
+	luaopen_cosocket(ls, loop);
+	ffi = luaopen_luarest_ffi(ls);
+        
+    ret = luaL_loadfile(ls, utstring_body(path));
+    if (ret != 0) {
+		printf("Couldn't load file: %s\n", lua_tostring(ls, -1));
+		lua_close(ls);
+		return(LUAREST_ERROR);
+    }
+	ret = lua_pcall(ls, 0, 0, 0);
+    if (ret != 0) {
+        printf("Couldn't execute LUA Script %s\n", lua_tostring(ls, -1));
+		lua_close(ls);
+		return(LUAREST_ERROR);
+    }
+	lua_getglobal(ls, "luarest_init");
+    if (lua_isfunction(ls, -1) == 0) {
+		printf("Couln'd find 'luarest_init' table in LUA script!\n");
+		lua_close(ls);
+		return(LUAREST_ERROR);
+	}
+	app = (application*)lua_newuserdata(ls, sizeof(application));
+	luaL_getmetatable(ls, LUA_USERDATA_APPLICATION);
+	lua_setmetatable(ls, -2);
+	router_init(&app->routes);
+	app->ffi = ffi;
+	app->loop = loop;
+	app->running = NULL;
+	app->num_idle_threads = 0;
+	cache_init(&app->cache, CACHE_MAX_SIZE);
+	app->flights = NULL;
+	/* anchors the application, current_request finds it here */
+	lua_pushvalue(ls, -1);
+	lua_setfield(ls, LUA_REGISTRYINDEX, LUA_REGISTRY_APPLICATION);
+	utstring_new(app->name);
+	utstring_printf(app->name, appName);
+	utstring_new(app->dir);
+	utstring_bincpy(app->dir, utstring_body(path), utstring_len(path) - strlen(APP_ENTRY_POINT) - 1);
+	if (lua_pcall(ls, 1, 0, 0) != 0) {
+		printf("Error calling luarest_init: %s\n!", lua_tostring(ls, -1));
+		lua_close(ls);
+		return(LUAREST_ERROR);
+	}
+	app->lua_state = ls;
+	HASH_ADD_KEYPTR(hh, *apps, utstring_body(app->name), utstring_len(app->name), app);
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status parse_apps(application** apps, char* directory_path, uv_loop_t* loop)
+{
+#ifdef WIN32
+	WIN32_FIND_DATA ffd;
+	WIN32_FIND_DATA fap;
+	size_t length_of_arg;
+	TCHAR szDir[MAX_PATH];
+	TCHAR appFile[MAX_PATH];
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	HANDLE hApp = INVALID_HANDLE_VALUE;
+	luarest_status ret;
+	// Check that the input path plus 2 is not longer than MAX_PATH.
+	StringCchLength(directory_path, MAX_PATH, &length_of_arg);
+	if (length_of_arg > (MAX_PATH - 2)) {
+		_tprintf(TEXT("\nDirectory path is too long.\n"));
+		return(LUAREST_ERROR);
+	}
+	// Prepare string for use with FindFile functions.  First, copy the
+	// string to a buffer, then append '\*' to the directory name.
+	StringCchCopy(szDir, MAX_PATH, directory_path);
+	StringCchCat(szDir, MAX_PATH, TEXT("\\*"));
+	// Find the first file in the directory.
+	hFind = FindFirstFile(szDir, &ffd);
+	if (INVALID_HANDLE_VALUE == hFind) {
+      return(LUAREST_ERROR);
+	}
+	// List all the files in the directory with some info about them.
+	do {
+		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			StringCchCopy(appFile, MAX_PATH, directory_path);
 			StringCchCat(appFile, MAX_PATH, TEXT("\\"));
 			StringCchCat(appFile, MAX_PATH, ffd.cFileName);
 			StringCchCat(appFile, MAX_PATH, TEXT("\\"));
@@ -320,7 +1564,7 @@ static luarest_status parse_apps(application** apps, char* directory_path)
 				utstring_new(app);
 				utstring_printf(app, appFile);
 				/* verify application */
-				ret = verify_application(apps, ffd.cFileName, app);
+				ret = verify_application(apps, ffd.cFileName, app, loop);
 				utstring_free(app);
 				if (ret != LUAREST_SUCCESS) {
 					printf("Application %s couldn't be load due to errors!\n", ffd.cFileName);
@@ -332,70 +1576,708 @@ static luarest_status parse_apps(application** apps, char* directory_path)
 	while (FindNextFile(hFind, &ffd) != 0);
 	FindClose(hFind);
 #else
-    DIR *dpdf;
-    struct dirent *epdf;
-    struct stat st;
-    int is_dir = 0;
-    dpdf = opendir("./");
-    if (dpdf != NULL){
-        while ( (epdf = readdir(dpdf)) != NULL) {
-            if (stat(epdf->d_name, &st) == -1) {
-                continue;
-            }
-            is_dir = (st.st_mode & S_IFDIR) != 0;
-            if (is_dir) {
-                continue;
-            }
-            /* re-do for unix */
-        }
-    }
-    closedir(dpdf);
+	DIR *dpdf;
+	struct dirent *epdf;
+	struct stat st;
+	UT_string* app;
+	luarest_status ret;
+
+	dpdf = opendir(directory_path);
+	if (dpdf == NULL) {
+		return(LUAREST_ERROR);
+	}
+	while ((epdf = readdir(dpdf)) != NULL) {
+		if (epdf->d_name[0] == '.') {
+			continue;
+		}
+		utstring_new(app);
+		utstring_printf(app, "%s/%s/%s", directory_path, epdf->d_name, APP_ENTRY_POINT);
+		if (stat(utstring_body(app), &st) == 0 && S_ISREG(st.st_mode)) {
+			/* verify application */
+			ret = verify_application(apps, epdf->d_name, app, loop);
+			if (ret != LUAREST_SUCCESS) {
+				printf("Application %s couldn't be load due to errors!\n", epdf->d_name);
+			}
+		}
+		utstring_free(app);
+	}
+	closedir(dpdf);
 #endif
 	return(LUAREST_SUCCESS);
 }
 /**
+ * The cache key is the method and the negotiated content encoding, path 
+ * and query followed by the values of the headers the route varies on, 
+ * those of the cache policy and then those of coalescing. It lives in the 
+ * request's arena and is the key of the request's flight as well
+ *
+ */
+static luarest_status make_cache_key(request* req, const service* service)
+{
+	size_t len = req->path.len + req->query.len + 3;
+	const char* names[2 * CACHE_MAX_VARY];
+	const slice_t* values[2 * CACHE_MAX_VARY];
+	int num_vary = 0;
+	char* p;
+	int i;
+
+	if (service->cache != NULL) {
+		for (i = 0; i < service->cache->num_vary; i++) {
+			names[num_vary++] = service->cache->vary[i];
+		}
+	}
+	if (service->coalesce != NULL) {
+		for (i = 0; i < service->coalesce->num_vary; i++) {
+			names[num_vary++] = service->coalesce->vary[i];
+		}
+	}
+	for (i = 0; i < num_vary; i++) {
+		values[i] = request_header(req, names[i], strlen(names[i]));
+		if (values[i] != NULL) {
+			len += values[i]->len;
+		}
+		len++;
+	}
+	p = (char*)arena_alloc(req->arena, len);
+	if (p == NULL) {
+		return(LUAREST_ERROR);
+	}
+	req->cache_key.base = p;
+	req->cache_key.len = len;
+
+	*p++ = (char)req->method;
+	*p++ = (char)req->accept_encoding;
+	memcpy(p, req->path.base, req->path.len);
+	p += req->path.len;
+	*p++ = '?';
+	memcpy(p, req->query.base, req->query.len);
+	p += req->query.len;
+	for (i = 0; i < num_vary; i++) {
+		*p++ = '\n';
+		if (values[i] != NULL) {
+			memcpy(p, values[i]->base, values[i]->len);
+			p += values[i]->len;
+		}
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Sends the shared response to a request which waited for it
+ *
+ */
+static void send_shared(request* req, cache_entry* entry)
+{
+	response_body body;
+
+	body.data = entry->data;
+	body.len = entry->len;
+	body.lua_state = NULL;
+	body.owned = NULL;
+	body.owned_pool = NULL;
+	body.cached = entry;
+	body.file = NULL;
+	entry->refs++;
+	req->streaming = true;
+	req->stream_finished = true;
+	req->ops->send(req, &body);
+}
+/**
+ * Answers a request from the shared entry, a conditional request whose 
+ * validators match gets a 304 instead, rendered by the server
+ *
+ */
+static void answer_shared(request* req, cache_entry* entry)
+{
+	slice_t etag;
+
+	etag.base = entry->etag;
+	etag.len = entry->etag_len;
+	if (request_not_modified(req, &etag, entry->last_modified)) {
+		req->etag.base = (char*)arena_alloc(req->arena, etag.len + 1);
+		if (req->etag.base != NULL) {
+			memcpy(req->etag.base, etag.base, etag.len);
+			req->etag.len = etag.len;
+			req->last_modified = entry->last_modified;
+			req->res_code = HTTP_RESPONSE_NOT_MODIFIED;
+			return;
+		}
+		req->etag.len = 0;
+	}
+	send_shared(req, entry);
+}
+/**
+ * The request's client went away while it waited on a flight
+ *
+ */
+static void leave_flight(request* req)
+{
+	flight* f = req->flight;
+	request** p;
+
+	for (p = &f->waiters; *p != NULL; p = &(*p)->next_waiter) {
+		if (*p == req) {
+			*p = req->next_waiter;
+			break;
+		}
+	}
+	req->flight = NULL;
+}
+/**
+ * Case-insensitive search for token in value
  *
+ */
+static bool value_contains(const char* value, size_t len, const char* token, size_t token_len)
+{
+	size_t i;
+
+	for (i = 0; i + token_len <= len; i++) {
+		if (strncasecmp(value + i, token, token_len) == 0) {
+			return(true);
+		}
+	}
+	return(false);
+}
+/**
+ * A response which sets a cookie or whose Cache-Control forbids shared
+ * caches must only go to the client which asked for it
+ *
+ */
+static bool response_is_private(const request* req)
+{
+	const char* p = req->res_headers.base;
+	const char* end = p + req->res_headers.len;
+	const char* eol;
+	const char* colon;
+	slice_t field;
+
+	if (p == NULL) {
+		return(false);
+	}
+	while (p < end) {
+		eol = (const char*)memchr(p, '\r', end - p);
+		colon = (const char*)memchr(p, ':', end - p);
+		if (eol == NULL || colon == NULL || colon > eol) {
+			break;
+		}
+		field.base = (char*)p;
+		field.len = colon - p;
+		if (field_equals(&field, "Set-Cookie", 10)) {
+			return(true);
+		}
+		if (field_equals(&field, "Cache-Control", 13) &&
+			(value_contains(colon + 1, eol - colon - 1, "private", 7) ||
+			value_contains(colon + 1, eol - colon - 1, "no-store", 8))) {
+			return(true);
+		}
+		p = eol + 2;
+	}
+	return(false);
+}
+/**
+ * The leader can't share its response (it was streamed or the client went
+ * away), the first waiter runs the callback for the others
+ *
+ */
+static void hand_over_flight(request* req)
+{
+	flight* f = req->flight;
+	request* next = f->waiters;
+	luarest_status status;
+
+	req->flight = NULL;
+	if (next == NULL) {
+		HASH_DELETE(hh, f->app->flights, f);
+		free(f);
+		return;
+	}
+	f->waiters = next->next_waiter;
+	f->leader = next;
+	next->waiting = REQUEST_WAIT_NONE;
+	next->wait_cancel = NULL;
+	next->wait_data = NULL;
+	status = invoke_lua(f->app, f->service->callback_ref, next);
+	if (status != LUAREST_PENDING) {
+		next->ops->complete(next, status);
+	}
+}
+/**
+ * Hands the leader's response to every request waiting on its flight
+ *
+ */
+static void land_flight(request* req, cache_entry* entry)
+{
+	flight* f = req->flight;
+	request* waiter;
+
+	req->flight = NULL;
+	HASH_DELETE(hh, f->app->flights, f);
+	while (f->waiters != NULL) {
+		waiter = f->waiters;
+		f->waiters = waiter->next_waiter;
+		waiter->flight = NULL;
+		waiter->waiting = REQUEST_WAIT_NONE;
+		waiter->wait_cancel = NULL;
+		waiter->wait_data = NULL;
+		answer_shared(waiter, entry);
+		waiter->ops->complete(waiter, LUAREST_SUCCESS);
+	}
+	free(f);
+}
+/**
+ * A fresh cache entry is sent as it is, with a single write and without 
+ * running the service-callback. On a miss of a coalescing route the request
+ * either waits for the identical one running already or becomes the leader
+ * of a new flight. The response is cached and shared once it has been 
+ * rendered, see share_response
+ *
+ */
+static luarest_status invoke_shared(application* app, service* service, request* req)
+{
+	cache_entry* entry;
+	flight* f = NULL;
+
+	if (make_cache_key(req, service) != LUAREST_SUCCESS) {
+		return(invoke_lua(app, service->callback_ref, req));
+	}
+	if (service->cache != NULL) {
+		entry = cache_lookup(service->cache->cache, req->cache_key.base, req->cache_key.len, uv_now(app->loop));
+		if (entry != NULL) {
+			answer_shared(req, entry);
+			cache_entry_release(entry);
+			return(LUAREST_SUCCESS);
+		}
+		req->cache = service->cache;
+	}
+	if (service->coalesce != NULL) {
+		HASH_FIND(hh, app->flights, req->cache_key.base, req->cache_key.len, f);
+		if (f != NULL) {
+			req->flight = f;
+			req->next_waiter = f->waiters;
+			f->waiters = req;
+			req->app = app;
+			req->waiting = REQUEST_WAIT_EVENT;
+			req->wait_cancel = leave_flight;
+			req->wait_resume = NULL;
+			req->wait_data = f;
+			return(LUAREST_PENDING);
+		}
+		f = (flight*)malloc(sizeof(flight) + req->cache_key.len);
+		if (f != NULL) {
+			f->key = (char*)(f + 1);
+			f->key_len = req->cache_key.len;
+			memcpy(f->key, req->cache_key.base, f->key_len);
+			f->leader = req;
+			f->waiters = NULL;
+			f->app = app;
+			f->service = service;
+			HASH_ADD_KEYPTR(hh, app->flights, f->key, f->key_len, f);
+			req->flight = f;
+		}
+	}
+	return(invoke_lua(app, service->callback_ref, req));
+}
+/**
+ *
+ *
+ */
+static bool varies_on(char* const* vary, int num_vary, const char* name)
+{
+	slice_t field;
+	int i;
+
+	for (i = 0; i < num_vary; i++) {
+		field.base = vary[i];
+		field.len = strlen(vary[i]);
+		if (field_equals(&field, name, strlen(name))) {
+			return(true);
+		}
+	}
+	return(false);
+}
+/**
+ * A request carrying credentials gets a response of its own, unless the
+ * route's key varies on them
+ *
+ */
+static bool has_credentials(const request* req, const service* service)
+{
+	static const char* names[] = { "Authorization", "Cookie" };
+	size_t i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (request_header(req, names[i], strlen(names[i])) == NULL) {
+			continue;
+		}
+		if ((service->cache == NULL || !varies_on(service->cache->vary, service->cache->num_vary, names[i])) &&
+			(service->coalesce == NULL || 
+			!varies_on(service->coalesce->vary, service->coalesce->num_vary, names[i]))) {
+			return(true);
+		}
+	}
+	return(false);
+}
+/**
+ * Looks up the application and route of req, the values captured by the
+ * route are kept in req->match
  *
  */
-luarest_status invoke_application(application* apps, UT_string* url, luarest_method m, luarest_response* res_code, 
-	luarest_content_type* con_type, UT_string* res_buf)
+static service* find_service(application* apps, request* req, application** app)
 {
-	application* app = NULL;
-	service *service;
+	application* found = NULL;
+	slice_t* path = &req->path;
 	char* pch = NULL;
-	char* tmp = utstring_body(url);
-	UT_string* app_name;
-	UT_string* key;
+	char* tmp;
 
-	utstring_new(app_name);
-	pch = strchr(++tmp, '/');
+	if (path->len < 2 || path->base[0] != '/') {
+		return(NULL);
+	}
+	tmp = path->base + 1;
+	pch = (char*)memchr(tmp, '/', path->len - 1);
 	if (pch == NULL) {
-		return(LUAREST_ERROR);
+		return(NULL);
 	}
-	utstring_bincpy(app_name, tmp, pch-tmp);
-	HASH_FIND(hh, apps, utstring_body(app_name), utstring_len(app_name), app);
-	utstring_free(app_name);
-	if (app == NULL) {
+	/* both lookups work on slices of the request path, nothing is copied */
+	HASH_FIND(hh, apps, tmp, pch-tmp, found);
+	*app = found;
+	if (found == NULL) {
+		return(NULL);
+	}
+	return((service*)router_lookup(&found->routes, req->method, pch, path->len - (pch - path->base), 
+		&req->match));
+}
+/**
+ * Sets limit to the body size the route of req accepts if it has its own 
+ * and upload if its body is to be spooled, fails if there is no such route.
+ * Called once the headers are parsed, before the body is read
+ *
+ */
+luarest_status application_body_options(application* apps, request* req, size_t* limit, bool* upload)
+{
+	application* app;
+	service* service = find_service(apps, req, &app);
+
+	if (service == NULL) {
 		return(LUAREST_ERROR);
 	}
-	utstring_new(key);
-	utstring_printf(key, "M%d#P%s", m, pch);
-	HASH_FIND(hh, app->s, utstring_body(key), utstring_len(key), service);
+	if (service->max_body > 0) {
+		*limit = service->max_body;
+	}
+	*upload = service->upload;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Dispatches the request to the application named by the first path segment 
+ * and the service matching the rest of the path, without allocating. A
+ * request no service matches is answered with a 404
+ *
+ */
+luarest_status invoke_application(application* apps, request* req)
+{
+	application* app;
+	service* service = find_service(apps, req, &app);
+
 	if (service == NULL) {
+		/* answered, an error would turn it into a 500 */
+		req->res_code = HTTP_RESPONSE_NOT_FOUND;
+		req->con_type = CONTENT_TYPE_PLAIN;
+		return(LUAREST_SUCCESS);
+	}
+	if (service->proxy != NULL) {
+		return(proxy_request(service->proxy, req));
+	}
+	if (service->files != NULL) {
+		return(static_request(service->files, req));
+	}
+	/* HTTP/1.0 responses differ in their connection handling, only 1.1 is 
+	   cached or coalesced */
+	if ((service->cache != NULL || service->coalesce != NULL) && req->http_minor > 0 &&
+		!has_credentials(req, service)) {
+		return(invoke_shared(app, service, req));
+	}
+	return(invoke_lua(app, service->callback_ref, req));
+}
+/**
+ * Continues a suspended service-callback, nresults values pushed onto 
+ * req->co are returned from the yield. The outcome is reported through
+ * req->ops->complete once the callback has finished
+ *
+ */
+void resume_application(request* req, int nresults)
+{
+	luarest_status status = run_coroutine(req, nresults);
+
+	if (status != LUAREST_PENDING) {
+		req->ops->complete(req, status);
+	}
+}
+/**
+ * Drops a suspended service-callback, its connection has gone away
+ *
+ */
+void cancel_application(request* req)
+{
+	if (req->wait_cancel != NULL) {
+		req->wait_cancel(req);
+		req->wait_cancel = NULL;
+	}
+	if (req->co != NULL) {
+		release_coroutine(req, false);
+	}
+	if (req->flight != NULL) {
+		hand_over_flight(req);
+	}
+}
+/**
+ * Returns the request whose service-callback is running in state, NULL if 
+ * state is not the coroutine of a request (e.g. the main state or a 
+ * coroutine created by the callback itself)
+ *
+ */
+request* current_request(lua_State* state)
+{
+	application* app;
+
+	lua_getfield(state, LUA_REGISTRYINDEX, LUA_REGISTRY_APPLICATION);
+	app = (application*)lua_touserdata(state, -1);
+	lua_pop(state, 1);
+
+	if (app == NULL || app->running == NULL || app->running->co != state) {
+		return(NULL);
+	}
+	return(app->running);
+}
+/**
+ * Suspends the service-callback of req until resume_application is called,
+ * has to be returned from the lua_CFunction. cancel is called with data in
+ * req->wait_data if the request goes away while it waits
+ *
+ */
+int suspend_request(lua_State* state, request* req, void (*cancel)(request* req), void* data)
+{
+	req->waiting = REQUEST_WAIT_EVENT;
+	req->wait_cancel = cancel;
+	req->wait_resume = NULL;
+	req->wait_data = data;
+	return(lua_yield(state, 0));
+}
+/**
+ * Drops the registry reference which kept the body string alive or frees
+ * the FFI output the body was taken from
+ *
+ */
+void release_response_body(response_body* body)
+{
+	if (body->lua_state != NULL) {
+		luaL_unref(body->lua_state, LUA_REGISTRYINDEX, body->ref);
+		body->lua_state = NULL;
+	}
+	if (body->owned_pool != NULL) {
+		pool_put(body->owned_pool, body->owned);
+		body->owned_pool = NULL;
+	}
+	else {
+		free(body->owned);
+	}
+	body->owned = NULL;
+	if (body->cached != NULL) {
+		cache_entry_release(body->cached);
+		body->cached = NULL;
+	}
+	if (body->file != NULL) {
+		static_file_release(body->file);
+		body->file = NULL;
+	}
+}
+/**
+ * Called with the rendered response of a request whose route caches or
+ * coalesces, header is NULL for a streamed response. The response is stored
+ * in the cache and sent to the requests waiting on the request's flight, on
+ * success body refers to the shared entry which holds header and body
+ *
+ */
+luarest_status share_response(request* req, luarest_status status, bool keep_alive_header, 
+	const char* header, size_t header_len, response_body* body)
+{
+	cache_policy* policy = req->cache;
+	cache_entry* entry = NULL;
+
+	req->cache = NULL;
+	/* a 304 of the callback itself only answers this request's validators,
+	   a private response only this request */
+	if (header == NULL || req->res_code == HTTP_RESPONSE_NOT_MODIFIED || response_is_private(req)) {
+		if (req->flight != NULL) {
+			hand_over_flight(req);
+		}
+		return(LUAREST_ERROR);
+	}
+	if (policy != NULL && status == LUAREST_SUCCESS && !keep_alive_header && 
+		req->res_code == HTTP_RESPONSE_OK && header_len + body->len <= policy->max_entry_size) {
+		entry = cache_store(policy->cache, req->cache_key.base, req->cache_key.len, header, header_len,
+			body->data, body->len, uv_now(req->app->loop) + policy->ttl_ms);
+		if (entry != NULL) {
+			cache_entry_set_validators(entry, req->etag.base, req->etag.len, req->last_modified);
+		}
+	}
+	if (req->flight != NULL) {
+		if (req->flight->waiters == NULL) {
+			HASH_DELETE(hh, req->app->flights, req->flight);
+			free(req->flight);
+			req->flight = NULL;
+		}
+		else {
+			if (entry == NULL) {
+				entry = cache_entry_new(header, header_len, body->data, body->len);
+				if (entry != NULL) {
+					cache_entry_set_validators(entry, req->etag.base, req->etag.len, req->last_modified);
+				}
+			}
+			if (entry == NULL) {
+				hand_over_flight(req);
+				return(LUAREST_ERROR);
+			}
+			land_flight(req, entry);
+		}
+	}
+	if (entry == NULL) {
+		return(LUAREST_ERROR);
+	}
+	release_response_body(body);
+	body->data = entry->data;
+	body->len = entry->len;
+	body->cached = entry;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Returns the value of the request header name, compared case-insensitive,
+ * NULL if the request doesn't carry it
+ *
+ */
+const slice_t* request_header(const request* req, const char* name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < req->num_headers; i++) {
+		if (field_equals(&req->headers[i].field, name, len)) {
+			return(&req->headers[i].value);
+		}
+	}
+	return(NULL);
+}
+/**
+ * Appends a header line to the response, the lines share one buffer of
+ * RESPONSE_HEADERS_MAX bytes in the request's arena
+ *
+ */
+luarest_status request_add_header(request* req, const char* name, size_t name_len, const char* value,
+	size_t value_len)
+{
+	char* p;
+
+	if (req->res_headers.base == NULL) {
+		req->res_headers.base = (char*)arena_alloc(req->arena, RESPONSE_HEADERS_MAX);
+		req->res_headers.len = 0;
+		if (req->res_headers.base == NULL) {
+			return(LUAREST_ERROR);
+		}
+	}
+	if (req->res_headers.len + name_len + value_len + 4 > RESPONSE_HEADERS_MAX) {
 		return(LUAREST_ERROR);
 	}
-	invoke_lua(app->lua_state, service->callback_ref, res_code, con_type, res_buf);
+	p = req->res_headers.base + req->res_headers.len;
+	memcpy(p, name, name_len);
+	p += name_len;
+	*p++ = ':';
+	*p++ = ' ';
+	memcpy(p, value, value_len);
+	p += value_len;
+	*p++ = '\r';
+	*p++ = '\n';
+	req->res_headers.len = p - req->res_headers.base;
 	return(LUAREST_SUCCESS);
 }
+/**
+ * Weak comparison of etag with a comma separated list of entity-tags 
+ *
+ */
+static bool etag_list_matches(const slice_t* list, const slice_t* etag)
+{
+	const char* p = list->base;
+	const char* end = p + list->len;
+	const char* tag = etag->base;
+	size_t tag_len = etag->len;
+	const char* start;
+
+	if (tag_len > 2 && tag[0] == 'W' && tag[1] == '/') {
+		tag += 2;
+		tag_len -= 2;
+	}
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if (*p == '*') {
+			return(true);
+		}
+		if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+			p += 2;
+		}
+		start = p;
+		if (*p == '"') {
+			p = (const char*)memchr(p + 1, '"', end - p - 1);
+			if (p == NULL) {
+				return(false);
+			}
+			p++;
+		}
+		else {
+			/* not an entity-tag, skip it */
+			while (p < end && *p != ',') {
+				p++;
+			}
+			continue;
+		}
+		if ((size_t)(p - start) == tag_len && memcmp(start, tag, tag_len) == 0) {
+			return(true);
+		}
+	}
+	return(false);
+}
+/**
+ * Evaluates If-None-Match, or If-Modified-Since if it is absent, of a GET 
+ * or HEAD request against the validators of its response
+ *
+ */
+bool request_not_modified(const request* req, const slice_t* etag, time_t last_modified)
+{
+	const slice_t* value;
+	time_t since;
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD) {
+		return(false);
+	}
+	value = request_header(req, "If-None-Match", sizeof("If-None-Match") - 1);
+	if (value != NULL) {
+		return(etag->len > 0 && etag_list_matches(value, etag));
+	}
+	value = request_header(req, "If-Modified-Since", sizeof("If-Modified-Since") - 1);
+	if (value != NULL && last_modified != 0 &&
+		http_date_parse(value->base, value->len, &since) == LUAREST_SUCCESS) {
+		return(last_modified <= since);
+	}
+	return(false);
+}
 /**
  *
  *
  */
-luarest_status create_applications(application** apps, char* app_dir)
+luarest_status create_applications(application** apps, char* app_dir, uv_loop_t* loop)
 {
 	luarest_status ret = LUAREST_SUCCESS;
 
-	ret = parse_apps(apps, app_dir);
+	ret = parse_apps(apps, app_dir, loop);
 
 	return(LUAREST_SUCCESS);
 }
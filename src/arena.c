@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+#define BLOCK_DATA(b) ((char*)(b) + ARENA_ALIGN(sizeof(arena_block)))
+
+/**
+ *
+ *
+ */
+static arena_block* new_block(size_t size)
+{
+	arena_block* block = (arena_block*)malloc(ARENA_ALIGN(sizeof(arena_block)) + size);
+
+	if (block == NULL) {
+		return(NULL);
+	}
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return(block);
+}
+/**
+ *
+ *
+ */
+void arena_init(arena_t* arena, size_t block_size)
+{
+	arena->first = NULL;
+	arena->current = NULL;
+	arena->block_size = block_size;
+	arena->last = NULL;
+	arena->last_size = 0;
+}
+/**
+ * Allocations larger than the block size get a block of their own
+ *
+ */
+void* arena_alloc(arena_t* arena, size_t size)
+{
+	arena_block* block = arena->current;
+	arena_block* next;
+	char* p;
+
+	size = ARENA_ALIGN(size > 0 ? size : 1);
+
+	while (block == NULL || block->used + size > block->size) {
+		next = (block != NULL) ? block->next : arena->first;
+		if (next == NULL || size > next->size) {
+			/* the chain is exhausted, add a block after the current one */
+			next = new_block(size > arena->block_size ? size : arena->block_size);
+			if (next == NULL) {
+				return(NULL);
+			}
+			if (block == NULL) {
+				next->next = arena->first;
+				arena->first = next;
+			}
+			else {
+				next->next = block->next;
+				block->next = next;
+			}
+		}
+		block = next;
+		block->used = 0;
+		arena->current = block;
+	}
+
+	p = BLOCK_DATA(block) + block->used;
+	block->used += size;
+	arena->last = p;
+	arena->last_size = size;
+	return(p);
+}
+/**
+ * Appends data to str and keeps it NUL-terminated. A string which is the 
+ * most recent allocation grows in place, otherwise it is moved
+ *
+ */
+luarest_status arena_append(arena_t* arena, slice_t* str, const char* data, size_t len)
+{
+	arena_block* block = arena->current;
+	size_t needed = ARENA_ALIGN(str->len + len + 1);
+	char* p;
+
+	if (str->base != NULL && str->base == arena->last && block != NULL &&
+		(arena->last - BLOCK_DATA(block)) + needed <= block->size) {
+		block->used = (arena->last - BLOCK_DATA(block)) + needed;
+		arena->last_size = needed;
+		p = str->base;
+	}
+	else {
+		p = (char*)arena_alloc(arena, str->len + len + 1);
+		if (p == NULL) {
+			return(LUAREST_ERROR);
+		}
+		if (str->len > 0) {
+			memcpy(p, str->base, str->len);
+		}
+	}
+	memcpy(p + str->len, data, len);
+	str->base = p;
+	str->len += len;
+	p[str->len] = '\0';
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Releases every allocation in one step, the blocks stay with the arena 
+ * except for oversized ones
+ *
+ */
+void arena_reset(arena_t* arena)
+{
+	arena_block** link = &arena->first;
+	arena_block* block;
+
+	while ((block = *link) != NULL) {
+		if (block->size > arena->block_size) {
+			*link = block->next;
+			free(block);
+		}
+		else {
+			link = &block->next;
+		}
+	}
+	if (arena->first != NULL) {
+		arena->first->used = 0;
+	}
+	arena->current = arena->first;
+	arena->last = NULL;
+	arena->last_size = 0;
+}
+/**
+ *
+ *
+ */
+void arena_destroy(arena_t* arena)
+{
+	arena_block* block = arena->first;
+	arena_block* next;
+
+	while (block != NULL) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	arena_init(arena, arena->block_size);
+}
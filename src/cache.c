@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+/**
+ *
+ *
+ */
+void cache_init(response_cache* cache, size_t max_size)
+{
+	memset(cache, 0, sizeof(response_cache));
+	cache->max_size = max_size;
+}
+/**
+ * Drops a reference, the last one frees the entry
+ *
+ */
+void cache_entry_release(cache_entry* entry)
+{
+	if (--entry->refs == 0) {
+		free(entry->key);
+		free(entry->etag);
+		free(entry->data);
+		free(entry);
+	}
+}
+/**
+ *
+ *
+ */
+static void cache_remove(response_cache* cache, cache_entry* entry)
+{
+	HASH_DELETE(hh, cache->entries, entry);
+	cache->size -= entry->len + entry->key_len;
+	cache_entry_release(entry);
+}
+/**
+ * Returns the entry with a reference taken for the caller, NULL if there is
+ * none or it expired
+ *
+ */
+cache_entry* cache_lookup(response_cache* cache, const char* key, size_t key_len, uint64_t now)
+{
+	cache_entry* entry = NULL;
+
+	HASH_FIND(hh, cache->entries, key, key_len, entry);
+	if (entry == NULL) {
+		cache->misses++;
+		return(NULL);
+	}
+	if (entry->expires <= now) {
+		cache_remove(cache, entry);
+		cache->misses++;
+		return(NULL);
+	}
+	/* most recently used ones go to the end */
+	HASH_DELETE(hh, cache->entries, entry);
+	HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+	cache->hits++;
+	entry->refs++;
+	return(entry);
+}
+/**
+ * Finds the Date line of the rendered header
+ *
+ */
+static void find_date_line(cache_entry* entry, const char* header, size_t len)
+{
+	static const char date[] = "\r\nDate: ";
+	const char* end = header + len;
+	const char* p = header;
+	const char* eol;
+
+	entry->date_offset = 0;
+	entry->date_len = 0;
+	while ((p = (const char*)memchr(p, '\r', end - p)) != NULL) {
+		if ((size_t)(end - p) < sizeof(date) - 1) {
+			return;
+		}
+		if (memcmp(p, date, sizeof(date) - 1) == 0) {
+			eol = (const char*)memchr(p + 2, '\n', end - p - 2);
+			if (eol != NULL) {
+				entry->date_offset = p + 2 - header;
+				entry->date_len = eol + 1 - (p + 2);
+			}
+			return;
+		}
+		p++;
+	}
+}
+/**
+ * Creates an entry which is not in any cache, the caller holds the only
+ * reference
+ *
+ */
+cache_entry* cache_entry_new(const char* header, size_t header_len, const char* body, size_t body_len)
+{
+	cache_entry* entry = (cache_entry*)malloc(sizeof(cache_entry));
+
+	if (entry == NULL) {
+		return(NULL);
+	}
+	entry->data = (char*)malloc(header_len + body_len);
+	if (entry->data == NULL) {
+		free(entry);
+		return(NULL);
+	}
+	memcpy(entry->data, header, header_len);
+	if (body_len > 0) {
+		memcpy(entry->data + header_len, body, body_len);
+	}
+	entry->len = header_len + body_len;
+	find_date_line(entry, header, header_len);
+	entry->key = NULL;
+	entry->key_len = 0;
+	entry->expires = 0;
+	entry->refs = 1;
+	entry->etag = NULL;
+	entry->etag_len = 0;
+	entry->last_modified = 0;
+	return(entry);
+}
+/**
+ * Keeps a copy of the response's validators with the entry
+ *
+ */
+luarest_status cache_entry_set_validators(cache_entry* entry, const char* etag, size_t etag_len, 
+	time_t last_modified)
+{
+	char* copy = NULL;
+
+	if (etag_len > 0) {
+		copy = (char*)malloc(etag_len);
+		if (copy == NULL) {
+			return(LUAREST_ERROR);
+		}
+		memcpy(copy, etag, etag_len);
+	}
+	free(entry->etag);
+	entry->etag = copy;
+	entry->etag_len = etag_len;
+	entry->last_modified = last_modified;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Stores header and body as one buffer, replacing an older entry with the
+ * same key and evicting the least recently used ones until it fits. Returns
+ * the entry with a reference taken for the caller
+ *
+ */
+cache_entry* cache_store(response_cache* cache, const char* key, size_t key_len, const char* header,
+	size_t header_len, const char* body, size_t body_len, uint64_t expires)
+{
+	cache_entry* entry = NULL;
+	size_t size = header_len + body_len + key_len;
+
+	if (size > cache->max_size) {
+		return(NULL);
+	}
+	HASH_FIND(hh, cache->entries, key, key_len, entry);
+	if (entry != NULL) {
+		cache_remove(cache, entry);
+	}
+	while (cache->entries != NULL && cache->size + size > cache->max_size) {
+		/* the head of the hash is the least recently used */
+		cache_remove(cache, cache->entries);
+		cache->evictions++;
+	}
+
+	entry = cache_entry_new(header, header_len, body, body_len);
+	if (entry == NULL) {
+		return(NULL);
+	}
+	entry->key = (char*)malloc(key_len);
+	if (entry->key == NULL) {
+		cache_entry_release(entry);
+		return(NULL);
+	}
+	memcpy(entry->key, key, key_len);
+	entry->key_len = key_len;
+	entry->expires = expires;
+	entry->refs = 2;
+	HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+	cache->size += size;
+	return(entry);
+}
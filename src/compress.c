@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef LUAREST_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compress.h"
+
+/* zlib's windowBits, 16 added selects the gzip wrapper */
+#define WINDOW_BITS 15
+#define WINDOW_BITS_GZIP (15 + 16)
+#define MEM_LEVEL 8
+
+/**
+ *
+ *
+ */
+static bool token_equals(const char* token, size_t len, const char* name)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (name[i] == '\0' || tolower((unsigned char)token[i]) != name[i]) {
+			return(false);
+		}
+	}
+	return(name[len] == '\0');
+}
+/**
+ * Parses the qvalue of an Accept-Encoding element, in thousandths
+ *
+ */
+static int parse_qvalue(const char* p, const char* end)
+{
+	int q = 0;
+	int scale = 1000;
+
+	if (p < end && *p == '1') {
+		return(1000);
+	}
+	if (p < end && *p == '0') {
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && scale > 1 && isdigit((unsigned char)*p)) {
+			scale /= 10;
+			q += (*p - '0') * scale;
+			p++;
+		}
+	}
+	return(q);
+}
+/**
+ * Picks the encoding of a response from the request's Accept-Encoding, the
+ * one with the highest qvalue, gzip if they are equal
+ *
+ */
+content_encoding compress_negotiate(const char* accept_encoding, size_t len)
+{
+	const char* p = accept_encoding;
+	const char* end = p + len;
+	const char* name;
+	size_t name_len;
+	int q;
+	int q_gzip = -1;
+	int q_deflate = -1;
+	int q_any = 0;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+			p++;
+		}
+		name = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+			p++;
+		}
+		name_len = p - name;
+		q = 1000;
+		while (p < end && *p != ',') {
+			if (*p == ';') {
+				p++;
+				while (p < end && (*p == ' ' || *p == '\t')) {
+					p++;
+				}
+				if (end - p > 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+					q = parse_qvalue(p + 2, end);
+				}
+			}
+			else {
+				p++;
+			}
+		}
+		if (token_equals(name, name_len, "gzip") || token_equals(name, name_len, "x-gzip")) {
+			q_gzip = q;
+		}
+		else if (token_equals(name, name_len, "deflate")) {
+			q_deflate = q;
+		}
+		else if (token_equals(name, name_len, "*")) {
+			q_any = q;
+		}
+	}
+	/* the wildcard stands for the encodings which aren't listed */
+	if (q_gzip < 0) {
+		q_gzip = q_any;
+	}
+	if (q_deflate < 0) {
+		q_deflate = q_any;
+	}
+	if (q_gzip > 0 && q_gzip >= q_deflate) {
+		return(CONTENT_ENCODING_GZIP);
+	}
+	if (q_deflate > 0) {
+		return(CONTENT_ENCODING_DEFLATE);
+	}
+	return(CONTENT_ENCODING_IDENTITY);
+}
+/**
+ * Compresses data in one go into a buffer allocated with malloc. Returns 
+ * NULL if compressing failed or didn't make the data smaller
+ *
+ */
+char* compress_body(content_encoding encoding, int level, const char* data, size_t len, size_t* out_len)
+{
+#ifdef LUAREST_HAVE_ZLIB
+	z_stream stream;
+	char* out;
+	uLong bound;
+	int ret;
+
+	if (encoding == CONTENT_ENCODING_IDENTITY) {
+		return(NULL);
+	}
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, level, Z_DEFLATED, encoding == CONTENT_ENCODING_GZIP ? WINDOW_BITS_GZIP : WINDOW_BITS,
+		MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return(NULL);
+	}
+	/* deflateBound doesn't account for the gzip wrapper */
+	bound = deflateBound(&stream, (uLong)len) + 18;
+	out = (char*)malloc(bound);
+	if (out == NULL) {
+		deflateEnd(&stream);
+		return(NULL);
+	}
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = (uInt)len;
+	stream.next_out = (Bytef*)out;
+	stream.avail_out = (uInt)bound;
+	ret = deflate(&stream, Z_FINISH);
+	*out_len = stream.total_out;
+	deflateEnd(&stream);
+	if (ret != Z_STREAM_END || *out_len >= len) {
+		free(out);
+		return(NULL);
+	}
+	return(out);
+#else
+	return(NULL);
+#endif
+}
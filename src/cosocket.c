@@ -0,0 +1,828 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "app.h"
+#include "cosocket.h"
+#include "thirdparty/utlist.h"
+
+#define LUA_USERDATA_TCP "luarest.tcp"
+#define LUA_USERDATA_COSOCKET_CTX "luarest.cosocket_ctx"
+
+/* Free space guaranteed in a connection's buffer for every read */
+#define COSOCKET_READ_SIZE (16 * 1024)
+
+/* The operation a connection is waiting for, at most one at a time */
+typedef enum cosocket_op {
+	COSOCKET_OP_NONE = 0,
+	COSOCKET_OP_RESOLVE,
+	COSOCKET_OP_CONNECT,
+	COSOCKET_OP_SEND,
+	COSOCKET_OP_RECEIVE
+} cosocket_op;
+
+typedef enum cosocket_receive {
+	COSOCKET_RECEIVE_BYTES = 0,
+	COSOCKET_RECEIVE_LINE,
+	COSOCKET_RECEIVE_ALL
+} cosocket_receive;
+
+struct cosocket_conn;
+
+/* The object returned by luarest.tcp(), the connection is only attached
+   between connect and close or setkeepalive */
+typedef struct tcp_object {
+	struct cosocket_conn* conn;
+	cosocket_ctx* ctx;
+	int timeout_ms;
+} tcp_object;
+
+typedef struct cosocket_resolve {
+	uv_getaddrinfo_t resolve_req;
+	struct cosocket_conn* conn;
+	int port;
+} cosocket_resolve;
+
+/* A connection outlives its tcp_object while it waits in a pool and until
+   both of its handles have been closed */
+typedef struct cosocket_conn {
+	uv_tcp_t handle;
+	uv_timer_t timer;
+	uv_connect_t connect_req;
+	uv_write_t write_req;
+	cosocket_ctx* ctx;
+	tcp_object* owner;
+	request* req;
+	cosocket_op op;
+	cosocket_receive mode;
+	size_t want;
+	size_t sent;
+	int send_ref;
+	cosocket_resolve* resolve;
+	char* buf;
+	size_t len;
+	size_t cap;
+	int connected;
+	int eof;
+	int closing;
+	int handles_open;
+	int reused;
+	struct cosocket_pool* pool;
+	struct cosocket_conn* prev;
+	struct cosocket_conn* next;
+	char key[COSOCKET_KEY_MAX];
+} cosocket_conn;
+
+/* Idle connections to one host:port */
+typedef struct cosocket_pool {
+	char key[COSOCKET_KEY_MAX];
+	cosocket_conn* idle;
+	int num_idle;
+	UT_hash_handle hh;
+} cosocket_pool;
+
+static void on_timer(uv_timer_t* timer, int status);
+
+/**
+ *
+ *
+ */
+static void on_conn_close(uv_handle_t* handle)
+{
+	cosocket_conn* conn = (cosocket_conn*)handle->data;
+
+	if (--conn->handles_open == 0) {
+		free(conn->buf);
+		free(conn);
+	}
+}
+/**
+ * Closes the connection, safe to call more than once. A request waiting on
+ * the connection is not resumed by this
+ *
+ */
+static void conn_close(cosocket_conn* conn)
+{
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = 1;
+	if (conn->pool != NULL) {
+		DL_DELETE(conn->pool->idle, conn);
+		conn->pool->num_idle--;
+		conn->pool = NULL;
+	}
+	if (conn->owner != NULL) {
+		conn->owner->conn = NULL;
+		conn->owner = NULL;
+	}
+	if (conn->resolve != NULL) {
+		/* on_resolved frees it */
+		conn->resolve->conn = NULL;
+		conn->resolve = NULL;
+	}
+	uv_timer_stop(&conn->timer);
+	uv_close((uv_handle_t*)&conn->handle, on_conn_close);
+	uv_close((uv_handle_t*)&conn->timer, on_conn_close);
+}
+/**
+ *
+ *
+ */
+static cosocket_conn* conn_new(cosocket_ctx* ctx, const char* key)
+{
+	cosocket_conn* conn = (cosocket_conn*)calloc(1, sizeof(cosocket_conn));
+
+	if (conn == NULL) {
+		return(NULL);
+	}
+	conn->ctx = ctx;
+	conn->send_ref = LUA_NOREF;
+	strcpy(conn->key, key);
+	uv_tcp_init(ctx->loop, &conn->handle);
+	uv_timer_init(ctx->loop, &conn->timer);
+	conn->handle.data = conn;
+	conn->timer.data = conn;
+	conn->handles_open = 2;
+	return(conn);
+}
+/**
+ * The pending operation has finished, the nresults values pushed onto the
+ * request's coroutine are returned by the suspended method
+ *
+ */
+static void op_done(cosocket_conn* conn, int nresults)
+{
+	request* req = conn->req;
+
+	uv_timer_stop(&conn->timer);
+	conn->op = COSOCKET_OP_NONE;
+	conn->req = NULL;
+	resume_application(req, nresults);
+}
+/**
+ *
+ *
+ */
+static void op_failed(cosocket_conn* conn, const char* msg)
+{
+	lua_pushnil(conn->req->co);
+	lua_pushstring(conn->req->co, msg);
+	op_done(conn, 2);
+}
+/**
+ * Closes the connection of a socket which is closed or connected again from
+ * Lua, a request which is waiting on the connection gets nil, "closed"
+ *
+ */
+static void conn_abandon(cosocket_conn* conn)
+{
+	if (conn->op == COSOCKET_OP_RECEIVE) {
+		uv_read_stop((uv_stream_t*)&conn->handle);
+	}
+	conn_close(conn);
+	if (conn->op != COSOCKET_OP_NONE) {
+		op_failed(conn, "closed");
+	}
+}
+/**
+ * The request went away while waiting, the connection is in an unknown
+ * state and can't be reused
+ *
+ */
+static void cancel_op(request* req)
+{
+	cosocket_conn* conn = (cosocket_conn*)req->wait_data;
+
+	conn->op = COSOCKET_OP_NONE;
+	conn->req = NULL;
+	conn_close(conn);
+}
+/**
+ *
+ *
+ */
+static int wait_op(lua_State* state, tcp_object* obj, cosocket_op op, request* req)
+{
+	cosocket_conn* conn = obj->conn;
+
+	conn->op = op;
+	conn->req = req;
+	uv_timer_start(&conn->timer, on_timer, obj->timeout_ms, 0);
+	return(suspend_request(state, req, cancel_op, conn));
+}
+/**
+ * Takes what the pending receive asked for from the buffer and pushes it
+ * onto state, returns the number of values pushed or 0 if it isn't there yet
+ *
+ */
+static int try_receive(cosocket_conn* conn, lua_State* state)
+{
+	size_t n = 0;
+	size_t len;
+	char* p;
+
+	switch (conn->mode) {
+		case COSOCKET_RECEIVE_BYTES:
+			if (conn->len < conn->want) {
+				return(0);
+			}
+			lua_pushlstring(state, conn->buf, conn->want);
+			n = conn->want;
+			break;
+		case COSOCKET_RECEIVE_LINE:
+			p = (char*)memchr(conn->buf, '\n', conn->len);
+			if (p == NULL) {
+				return(0);
+			}
+			n = p - conn->buf + 1;
+			len = n - 1;
+			if (len > 0 && conn->buf[len - 1] == '\r') {
+				len--;
+			}
+			lua_pushlstring(state, conn->buf, len);
+			break;
+		case COSOCKET_RECEIVE_ALL:
+			if (!conn->eof) {
+				return(0);
+			}
+			lua_pushlstring(state, conn->buf, conn->len);
+			n = conn->len;
+			break;
+	}
+	conn->len -= n;
+	if (conn->len > 0) {
+		memmove(conn->buf, conn->buf + n, conn->len);
+	}
+	return(1);
+}
+/**
+ * The connection was closed before the receive could be satisfied, returns
+ * nil, "closed" and whatever was received
+ *
+ */
+static int receive_closed(cosocket_conn* conn, lua_State* state)
+{
+	lua_pushnil(state);
+	lua_pushliteral(state, "closed");
+	lua_pushlstring(state, conn->buf, conn->len);
+	conn->len = 0;
+	return(3);
+}
+/**
+ *
+ *
+ */
+static void on_timer(uv_timer_t* timer, int status)
+{
+	cosocket_conn* conn = (cosocket_conn*)timer->data;
+
+	if (conn->pool != NULL) {
+		/* idle for too long */
+		conn_close(conn);
+		return;
+	}
+	if (conn->op == COSOCKET_OP_NONE) {
+		return;
+	}
+	if (conn->op == COSOCKET_OP_RECEIVE) {
+		uv_read_stop((uv_stream_t*)&conn->handle);
+	}
+	else {
+		/* the pending connect or write can't be taken back */
+		conn_close(conn);
+	}
+	op_failed(conn, "timeout");
+}
+/**
+ *
+ *
+ */
+static uv_buf_t on_alloc(uv_handle_t* handle, size_t suggested_size)
+{
+	cosocket_conn* conn = (cosocket_conn*)handle->data;
+	size_t cap;
+	char* buf;
+
+	if (conn->cap - conn->len < COSOCKET_READ_SIZE) {
+		cap = conn->cap * 2 > conn->len + COSOCKET_READ_SIZE ? conn->cap * 2 : conn->len + COSOCKET_READ_SIZE;
+		buf = (char*)realloc(conn->buf, cap);
+		if (buf == NULL) {
+			return(uv_buf_init(NULL, 0));
+		}
+		conn->buf = buf;
+		conn->cap = cap;
+	}
+	return(uv_buf_init(conn->buf + conn->len, conn->cap - conn->len));
+}
+/**
+ *
+ *
+ */
+static void on_read(uv_stream_t* stream, ssize_t nread, uv_buf_t buf)
+{
+	cosocket_conn* conn = (cosocket_conn*)stream->data;
+	int n;
+
+	if (nread > 0) {
+		conn->len += nread;
+	}
+	else if (nread < 0) {
+		conn->eof = 1;
+		uv_read_stop(stream);
+	}
+	if (conn->pool != NULL) {
+		if (nread != 0) {
+			/* an idle connection was closed or sent something unasked, 
+			   nothing was read on a spurious wakeup */
+			conn_close(conn);
+		}
+		return;
+	}
+	if (conn->op != COSOCKET_OP_RECEIVE) {
+		return;
+	}
+	n = try_receive(conn, conn->req->co);
+	if (n == 0 && conn->eof) {
+		n = receive_closed(conn, conn->req->co);
+	}
+	if (n > 0) {
+		uv_read_stop(stream);
+		op_done(conn, n);
+	}
+}
+/**
+ *
+ *
+ */
+static void on_connect(uv_connect_t* connect_req, int status)
+{
+	cosocket_conn* conn = (cosocket_conn*)connect_req->data;
+
+	if (conn->op != COSOCKET_OP_CONNECT) {
+		return;
+	}
+	if (status) {
+		conn_close(conn);
+		op_failed(conn, uv_strerror(uv_last_error(conn->ctx->loop)));
+		return;
+	}
+	conn->connected = 1;
+	lua_pushboolean(conn->req->co, 1);
+	op_done(conn, 1);
+}
+/**
+ *
+ *
+ */
+static int conn_connect(cosocket_conn* conn, struct sockaddr_in address)
+{
+	conn->connect_req.data = conn;
+	return(uv_tcp_connect(&conn->connect_req, &conn->handle, address, on_connect));
+}
+/**
+ *
+ *
+ */
+static void on_resolved(uv_getaddrinfo_t* resolve_req, int status, struct addrinfo* res)
+{
+	cosocket_resolve* resolve = (cosocket_resolve*)resolve_req->data;
+	cosocket_conn* conn = resolve->conn;
+	struct sockaddr_in address;
+
+	free(resolve);
+	if (conn == NULL) {
+		/* closed while resolving */
+		if (res != NULL) {
+			uv_freeaddrinfo(res);
+		}
+		return;
+	}
+	conn->resolve = NULL;
+	if (status || res == NULL) {
+		conn_close(conn);
+		op_failed(conn, "host not found");
+		return;
+	}
+	address = *(struct sockaddr_in*)res->ai_addr;
+	address.sin_port = htons((unsigned short)resolve->port);
+	uv_freeaddrinfo(res);
+
+	conn->op = COSOCKET_OP_CONNECT;
+	if (conn_connect(conn, address) != 0) {
+		conn_close(conn);
+		op_failed(conn, uv_strerror(uv_last_error(conn->ctx->loop)));
+	}
+}
+/**
+ *
+ *
+ */
+static request* check_request(lua_State* state)
+{
+	request* req = current_request(state);
+
+	if (req == NULL) {
+		luaL_error(state, "sockets can only be used by a service-callback");
+	}
+	return(req);
+}
+/**
+ * Returns the connection of sock if it is ready for the next operation,
+ * otherwise pushes nil, "closed" onto the stack
+ *
+ */
+static cosocket_conn* check_conn(lua_State* state, tcp_object* obj)
+{
+	if (obj->conn == NULL || !obj->conn->connected) {
+		lua_pushnil(state);
+		lua_pushliteral(state, "closed");
+		return(NULL);
+	}
+	if (obj->conn->op != COSOCKET_OP_NONE) {
+		luaL_error(state, "socket is busy");
+	}
+	return(obj->conn);
+}
+/**
+ * LUA syntax: luarest.tcp()
+ *
+ */
+static int l_tcp(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)lua_newuserdata(state, sizeof(tcp_object));
+
+	obj->conn = NULL;
+	obj->ctx = (cosocket_ctx*)lua_touserdata(state, lua_upvalueindex(1));
+	obj->timeout_ms = COSOCKET_TIMEOUT_MS;
+	luaL_getmetatable(state, LUA_USERDATA_TCP);
+	lua_setmetatable(state, -2);
+	return(1);
+}
+/**
+ * LUA syntax: sock:connect(host, port)
+ *
+ * Reuses an idle connection to host:port if there is one
+ *
+ * Return: true or nil and an error message
+ *
+ */
+static int l_connect(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+	const char* host = luaL_checkstring(state, 2);
+	int port = luaL_checkint(state, 3);
+	request* req = check_request(state);
+	char key[COSOCKET_KEY_MAX];
+	cosocket_pool* pool = NULL;
+	cosocket_conn* conn;
+	cosocket_resolve* resolve;
+	struct addrinfo hints;
+	struct sockaddr_in address;
+	int n;
+
+	luaL_argcheck(state, port >= 1 && port <= 65535, 3, "port out of range");
+	n = snprintf(key, COSOCKET_KEY_MAX, "%s:%d", host, port);
+	if (n < 0 || n >= COSOCKET_KEY_MAX) {
+		return(luaL_error(state, "host name too long"));
+	}
+	if (obj->conn != NULL) {
+		conn_abandon(obj->conn);
+	}
+	if (obj->conn != NULL) {
+		/* the request which was waiting connected the socket again */
+		return(luaL_error(state, "socket is busy"));
+	}
+
+	HASH_FIND_STR(obj->ctx->pools, key, pool);
+	if (pool != NULL && pool->idle != NULL) {
+		conn = pool->idle;
+		DL_DELETE(pool->idle, conn);
+		pool->num_idle--;
+		conn->pool = NULL;
+		conn->reused++;
+		uv_timer_stop(&conn->timer);
+		uv_read_stop((uv_stream_t*)&conn->handle);
+		conn->owner = obj;
+		obj->conn = conn;
+		lua_pushboolean(state, 1);
+		return(1);
+	}
+
+	conn = conn_new(obj->ctx, key);
+	if (conn == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+	conn->owner = obj;
+	obj->conn = conn;
+
+	address = uv_ip4_addr(host, port);
+	if (address.sin_addr.s_addr != INADDR_NONE || strcmp(host, "255.255.255.255") == 0) {
+		if (conn_connect(conn, address) != 0) {
+			conn_close(conn);
+			lua_pushnil(state);
+			lua_pushstring(state, uv_strerror(uv_last_error(obj->ctx->loop)));
+			return(2);
+		}
+		return(wait_op(state, obj, COSOCKET_OP_CONNECT, req));
+	}
+
+	/* not an address, resolve it on the loop's thread pool */
+	resolve = (cosocket_resolve*)malloc(sizeof(cosocket_resolve));
+	if (resolve == NULL) {
+		conn_close(conn);
+		return(luaL_error(state, "out of memory"));
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	resolve->conn = conn;
+	resolve->port = port;
+	resolve->resolve_req.data = resolve;
+	if (uv_getaddrinfo(obj->ctx->loop, &resolve->resolve_req, on_resolved, host, NULL, &hints) != 0) {
+		free(resolve);
+		conn_close(conn);
+		lua_pushnil(state);
+		lua_pushliteral(state, "host not found");
+		return(2);
+	}
+	conn->resolve = resolve;
+	return(wait_op(state, obj, COSOCKET_OP_RESOLVE, req));
+}
+/**
+ *
+ *
+ */
+static void on_write(uv_write_t* write_req, int status)
+{
+	cosocket_conn* conn = (cosocket_conn*)write_req->data;
+
+	luaL_unref(conn->ctx->lua_state, LUA_REGISTRYINDEX, conn->send_ref);
+	conn->send_ref = LUA_NOREF;
+	if (conn->op != COSOCKET_OP_SEND) {
+		return;
+	}
+	if (status) {
+		conn_close(conn);
+		op_failed(conn, uv_strerror(uv_last_error(conn->ctx->loop)));
+		return;
+	}
+	lua_pushinteger(conn->req->co, conn->sent);
+	op_done(conn, 1);
+}
+/**
+ * LUA syntax: sock:send(data)
+ *
+ * Return: the number of bytes sent or nil and an error message
+ *
+ */
+static int l_send(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+	request* req = check_request(state);
+	cosocket_conn* conn;
+	uv_buf_t buf;
+	size_t len;
+
+	luaL_checkstring(state, 2);
+	conn = check_conn(state, obj);
+	if (conn == NULL) {
+		return(2);
+	}
+
+	/* the string is written as is, pinned until the write has finished */
+	lua_pushvalue(state, 2);
+	buf.base = (char*)lua_tolstring(state, -1, &len);
+	buf.len = len;
+	conn->send_ref = luaL_ref(state, LUA_REGISTRYINDEX);
+	conn->sent = len;
+	conn->write_req.data = conn;
+	if (uv_write(&conn->write_req, (uv_stream_t*)&conn->handle, &buf, 1, on_write) != 0) {
+		luaL_unref(state, LUA_REGISTRYINDEX, conn->send_ref);
+		conn->send_ref = LUA_NOREF;
+		conn_close(conn);
+		lua_pushnil(state);
+		lua_pushstring(state, uv_strerror(uv_last_error(obj->ctx->loop)));
+		return(2);
+	}
+	return(wait_op(state, obj, COSOCKET_OP_SEND, req));
+}
+/**
+ * LUA syntax: sock:receive([pattern])
+ *
+ * pattern is the number of bytes to read, "*l" for a line without its CRLF
+ * (the default) or "*a" for everything until the peer closes the connection
+ *
+ * Return: the data or nil, an error message and the partial data
+ *
+ */
+static int l_receive(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+	request* req = check_request(state);
+	cosocket_conn* conn;
+	const char* pattern;
+	int n;
+
+	conn = check_conn(state, obj);
+	if (conn == NULL) {
+		return(2);
+	}
+	if (lua_type(state, 2) == LUA_TNUMBER) {
+		n = (int)lua_tointeger(state, 2);
+		luaL_argcheck(state, n >= 0, 2, "negative size");
+		conn->mode = COSOCKET_RECEIVE_BYTES;
+		conn->want = n;
+	}
+	else {
+		pattern = luaL_optstring(state, 2, "*l");
+		if (strcmp(pattern, "*l") == 0) {
+			conn->mode = COSOCKET_RECEIVE_LINE;
+		}
+		else if (strcmp(pattern, "*a") == 0) {
+			conn->mode = COSOCKET_RECEIVE_ALL;
+		}
+		else {
+			return(luaL_argerror(state, 2, "invalid pattern"));
+		}
+	}
+
+	n = try_receive(conn, state);
+	if (n > 0) {
+		return(n);
+	}
+	if (conn->eof) {
+		return(receive_closed(conn, state));
+	}
+	if (uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read) != 0) {
+		conn_close(conn);
+		lua_pushnil(state);
+		lua_pushstring(state, uv_strerror(uv_last_error(obj->ctx->loop)));
+		return(2);
+	}
+	return(wait_op(state, obj, COSOCKET_OP_RECEIVE, req));
+}
+/**
+ * LUA syntax: sock:settimeout(ms)
+ *
+ * Timeout of every following connect, send and receive
+ *
+ */
+static int l_settimeout(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+	int ms = luaL_checkint(state, 2);
+
+	luaL_argcheck(state, ms > 0, 2, "timeout must be positive");
+	obj->timeout_ms = ms;
+	return(0);
+}
+/**
+ * LUA syntax: sock:setkeepalive([timeout_ms[, pool_size]])
+ *
+ * Puts the connection into the pool of its host:port instead of closing it,
+ * the next connect to the same host:port may reuse it. A connection with
+ * unread data is closed
+ *
+ * Return: true or nil and an error message
+ *
+ */
+static int l_setkeepalive(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+	int timeout = luaL_optint(state, 2, COSOCKET_KEEPALIVE_TIMEOUT_MS);
+	int size = luaL_optint(state, 3, COSOCKET_KEEPALIVE_POOL_SIZE);
+	cosocket_pool* pool = NULL;
+	cosocket_conn* conn;
+
+	conn = check_conn(state, obj);
+	if (conn == NULL) {
+		return(2);
+	}
+	if (conn->len > 0 || conn->eof) {
+		conn_close(conn);
+		lua_pushnil(state);
+		lua_pushliteral(state, "unread data");
+		return(2);
+	}
+
+	HASH_FIND_STR(obj->ctx->pools, conn->key, pool);
+	if (pool == NULL) {
+		pool = (cosocket_pool*)calloc(1, sizeof(cosocket_pool));
+		if (pool == NULL) {
+			return(luaL_error(state, "out of memory"));
+		}
+		strcpy(pool->key, conn->key);
+		HASH_ADD_STR(obj->ctx->pools, key, pool);
+	}
+	if (pool->num_idle >= size) {
+		conn_close(conn);
+		lua_pushboolean(state, 1);
+		return(1);
+	}
+
+	conn->owner = NULL;
+	obj->conn = NULL;
+	conn->pool = pool;
+	DL_APPEND(pool->idle, conn);
+	pool->num_idle++;
+	/* reading tells us when the peer closes the idle connection */
+	uv_timer_start(&conn->timer, on_timer, timeout > 0 ? timeout : COSOCKET_KEEPALIVE_TIMEOUT_MS, 0);
+	uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read);
+	lua_pushboolean(state, 1);
+	return(1);
+}
+/**
+ * LUA syntax: sock:getreusedtimes()
+ *
+ * Return: how often the connection has been taken from the pool
+ *
+ */
+static int l_getreusedtimes(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+
+	if (obj->conn == NULL) {
+		lua_pushnil(state);
+		lua_pushliteral(state, "closed");
+		return(2);
+	}
+	lua_pushinteger(state, obj->conn->reused);
+	return(1);
+}
+/**
+ * LUA syntax: sock:close()
+ *
+ */
+static int l_close(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)luaL_checkudata(state, 1, LUA_USERDATA_TCP);
+
+	if (obj->conn == NULL) {
+		lua_pushnil(state);
+		lua_pushliteral(state, "closed");
+		return(2);
+	}
+	conn_abandon(obj->conn);
+	lua_pushboolean(state, 1);
+	return(1);
+}
+/**
+ *
+ *
+ */
+static int l_gc(lua_State* state)
+{
+	tcp_object* obj = (tcp_object*)lua_touserdata(state, 1);
+
+	if (obj->conn != NULL) {
+		conn_close(obj->conn);
+	}
+	return(0);
+}
+
+static const struct luaL_Reg l_tcp_methods [] = {
+	{"connect", l_connect},
+	{"send", l_send},
+	{"receive", l_receive},
+	{"settimeout", l_settimeout},
+	{"setkeepalive", l_setkeepalive},
+	{"getreusedtimes", l_getreusedtimes},
+	{"close", l_close},
+	{"__gc", l_gc},
+	{NULL, NULL} /* sentinel */
+};
+
+/**
+ * Registers luarest.tcp(), the luarest table has to exist already
+ *
+ */
+cosocket_ctx* luaopen_cosocket(lua_State* state, uv_loop_t* loop)
+{
+	cosocket_ctx* ctx = (cosocket_ctx*)lua_newuserdata(state, sizeof(cosocket_ctx));
+
+	ctx->lua_state = state;
+	ctx->loop = loop;
+	ctx->pools = NULL;
+	lua_setfield(state, LUA_REGISTRYINDEX, LUA_USERDATA_COSOCKET_CTX);
+
+	luaL_newmetatable(state, LUA_USERDATA_TCP);
+	lua_pushvalue(state, -1);
+	lua_setfield(state, -2, "__index");
+	luaL_register(state, NULL, l_tcp_methods);
+	lua_pop(state, 1);
+
+	lua_getglobal(state, "luarest");
+	lua_pushlightuserdata(state, ctx);
+	lua_pushcclosure(state, l_tcp, 1);
+	lua_setfield(state, -2, "tcp");
+	lua_pop(state, 1);
+
+	return(ctx);
+}
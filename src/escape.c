@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "escape.h"
 
 #ifndef TOASCII
@@ -96,4 +98,120 @@ luarest_status url_unescape(const char* src, char* target)
 	*q++ = 0;
     
 	return(LUAREST_SUCCESS);
-}
\ No newline at end of file
+}
+/**
+ *
+ *
+ */
+static int hex_value(char c)
+{
+	return(c >= '0' && c <= '9' ? c - '0'
+		: c >= 'A' && c <= 'F' ? c - 'A' + 10
+		: c >= 'a' && c <= 'f' ? c - 'a' + 10
+		: -1);
+}
+/**
+ * Decodes the character at *src and moves *src past it. "+" stands for a 
+ * space, a "%" not followed by two hex digits is kept as it is
+ *
+ */
+static char decode_char(const char** src, const char* end)
+{
+	const char* p = *src;
+	int hi;
+	int lo;
+
+	if (*p == '+') {
+		*src = p + 1;
+		return(' ');
+	}
+	if (*p == HEX_ESCAPE && end - p > 2 && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0) {
+		*src = p + 3;
+		return((char)(hi * 16 + lo));
+	}
+	*src = p + 1;
+	return(*p);
+}
+/**
+ * Decodes len bytes of a form-urlencoded string into target, which may be
+ * src itself. Returns the decoded length
+ *
+ */
+size_t url_decode(const char* src, size_t len, char* target)
+{
+	const char* end = src + len;
+	char* q = target;
+
+	while (src < end) {
+		*q++ = decode_char(&src, end);
+	}
+	return(q - target);
+}
+/**
+ * Compares len bytes of a form-urlencoded string with s once decoded, 
+ * without decoding it into a buffer
+ *
+ */
+bool url_decoded_equals(const char* src, size_t len, const char* s, size_t s_len)
+{
+	const char* end = src + len;
+	const char* s_end = s + s_len;
+
+	/* decoding never makes a string longer */
+	if (s_len > len) {
+		return(false);
+	}
+	while (src < end && s < s_end) {
+		if (decode_char(&src, end) != *s++) {
+			return(false);
+		}
+	}
+	return(src == end && s == s_end);
+}
+/**
+ * Upper bound of the key=value pairs of a form-urlencoded string
+ *
+ */
+size_t url_count_pairs(const char* src, size_t len)
+{
+	const char* end = src + len;
+	size_t n = 0;
+
+	while (src < end && (src = (const char*)memchr(src, '&', end - src)) != NULL) {
+		src++;
+		n++;
+	}
+	return(len > 0 ? n + 1 : 0);
+}
+/**
+ * Splits the next pair off a form-urlencoded string, key and value are 
+ * left escaped. Empty pairs are skipped, a key without "=" has an empty
+ * value. Returns false at the end of the string
+ *
+ */
+bool url_next_pair(const char** p, const char* end, const char** key, size_t* key_len,
+	const char** value, size_t* value_len)
+{
+	const char* s = *p;
+	const char* amp;
+	const char* eq;
+
+	while (s < end && *s == '&') {
+		s++;
+	}
+	if (s == end) {
+		*p = s;
+		return(false);
+	}
+	amp = (const char*)memchr(s, '&', end - s);
+	if (amp == NULL) {
+		amp = end;
+	}
+	eq = (const char*)memchr(s, '=', amp - s);
+	*key = s;
+	*key_len = (eq ? eq : amp) - s;
+	*value = eq ? eq + 1 : amp;
+	*value_len = amp - *value;
+	*p = amp;
+	return(true);
+}
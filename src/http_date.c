@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "http_date.h"
+
+static const char day_names[7][4] = {
+	"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"
+};
+
+static const char month_names[12][4] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/**
+ * Days since 1970-01-01 of a date of the proleptic Gregorian calendar, 
+ * month is 1 based
+ *
+ */
+static long days_from_civil(long year, int month, int day)
+{
+	long era;
+	long yoe;
+	long doy;
+
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	return(era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468);
+}
+/**
+ * Writes t as IMF-fixdate to target, which has room for HTTP_DATE_LEN + 1 
+ * chars. Doesn't depend on the locale or the timezone
+ *
+ */
+void http_date_format(time_t t, char* target)
+{
+	long days = (long)(t / 86400);
+	long secs = (long)(t % 86400);
+	long era;
+	long doe;
+	long yoe;
+	long doy;
+	long mp;
+	long year;
+	int month;
+	int day;
+
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	/* inverse of days_from_civil */
+	era = (days + 719468 >= 0 ? days + 719468 : days + 719468 - 146096) / 146097;
+	doe = days + 719468 - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	month = (int)(mp < 10 ? mp + 3 : mp - 9);
+	year = yoe + era * 400 + (month <= 2);
+
+	sprintf(target, "%s, %02d %s %04ld %02ld:%02ld:%02ld GMT",
+		day_names[((days % 7) + 7) % 7], day, month_names[month - 1], year,
+		secs / 3600, (secs / 60) % 60, secs % 60);
+}
+/**
+ *
+ *
+ */
+static bool parse_number(const char* src, int digits, int* value)
+{
+	int i;
+
+	*value = 0;
+	for (i = 0; i < digits; i++) {
+		if (src[i] < '0' || src[i] > '9') {
+			return(false);
+		}
+		*value = *value * 10 + (src[i] - '0');
+	}
+	return(true);
+}
+/**
+ * Parses an IMF-fixdate, the only format senders are allowed to generate.
+ * The obsolete RFC 850 and asctime formats are rejected, a conditional 
+ * request carrying them is answered in full
+ *
+ */
+luarest_status http_date_parse(const char* src, size_t len, time_t* t)
+{
+	int day;
+	int month;
+	int year;
+	int hour;
+	int min;
+	int sec;
+
+	if (len != HTTP_DATE_LEN || src[3] != ',' || src[4] != ' ' || src[7] != ' ' || 
+		src[11] != ' ' || src[16] != ' ' || src[19] != ':' || src[22] != ':' || 
+		memcmp(src + 25, " GMT", 4) != 0) {
+		return(LUAREST_ERROR);
+	}
+	for (month = 0; month < 12; month++) {
+		if (memcmp(src + 8, month_names[month], 3) == 0) {
+			break;
+		}
+	}
+	if (month == 12 || !parse_number(src + 5, 2, &day) || !parse_number(src + 12, 4, &year) ||
+		!parse_number(src + 17, 2, &hour) || !parse_number(src + 20, 2, &min) || 
+		!parse_number(src + 23, 2, &sec)) {
+		return(LUAREST_ERROR);
+	}
+	if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) {
+		return(LUAREST_ERROR);
+	}
+	*t = (time_t)days_from_civil(year, month + 1, day) * 86400 + hour * 3600 + min * 60 + sec;
+	return(LUAREST_SUCCESS);
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luarest_ffi.h"
+
+#define LUA_USERDATA_FFI_CONTEXT "luarest.ffi_context"
+
+/* Smallest output buffer allocated by reserve */
+#define FFI_OUTPUT_MIN 4096
+
+/* The leading fields of struct request (app.h), header_t and slice_t must 
+   match the declarations below */
+static const char ffi_module[] =
+	"local ffi = require('ffi')\n"
+	"ffi.cdef[[\n"
+	"typedef struct { char* base; size_t len; } luarest_slice;\n"
+	"typedef struct { luarest_slice field; luarest_slice value; } luarest_header;\n"
+	"typedef struct {\n"
+	"  int method;\n"
+	"  luarest_slice path;\n"
+	"  luarest_slice query;\n"
+	"  luarest_header* headers;\n"
+	"  int num_headers;\n"
+	"  luarest_slice body;\n"
+	"} luarest_request;\n"
+	"typedef struct {\n"
+	"  luarest_request* req;\n"
+	"  char* out_data;\n"
+	"  size_t out_len;\n"
+	"  size_t out_cap;\n"
+	"} luarest_ffi_context;\n"
+	"]]\n"
+	"local ctx_ptr, reserve = ...\n"
+	"local ctx = ffi.cast('luarest_ffi_context*', ctx_ptr)\n"
+	"local M = {}\n"
+	/* the request of the running service-callback */
+	"function M.request()\n"
+	"  local req = ctx.req\n"
+	"  if req == nil then error('no request is being processed', 2) end\n"
+	"  return req\n"
+	"end\n"
+	/* case-insensitive header lookup, returns a slice */
+	"function M.header(name)\n"
+	"  local req, n = M.request(), #name\n"
+	"  local lname = name:lower()\n"
+	"  for i = 0, req.num_headers - 1 do\n"
+	"    local f = req.headers[i].field\n"
+	"    if f.len == n and ffi.string(f.base, n):lower() == lname then\n"
+	"      return req.headers[i].value\n"
+	"    end\n"
+	"  end\n"
+	"  return nil\n"
+	"end\n"
+	/* returns a pointer to at least n writable bytes of the output buffer */
+	"function M.reserve(n)\n"
+	"  if ctx.out_len + n > ctx.out_cap then reserve(n) end\n"
+	"  return ctx.out_data + ctx.out_len\n"
+	"end\n"
+	/* marks n reserved bytes as written */
+	"function M.commit(n)\n"
+	"  ctx.out_len = ctx.out_len + n\n"
+	"end\n"
+	"function M.write(s, n)\n"
+	"  n = n or #s\n"
+	"  ffi.copy(M.reserve(n), s, n)\n"
+	"  ctx.out_len = ctx.out_len + n\n"
+	"end\n"
+	"return M\n";
+
+/**
+ * Grows the output buffer to hold at least n more bytes
+ *
+ */
+static int l_reserve(lua_State* state)
+{
+	ffi_context* ctx = (ffi_context*)lua_touserdata(state, lua_upvalueindex(1));
+	size_t n = (size_t)luaL_checkinteger(state, 1);
+	size_t cap = ctx->out_cap ? ctx->out_cap : FFI_OUTPUT_MIN;
+	char* data;
+
+	while (cap < ctx->out_len + n) {
+		cap *= 2;
+	}
+	data = (char*)realloc(ctx->out_data, cap);
+	if (data == NULL) {
+		return(luaL_error(state, "out of memory"));
+	}
+	ctx->out_data = data;
+	ctx->out_cap = cap;
+	return(0);
+}
+/**
+ * package.preload loader of "luarest.ffi"
+ *
+ */
+static int l_load_module(lua_State* state)
+{
+	if (luaL_loadbuffer(state, ffi_module, sizeof(ffi_module) - 1, "luarest.ffi") != 0) {
+		return(lua_error(state));
+	}
+	lua_pushvalue(state, lua_upvalueindex(1));
+	lua_pushvalue(state, lua_upvalueindex(1));
+	lua_pushcclosure(state, l_reserve, 1);
+	lua_call(state, 2, 1);
+	return(1);
+}
+/**
+ *
+ *
+ */
+static int l_context_gc(lua_State* state)
+{
+	ffi_context* ctx = (ffi_context*)lua_touserdata(state, 1);
+
+	free(ctx->out_data);
+	ctx->out_data = NULL;
+	return(0);
+}
+/**
+ * Creates the context of the lua_State and registers the "luarest.ffi"
+ * module, it only works with LuaJIT
+ *
+ */
+ffi_context* luaopen_luarest_ffi(lua_State* state)
+{
+	ffi_context* ctx = (ffi_context*)lua_newuserdata(state, sizeof(ffi_context));
+
+	memset(ctx, 0, sizeof(ffi_context));
+	luaL_newmetatable(state, LUA_USERDATA_FFI_CONTEXT);
+	lua_pushcfunction(state, l_context_gc);
+	lua_setfield(state, -2, "__gc");
+	lua_setmetatable(state, -2);
+	lua_pushvalue(state, -1);
+	lua_setfield(state, LUA_REGISTRYINDEX, LUA_USERDATA_FFI_CONTEXT);
+
+	/* package.preload["luarest.ffi"] */
+	lua_getglobal(state, "package");
+	lua_getfield(state, -1, "preload");
+	lua_pushvalue(state, -3);
+	lua_pushcclosure(state, l_load_module, 1);
+	lua_setfield(state, -2, "luarest.ffi");
+	lua_pop(state, 3);
+
+	return(ctx);
+}
+/**
+ * Exchanges the output buffer of the context with out
+ *
+ */
+void ffi_swap_output(ffi_context* ctx, ffi_output* out)
+{
+	ffi_output tmp;
+
+	tmp.data = ctx->out_data;
+	tmp.len = ctx->out_len;
+	tmp.cap = ctx->out_cap;
+	ctx->out_data = out->data;
+	ctx->out_len = out->len;
+	ctx->out_cap = out->cap;
+	*out = tmp;
+}
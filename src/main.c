@@ -1,6 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <stddef.h>
+#include <limits.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
 #include <uv.h>
 #include <uv-private/ngx-queue.h>
 #include <http_parser.h>
@@ -8,10 +15,15 @@
 #include "thirdparty/utlist.h"
 
 #include "app.h"
+#include "pool.h"
+#include "timer_wheel.h"
+#include "arena.h"
+#include "http_date.h"
+#include "upload.h"
 
-#define CHECK(r, msg) \
+#define CHECK(loop, r, msg) \
   if (r) { \
-    uv_err_t err = uv_last_error(uv_loop); \
+    uv_err_t err = uv_last_error(loop); \
     fprintf(stderr, "%s: %s\n", msg, uv_strerror(err)); \
     exit(1); \
   }
@@ -20,197 +32,1407 @@
 #define LOGF(fmt, params) printf(fmt "\n", params);
 #define LOG_ERROR(msg) puts(msg);
 
-/* Set keep-alive timeout to 75s */
+/* Default timeouts: keep-alive 75s, reading the request headers 10s, 
+   reading the request body 30s and answering a request 60s. The last one
+   starts over whenever a write of the connection completes */
 #define HTTP_KEEP_ALIVE_TIMEOUT_SEC 75
+#define HTTP_HEADER_TIMEOUT_SEC 10
+#define HTTP_BODY_TIMEOUT_SEC 30
+#define HTTP_REQUEST_TIMEOUT_SEC 60
 
-#define RESPONSE_HEADER "HTTP/1.1 200 OK\r\n"
-#define RESPONSE_CONTENT_TYPE "Content-Type: %s\r\n"
-#define RESPONSE_CONTENT_LENGTH "Content-Length: %d\r\n"
+/* After a rejected request the connection is shut down for writing and the
+   rest of the request is read and discarded for up to this long, closing
+   it with unread data would reset it and could destroy the response */
+#define LINGER_TIMEOUT_SEC 5
+
+/* Request bodies are buffered in the request's arena up to this size unless
+   the route sets max_body. A body of unknown length starts with a buffer of
+   REQUEST_BODY_INITIAL bytes which doubles as needed */
+#define HTTP_MAX_BODY_SIZE (1024 * 1024)
+#define REQUEST_BODY_INITIAL 4096
+
+/* Resolution of the connection timeouts */
+#define TIMER_WHEEL_TICK_MS 100
+
+#define RESPONSE_STATUS_LINE "HTTP/1.1 %s\r\n"
+#define RESPONSE_CONTENT_TYPE "Content-Type: "
+#define RESPONSE_CONTENT_LENGTH "Content-Length: "
+#define RESPONSE_TRANSFER_ENCODING_CHUNKED "Transfer-Encoding: chunked\r\n"
 #define RESPONSE_CONNECTION_KEEP_ALIVE "Connection: Keep-Alive\r\n"
+#define RESPONSE_DATE "Date: "
+#define RESPONSE_ETAG "ETag: "
+#define RESPONSE_LAST_MODIFIED "Last-Modified: "
+#define RESPONSE_CONTENT_ENCODING "Content-Encoding: "
+#define RESPONSE_VARY_ACCEPT_ENCODING "Vary: Accept-Encoding\r\n"
+#define RESPONSE_HEADER_END "\r\n"
 #define RESPONSE_HEADER_COMPLETE "\r\n"
 
-static uv_loop_t* uv_loop;
-static uv_tcp_t server;
+/* Status line, Content-Type and Connection of every combination of status,
+   content type and keep-alive are rendered once at startup */
+#define HEADER_TEMPLATE_MAX 128
+#define PUT_LITERAL(p, end, literal) put_header(p, end, literal, sizeof(literal) - 1)
+
+/* Chunk framing, the CRLF closing a chunk's data is sent in front of the
+   next chunk's size or the last chunk */
+#define CHUNK_HEADER_FIRST "%lx\r\n"
+#define CHUNK_HEADER "\r\n%lx\r\n"
+#define CHUNK_LAST_FIRST "0\r\n\r\n"
+#define CHUNK_LAST "\r\n0\r\n\r\n"
+
+/* Upper bound of the rendered status line and headers, leaves room for the
+   server's own lines next to RESPONSE_HEADERS_MAX bytes added by the app */
+#define RESPONSE_HEADER_MAX 1536
+
+/* Chunk framing, interim responses and the Date line sent in place of the
+   one of a cache entry fit into the frame of a response */
+#define RESPONSE_FRAME_MAX 40
+
+/* Port the workers listen on */
+#define LUAREST_PORT 8000
+
+/* Size of the pooled read buffers and how many idle ones a worker keeps */
+#define READ_BUFFER_SIZE (64 * 1024)
+#define READ_BUFFER_POOL_MAX 64
+#define RESPONSE_POOL_MAX 1024
+#define CLIENT_POOL_MAX 4096
+
+/* Block size of the per-connection request arena and the number of header
+   slots allocated up-front */
+#define REQUEST_ARENA_BLOCK_SIZE 4096
+#define REQUEST_HEADERS_INITIAL 16
+
+/* Maximum number of buffers handed to a single uv_write */
+#define FLUSH_MAX_BUFS 64
+
+/* A streaming service-callback is suspended while more than the high-water
+   mark is waiting in the connection's write queue and resumed once it 
+   drained below the low-water mark */
+#define STREAM_HIGH_WATER (256 * 1024)
+#define STREAM_LOW_WATER (64 * 1024)
+
+/* uv_tcp_t keeps its descriptor private, sendfile needs it */
+#ifdef WIN32
+#define SOCKET_FD(handle) (-1)
+#else
+#define SOCKET_FD(handle) ((handle)->io_watcher.fd)
+#endif
+
 static http_parser_settings parser_settings;
-static application* apps = NULL;
+static char* app_dir = NULL;
+static int num_workers = 0;
+static int idle_timeout_sec = HTTP_KEEP_ALIVE_TIMEOUT_SEC;
+static int header_timeout_sec = HTTP_HEADER_TIMEOUT_SEC;
+static int body_timeout_sec = HTTP_BODY_TIMEOUT_SEC;
+static int request_timeout_sec = HTTP_REQUEST_TIMEOUT_SEC;
+static size_t max_body_size = HTTP_MAX_BODY_SIZE;
+static const char* upload_dir = NULL;
+static int compress_level = COMPRESS_LEVEL;
+static int compress_min_size = COMPRESS_MIN_SIZE;
+
+typedef struct header_template {
+	char data[HEADER_TEMPLATE_MAX];
+	size_t len;
+} header_template;
+
+/* Indexed by luarest_response, content_type (the sentinel renders no 
+   Content-Type) and whether Connection: Keep-Alive is sent. Written before
+   the workers start, read only afterwards */
+static header_template header_templates[LUAREST_NUM_RESPONSES][LUAREST_NUM_CONTENT_TYPES][2];
+
+struct client_t;
 
-typedef struct header_t {
-	UT_string* field;
-	UT_string* value;
-} header_t;
+/* Every worker owns an event loop, a listening socket bound with SO_REUSEPORT
+   and its own set of applications (one lua_State per app), so workers never
+   share any mutable state and can run on separate cores */
+typedef struct worker_t {
+	int id;
+	uv_loop_t* loop;
+	uv_tcp_t server;
+	uv_thread_t thread;
+	uv_timer_t wheel_ticker;
+	timer_wheel timeouts;
+	/* the Date header line, rendered again whenever the second changes */
+	time_t date_time;
+	char date_header[sizeof(RESPONSE_DATE) + HTTP_DATE_LEN + sizeof(RESPONSE_HEADER_END)];
+	size_t date_header_len;
+	application* apps;
+	struct client_t* connections;
+	int conn_counter;
+	pool_t read_buffers;
+	pool_t responses;
+	pool_t headers;
+	pool_t batches;
+	pool_t clients;
+} worker_t;
 
+static worker_t* workers = NULL;
+
+/* A response rendered by process_request, the status line and headers live
+   in a header block of the worker's pool, the body points straight into the
+   Lua string. A streamed response is queued as one response_t per chunk,
+   header points to the chunk framing in frame. A response sent from a cache
+   entry has no header of its own, the current Date line is copied to frame
+   when it is written. The response of a suspended request is queued before
+   it is ready, so it keeps its place in front of the responses queued 
+   after it */
 typedef struct response_t {
 	ngx_queue_t queue;
-
+	int ready;
+	char* header;
+	size_t header_len;
+	response_body body;
+	char frame[RESPONSE_FRAME_MAX];
 } response_t;
 
+/* Responses are flushed in batches, one uv_write carries all responses 
+   which were queued on the connection since the last flush */
+typedef struct write_batch_t {
+	uv_write_t write_req;
+	ngx_queue_t responses;
+	struct client_t* client;
+} write_batch_t;
+
+/* The file of a response which is being sent, in_flight while a worker
+   thread calls sendfile */
+typedef struct sendfile_t {
+	uv_fs_t fs;
+	bool in_flight;
+	struct client_t* client;
+	response_t* response;
+} sendfile_t;
+
+/* Tells when the socket takes more of a file after sendfile found its 
+   buffer full. The tcp handle owns the descriptor's watcher, the poll 
+   handle watches a duplicate which lives as long as the connection, so
+   libuv's epoll registration never outlives it */
+typedef struct write_poll_t {
+	uv_poll_t handle;
+	int fd;
+} write_poll_t;
+
+/* Connections are recycled through the worker's pool. The fields used on 
+   every read and write come first so they share the first cache lines, the
+   bookkeeping which is only touched on connect, close or timeouts comes last */
 typedef struct client_t {
+  /* hot */
   uv_tcp_t handle;
-  http_parser* parser;
-  uv_write_t write_req;
-  int conn_num;
-  UT_string* url;
-  UT_string* path;
-  UT_string* query;
-  luarest_method req_method;
+  http_parser parser;
+  worker_t* worker;
+  int closing;
+  int in_message;
   int keep_alive_header;
   int should_keep_alive;
-  int message_complete;
+  int writes_in_flight;
+  int pending;
+  int chunked;
+  int chunks_written;
+  request req;
+  response_t* head;
+  sendfile_t* sending;
+  write_poll_t* writable;
+  slice_t url;
   int num_header_fields;
   int num_header_values;
-  int idle_time_sec;
-  header_t* headers;
   int headers_len;
+  size_t body_cap;
+  size_t body_read;
+  size_t body_limit;
+  luarest_response rejected;
+  /* 1 while the response to a rejected request is written, 2 once the 
+     connection is shut down for writing */
+  int lingering;
+  upload* upload;
+  int upload_stalled;
+  int upload_waiting;
+  arena_t arena;
+  ngx_queue_t responses;
+  /* cold */
+  uv_shutdown_t shutdown_req;
+  char* backlog;
+  size_t backlog_len;
+  wheel_timer timeout;
+  int conn_num;
   struct client_t* prev;
   struct client_t* next;
 } client_t;
 
-static int conn_counter;
-static client_t* connections = NULL;
+/**
+ * 
+ *
+ */
+static void release_response(worker_t* worker, response_t* response)
+{
+	release_response_body(&response->body);
+	if (response->header != response->frame) {
+		pool_put(&worker->headers, response->header);
+	}
+	pool_put(&worker->responses, response);
+}
+/**
+ * Only the response to a request gets a header block, the header of any
+ * other is its frame. Returns NULL if no memory is left, the caller closes
+ * the connection
+ *
+ */
+static response_t* new_response(worker_t* worker, bool header_block)
+{
+	response_t* response = (response_t*)pool_get(&worker->responses);
+
+	if (response == NULL) {
+		return(NULL);
+	}
+	response->header = response->frame;
+	if (header_block) {
+		response->header = (char*)pool_get(&worker->headers);
+		if (response->header == NULL) {
+			pool_put(&worker->responses, response);
+			return(NULL);
+		}
+	}
+	response->ready = 0;
+	response->header_len = 0;
+	response->body.data = NULL;
+	response->body.len = 0;
+	response->body.lua_state = NULL;
+	response->body.owned = NULL;
+	response->body.owned_pool = NULL;
+	response->body.cached = NULL;
+	response->body.file = NULL;
+	return(response);
+}
+/**
+ * 
+ *
+ */
+static void on_close(uv_handle_t* handle) {
+	client_t* client = (client_t*)handle->data;
+	ngx_queue_t* q;
+	
+	LOGF("[ %5d ] connection closed", client->conn_num);
+
+	timer_wheel_remove(&client->worker->timeouts, &client->timeout);
+
+	if (client->pending) {
+		cancel_application(&client->req);
+		client->pending = 0;
+	}
+	free(client->backlog);
+	client->backlog = NULL;
+	if (client->upload != NULL) {
+		upload_release(client->upload);
+		client->upload = NULL;
+	}
+
+	/* responses which never made it into a write */
+	while (!ngx_queue_empty(&client->responses)) {
+		q = ngx_queue_head(&client->responses);
+		ngx_queue_remove(q);
+		release_response(client->worker, ngx_queue_data(q, response_t, queue));
+	}
+	
+	DL_DELETE(client->worker->connections, client);
+
+	/* a pooled connection keeps the blocks of its arena */
+	arena_reset(&client->arena);
+	if (client->worker->clients.num_free >= client->worker->clients.max_free) {
+		arena_destroy(&client->arena);
+	}
+	pool_put(&client->worker->clients, client);
+}
+/**
+ * The file has been sent or won't be, a response still queued is released
+ * by the caller or on_close
+ *
+ */
+static void end_sendfile(sendfile_t* sf)
+{
+	sf->client->sending = NULL;
+	sf->client->writes_in_flight--;
+	if (sf->client->writable != NULL) {
+		uv_poll_stop(&sf->client->writable->handle);
+	}
+	free(sf);
+}
+/**
+ *
+ *
+ */
+static void on_write_poll_close(uv_handle_t* handle)
+{
+	write_poll_t* wp = (write_poll_t*)handle->data;
+
+	close(wp->fd);
+	free(wp);
+}
+/**
+ * Closes the socket of the connection and the poll handle on its duplicate
+ *
+ */
+static void close_socket(client_t* client)
+{
+	if (client->writable != NULL) {
+		client->writable->handle.data = client->writable;
+		uv_close((uv_handle_t*)&client->writable->handle, on_write_poll_close);
+		client->writable = NULL;
+	}
+	uv_close((uv_handle_t*) &client->handle, on_close);
+}
+/**
+ * Closes the connection, safe to call more than once
+ *
+ */
+static void close_client(client_t* client)
+{
+	if (client->closing == 2) {
+		return;
+	}
+	client->closing = 2;
+	if (client->sending != NULL) {
+		if (client->sending->in_flight) {
+			/* a worker thread still writes to the socket, on_sendfile closes it */
+			return;
+		}
+		end_sendfile(client->sending);
+	}
+	close_socket(client);
+}
+/**
+ * The idle, header, body or request timeout of a connection expired. A
+ * pending request is cancelled right away, its callback may be waiting for
+ * something which never happens
+ *
+ */
+static void on_client_timeout(wheel_timer* timer)
+{
+	client_t* client = (client_t*)timer->data;
+
+	printf("Timeout on connection %d\n", client->conn_num);
+	if (client->pending) {
+		cancel_application(&client->req);
+		client->pending = 0;
+	}
+	close_client(client);
+}
+/**
+ * Arms the connection's only timer, which one depends on what the 
+ * connection is waiting for
+ *
+ */
+static void set_client_timeout(client_t* client, int timeout_sec)
+{
+	timer_wheel_add(&client->worker->timeouts, &client->timeout, timeout_sec * 1000);
+}
+/**
+ * Renders the worker's Date header line, at most once per second as the
+ * formatted date only changes that often
+ *
+ */
+static void update_date_header(worker_t* worker)
+{
+	time_t now = time(NULL);
+	char* p = worker->date_header;
+
+	if (now == worker->date_time) {
+		return;
+	}
+	worker->date_time = now;
+	memcpy(p, RESPONSE_DATE, sizeof(RESPONSE_DATE) - 1);
+	p += sizeof(RESPONSE_DATE) - 1;
+	http_date_format(now, p);
+	p += HTTP_DATE_LEN;
+	memcpy(p, RESPONSE_HEADER_END, sizeof(RESPONSE_HEADER_END) - 1);
+	p += sizeof(RESPONSE_HEADER_END) - 1;
+	worker->date_header_len = p - worker->date_header;
+}
+/**
+ * Catches the worker's timer wheel up with the loop time, the same tick
+ * keeps the Date header current
+ *
+ */
+static void on_wheel_tick(uv_timer_t* timer, int status)
+{
+	worker_t* worker = (worker_t*)timer->data;
+	unsigned long now = (unsigned long)(uv_now(worker->loop) / TIMER_WHEEL_TICK_MS);
+
+	CHECK(worker->loop, status, "timer wheel");
+	if (now > worker->timeouts.current) {
+		timer_wheel_advance(&worker->timeouts, now - worker->timeouts.current);
+	}
+	update_date_header(worker);
+}
+/**
+ * Read buffers are taken from the worker's pool and handed back as soon as 
+ * the read is processed, so idle connections don't hold on to a buffer
+ *
+ */
+static uv_buf_t on_alloc(uv_handle_t* handle, size_t suggested_size) {
+	client_t* client = (client_t*)handle->data;
+	pool_t* pool = &client->worker->read_buffers;
+	uv_buf_t buf;
+
+	buf.base = (char*)pool_get(pool);
+	buf.len = buf.base ? pool->block_size : 0;
+	return(buf);
+}
+static void flush_responses(client_t* client);
+static void send_file_part(sendfile_t* sf);
+/**
+ * A batch has been handed to the kernel, only now the bodies may be 
+ * released by their lua_State
+ *
+ */
+static void on_write(uv_write_t* req, int status) {
+	write_batch_t* batch = (write_batch_t*)req->data;
+	client_t* client = batch->client;
+	ngx_queue_t* q;
+
+	if (status) {
+		UVERR(uv_last_error(req->handle->loop), "write");
+		close_client(client);
+	}
+
+	while (!ngx_queue_empty(&batch->responses)) {
+		q = ngx_queue_head(&batch->responses);
+		ngx_queue_remove(q);
+		release_response(client->worker, ngx_queue_data(q, response_t, queue));
+	}
+	pool_put(&client->worker->batches, batch);
+
+	client->writes_in_flight--;
+	if (client->pending && client->closing != 2) {
+		/* the client is reading, the pending request gets more time */
+		set_client_timeout(client, request_timeout_sec);
+	}
+	if (client->writes_in_flight == 0 && client->closing != 2) {
+		/* a file queued behind this write can go now, or the connection be closed */
+		flush_responses(client);
+	}
+	if (client->req.waiting == REQUEST_WAIT_WRITE && client->closing != 2 &&
+		client->handle.write_queue_size <= STREAM_LOW_WATER) {
+		client->req.waiting = REQUEST_WAIT_NONE;
+		client->req.wait_resume(&client->req);
+	}
+}
+/**
+ *
+ *
+ */
+static void on_shutdown(uv_shutdown_t* req, int status)
+{
+	client_t* client = (client_t*)req->data;
+
+	if (status) {
+		close_client(client);
+	}
+}
+/**
+ * The response to a rejected request has been written, the client learns
+ * the connection ends from the shutdown while on_read discards what it 
+ * still sends, until it closes too or the timeout expires
+ *
+ */
+static void linger_close(client_t* client)
+{
+	client->lingering = 2;
+	client->shutdown_req.data = client;
+	if (uv_shutdown(&client->shutdown_req, (uv_stream_t*)&client->handle, on_shutdown) != 0) {
+		close_client(client);
+		return;
+	}
+	set_client_timeout(client, LINGER_TIMEOUT_SEC);
+}
+/**
+ * The socket takes data again, sendfile goes on where it stopped
+ *
+ */
+static void on_writable(uv_poll_t* handle, int status, int events)
+{
+	client_t* client = (client_t*)handle->data;
+
+	uv_poll_stop(handle);
+	if (client->sending == NULL) {
+		return;
+	}
+	if (status) {
+		end_sendfile(client->sending);
+		close_client(client);
+		return;
+	}
+	send_file_part(client->sending);
+}
+/**
+ * Waits until the socket is writable, returns -1 if it can't
+ *
+ */
+static int wait_writable(client_t* client)
+{
+#ifdef WIN32
+	return(-1);
+#else
+	write_poll_t* wp = client->writable;
+
+	if (wp == NULL) {
+		wp = (write_poll_t*)malloc(sizeof(write_poll_t));
+		if (wp == NULL) {
+			return(-1);
+		}
+		wp->fd = dup(SOCKET_FD(&client->handle));
+		if (wp->fd < 0 || uv_poll_init(client->worker->loop, &wp->handle, wp->fd) != 0) {
+			if (wp->fd >= 0) {
+				close(wp->fd);
+			}
+			free(wp);
+			return(-1);
+		}
+		wp->handle.data = client;
+		client->writable = wp;
+	}
+	return(uv_poll_start(&wp->handle, UV_WRITABLE, on_writable));
+#endif
+}
+/**
+ * A part of the file has been sent, the rest follows until the response is
+ * complete
+ *
+ */
+static void on_sendfile(uv_fs_t* fs)
+{
+	sendfile_t* sf = (sendfile_t*)fs->data;
+	client_t* client = sf->client;
+	response_t* response = sf->response;
+	ssize_t result = fs->result;
+	int err = fs->errorno;
+
+	uv_fs_req_cleanup(fs);
+	sf->in_flight = false;
+	if (client->closing == 2) {
+		/* close_client left the socket open for us */
+		end_sendfile(sf);
+		close_socket(client);
+		return;
+	}
+	if (result > 0) {
+		response->body.offset += result;
+		response->body.len -= result;
+		/* the client is reading, even if it is slow */
+		set_client_timeout(client, client->pending ? request_timeout_sec : idle_timeout_sec);
+		if (response->body.len > 0) {
+			send_file_part(sf);
+			return;
+		}
+		ngx_queue_remove(&response->queue);
+		release_response(client->worker, response);
+		end_sendfile(sf);
+		flush_responses(client);
+		return;
+	}
+	if (result < 0 && err == UV_EAGAIN) {
+		/* the socket's buffer is full, sent on once the client has read */
+		if (wait_writable(client) == 0) {
+			return;
+		}
+	}
+	/* the file shrank or the client went away */
+	end_sendfile(sf);
+	close_client(client);
+}
+/**
+ *
+ *
+ */
+static void send_file_part(sendfile_t* sf)
+{
+	client_t* client = sf->client;
+	response_body* body = &sf->response->body;
+
+	sf->in_flight = true;
+	sf->fs.data = sf;
+	if (uv_fs_sendfile(client->worker->loop, &sf->fs, SOCKET_FD(&client->handle), body->fd, body->offset,
+		body->len, on_sendfile) != 0) {
+		sf->in_flight = false;
+		end_sendfile(sf);
+		close_client(client);
+	}
+}
+/**
+ * Starts sending the file of the response at the head of the queue, 
+ * everything in front of it including its header has been written
+ *
+ */
+static void start_sendfile(client_t* client, response_t* response)
+{
+	sendfile_t* sf = (sendfile_t*)malloc(sizeof(sendfile_t));
+
+	if (sf == NULL) {
+		close_client(client);
+		return;
+	}
+	sf->client = client;
+	sf->response = response;
+	sf->in_flight = false;
+	client->sending = sf;
+	client->writes_in_flight++;
+	send_file_part(sf);
+}
+/**
+ * Writes the ready responses at the head of the queue. A response with a
+ * file body ends the batch after its header, its file is sent once every
+ * write in front of it has completed
+ *
+ */
+static void flush_responses(client_t* client)
+{
+	uv_buf_t bufs[FLUSH_MAX_BUFS];
+	write_batch_t* batch;
+	response_t* response;
+	cache_entry* entry;
+	ngx_queue_t* q;
+	int n;
+
+	if (client->closing == 2) {
+		/* on_close releases whatever is still queued */
+		return;
+	}
+
+#define HEAD_READY() (!ngx_queue_empty(&client->responses) && \
+	(ngx_queue_data(ngx_queue_head(&client->responses), response_t, queue))->ready)
+
+	while (HEAD_READY()) {
+		response = ngx_queue_data(ngx_queue_head(&client->responses), response_t, queue);
+		if (response->body.file != NULL && response->header_len == 0) {
+			if (client->writes_in_flight == 0) {
+				start_sendfile(client, response);
+			}
+			break;
+		}
+		batch = (write_batch_t*)pool_get(&client->worker->batches);
+		if (batch == NULL) {
+			if (client->writes_in_flight == 0) {
+				/* nothing would flush the queue again */
+				close_client(client);
+			}
+			/* otherwise left queued for on_write */
+			return;
+		}
+		batch->client = client;
+		batch->write_req.data = batch;
+		ngx_queue_init(&batch->responses);
+
+		n = 0;
+		while (HEAD_READY() && n + 4 <= FLUSH_MAX_BUFS) {
+			q = ngx_queue_head(&client->responses);
+			response = ngx_queue_data(q, response_t, queue);
+			if (response->body.file != NULL) {
+				/* stays queued until its file has been sent */
+				if (response->header_len > 0) {
+					bufs[n++] = uv_buf_init(response->header, response->header_len);
+					response->header_len = 0;
+				}
+				break;
+			}
+			ngx_queue_remove(q);
+			ngx_queue_insert_tail(&batch->responses, q);
+
+			if (response->header_len > 0) {
+				bufs[n++] = uv_buf_init(response->header, response->header_len);
+			}
+			entry = response->body.cached;
+			if (entry != NULL && entry->date_len > 0 && response->body.len == entry->len) {
+				/* the entry's Date is as old as the entry */
+				memcpy(response->frame, client->worker->date_header, client->worker->date_header_len);
+				bufs[n++] = uv_buf_init(entry->data, entry->date_offset);
+				bufs[n++] = uv_buf_init(response->frame, client->worker->date_header_len);
+				bufs[n++] = uv_buf_init(entry->data + entry->date_offset + entry->date_len,
+					entry->len - entry->date_offset - entry->date_len);
+			}
+			else if (response->body.len > 0) {
+				bufs[n++] = uv_buf_init((char*)response->body.data, response->body.len);
+			}
+		}
+		uv_write(&batch->write_req, (uv_stream_t*)&client->handle, bufs, n, on_write);
+		client->writes_in_flight++;
+	}
+#undef HEAD_READY
+
+	if (client->closing == 1 && client->writes_in_flight == 0 && ngx_queue_empty(&client->responses)) {
+		if (client->lingering == 1) {
+			linger_close(client);
+		}
+		else if (client->lingering == 0) {
+			close_client(client);
+		}
+	}
+}
+/**
+ * Queues the last chunk of a stream, or nothing if the body was not framed
+ *
+ */
+static void end_stream(client_t* client)
+{
+	response_t* response;
+
+	if (!client->chunked || client->req.method == HTTP_METHOD_HEAD) {
+		return;
+	}
+	response = new_response(client->worker, false);
+	if (response == NULL) {
+		close_client(client);
+		return;
+	}
+	response->header_len = client->chunks_written ? sizeof(CHUNK_LAST) - 1 : sizeof(CHUNK_LAST_FIRST) - 1;
+	memcpy(response->header, client->chunks_written ? CHUNK_LAST : CHUNK_LAST_FIRST, response->header_len);
+	response->ready = 1;
+	ngx_queue_insert_tail(&client->responses, &response->queue);
+}
+/**
+ * Renders every combination of status line, content type and keep-alive
+ *
+ */
+static void init_header_templates(void)
+{
+	size_t code, type, keep_alive;
+	header_template* t;
+
+	for (code = 1; code < LUAREST_NUM_RESPONSES; code++) {
+		for (type = 0; type < LUAREST_NUM_CONTENT_TYPES; type++) {
+			for (keep_alive = 0; keep_alive < 2; keep_alive++) {
+				t = &header_templates[code][type][keep_alive];
+				t->len = snprintf(t->data, HEADER_TEMPLATE_MAX, RESPONSE_STATUS_LINE "%s%s%s%s", 
+					luarest_response_str[code], 
+					type ? RESPONSE_CONTENT_TYPE : "", luarest_content_type_str[type], 
+					type ? RESPONSE_HEADER_END : "",
+					keep_alive ? RESPONSE_CONNECTION_KEEP_ALIVE : "");
+			}
+		}
+	}
+}
+/**
+ * Appends to a header, a line which doesn't fit is dropped rather than cut
+ *
+ */
+static char* put_header(char* p, const char* end, const char* data, size_t len)
+{
+	if (len > (size_t)(end - p)) {
+		return(p);
+	}
+	memcpy(p, data, len);
+	return(p + len);
+}
+/**
+ * Appends a header line with its value in decimal
+ *
+ */
+static char* put_decimal_header(char* p, const char* end, const char* name, size_t name_len, size_t value)
+{
+	char digits[24];
+	char* d = digits + sizeof(digits);
+	size_t len;
+
+	memcpy(d - 2, RESPONSE_HEADER_END, 2);
+	d -= 2;
+	do {
+		*--d = '0' + (char)(value % 10);
+		value /= 10;
+	} while (value > 0);
+	len = digits + sizeof(digits) - d;
+	if (name_len + len > (size_t)(end - p)) {
+		return(p);
+	}
+	memcpy(p, name, name_len);
+	memcpy(p + name_len, d, len);
+	return(p + name_len + len);
+}
+/**
+ * Copies the prebuilt status line, Content-Type and Connection of the
+ * response and adds the lines which differ between responses
+ *
+ */
+static void render_header(client_t* client)
+{
+	response_t* response = client->head;
+	request* req = &client->req;
+	worker_t* worker = client->worker;
+	char* p = response->header;
+	/* room for the empty line ending the header is always kept */
+	const char* end = response->header + RESPONSE_HEADER_MAX - (sizeof(RESPONSE_HEADER_COMPLETE) - 1);
+	bool bodyless = req->res_code == HTTP_RESPONSE_NOT_MODIFIED || req->res_code == HTTP_RESPONSE_NO_CONTENT;
+	const header_template* t;
+	char date[HTTP_DATE_LEN + 1];
+	int keep_alive;
+
+	if (req->streaming) {
+		client->chunked = client->parser.http_major > 1 || 
+			(client->parser.http_major == 1 && client->parser.http_minor > 0);
+		if (!client->chunked) {
+			client->should_keep_alive = 0;
+		}
+		keep_alive = client->keep_alive_header && client->should_keep_alive;
+	}
+	else {
+		/* If its HTTP/1.0 and the Connection: Keep-Alive header is present we have to
+		   respond with the same header and make sure not to close the connection */
+		keep_alive = client->keep_alive_header;
+	}
+
+	/* a 304 or 204 never has a body, so neither its length nor its type */
+	t = &header_templates[req->res_code][bodyless || req->mime ? 0 : req->con_type][keep_alive ? 1 : 0];
+	p = put_header(p, end, t->data, t->len);
+	if (req->mime != NULL && !bodyless) {
+		p = PUT_LITERAL(p, end, RESPONSE_CONTENT_TYPE);
+		p = put_header(p, end, req->mime, strlen(req->mime));
+		p = PUT_LITERAL(p, end, RESPONSE_HEADER_END);
+	}
+	if (req->streaming) {
+		if (client->chunked) {
+			p = PUT_LITERAL(p, end, RESPONSE_TRANSFER_ENCODING_CHUNKED);
+		}
+	}
+	else if (!bodyless) {
+		p = put_decimal_header(p, end, RESPONSE_CONTENT_LENGTH, sizeof(RESPONSE_CONTENT_LENGTH) - 1, 
+			response->body.len);
+	}
+	p = put_header(p, end, worker->date_header, worker->date_header_len);
+
+	if (req->etag.len > 0) {
+		p = PUT_LITERAL(p, end, RESPONSE_ETAG);
+		p = put_header(p, end, req->etag.base, req->etag.len);
+		p = PUT_LITERAL(p, end, RESPONSE_HEADER_END);
+	}
+	if (req->last_modified != 0) {
+		http_date_format(req->last_modified, date);
+		p = PUT_LITERAL(p, end, RESPONSE_LAST_MODIFIED);
+		p = put_header(p, end, date, HTTP_DATE_LEN);
+		p = PUT_LITERAL(p, end, RESPONSE_HEADER_END);
+	}
+	if (req->con_encoding != CONTENT_ENCODING_IDENTITY) {
+		p = PUT_LITERAL(p, end, RESPONSE_CONTENT_ENCODING);
+		p = put_header(p, end, content_encoding_str[req->con_encoding], 
+			strlen(content_encoding_str[req->con_encoding]));
+		p = PUT_LITERAL(p, end, RESPONSE_HEADER_END);
+	}
+	if (req->vary_encoding && !req->streaming && (req->res_code == HTTP_RESPONSE_OK || 
+		req->res_code == HTTP_RESPONSE_PARTIAL_CONTENT || req->res_code == HTTP_RESPONSE_NOT_MODIFIED)) {
+		/* caches in between must not hand a compressed response to a client 
+		   which can't decode it or vice versa */
+		p = PUT_LITERAL(p, end, RESPONSE_VARY_ACCEPT_ENCODING);
+	}
+	if (req->res_headers.len > 0) {
+		p = put_header(p, end, req->res_headers.base, req->res_headers.len);
+	}
+	memcpy(p, RESPONSE_HEADER_COMPLETE, sizeof(RESPONSE_HEADER_COMPLETE) - 1);
+	p += sizeof(RESPONSE_HEADER_COMPLETE) - 1;
+
+	response->header_len = p - response->header;
+	response->ready = 1;
+}
+/**
+ * Sets a 64 bit FNV-1a hash of the body as entity-tag, fast and good enough
+ * to tell versions of a resource apart
+ *
+ */
+static void hash_etag(request* req, const response_body* body)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char* p = (const unsigned char*)body->data;
+	const unsigned char* end = p + body->len;
+	char* tag;
+
+	for (; p < end; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	tag = (char*)arena_alloc(req->arena, 19);
+	if (tag == NULL) {
+		return;
+	}
+	snprintf(tag, 19, "\"%016llx\"", (unsigned long long)hash);
+	req->etag.base = tag;
+	req->etag.len = 18;
+}
+/**
+ * Replaces the body with its compressed form in the encoding the client
+ * prefers. A strong entity-tag set by the callback is weakened, the 
+ * compressed response isn't byte for byte the one it was set for
+ *
+ */
+static void compress_response(client_t* client)
+{
+	response_t* response = client->head;
+	request* req = &client->req;
+	char* data;
+	char* tag;
+	size_t len;
+
+	data = compress_body(req->accept_encoding, compress_level, response->body.data, response->body.len, &len);
+	if (data == NULL) {
+		return;
+	}
+	release_response_body(&response->body);
+	response->body.data = data;
+	response->body.len = len;
+	response->body.owned = data;
+	req->con_encoding = req->accept_encoding;
+
+	if (req->etag.len > 0 && req->etag.base[0] == '"') {
+		tag = (char*)arena_alloc(req->arena, req->etag.len + 2);
+		if (tag == NULL) {
+			req->etag.len = 0;
+			return;
+		}
+		tag[0] = 'W';
+		tag[1] = '/';
+		memcpy(tag + 2, req->etag.base, req->etag.len);
+		req->etag.base = tag;
+		req->etag.len += 2;
+	}
+}
+/**
+ * Drops the body of a response whose validators match the request's 
+ * conditional headers and renders a 304 instead
+ *
+ */
+static void not_modified(client_t* client)
+{
+	response_t* response = client->head;
+
+	release_response_body(&response->body);
+	response->body.data = NULL;
+	response->body.len = 0;
+	response->body.cached = NULL;
+	client->req.res_code = HTTP_RESPONSE_NOT_MODIFIED;
+	render_header(client);
+}
+/**
+ * The request has been answered, its data is released and the connection
+ * is closed unless it is kept alive
+ *
+ */
+static void finish_request(client_t* client, luarest_status status)
+{
+	request* req = &client->req;
+	response_t* response = client->head;
+
+	if (req->streaming) {
+		if (!req->stream_finished) {
+			/* the callback failed half way, only closing the connection
+			   tells the client the body is incomplete */
+			client->should_keep_alive = 0;
+		}
+		response->ready = 1;
+	}
+	else {
+		if (status != LUAREST_SUCCESS) {
+			release_response_body(&response->body);
+			response->body.data = NULL;
+			response->body.len = 0;
+			req->res_code = HTTP_RESPONSE_SERVER_ERROR;
+			req->con_type = CONTENT_TYPE_PLAIN;
+			req->etag.len = 0;
+			req->last_modified = 0;
+		}
+		else if (req->res_code == HTTP_RESPONSE_OK) {
+			if (req->accept_encoding != CONTENT_ENCODING_IDENTITY && response->body.file == NULL &&
+				response->body.len >= (size_t)compress_min_size) {
+				compress_response(client);
+			}
+			/* hashed after compressing, so every encoding has its own tag */
+			if (req->etag.len == 0 && (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD)) {
+				hash_etag(req, &response->body);
+			}
+		}
+		render_header(client);
+		if (req->method == HTTP_METHOD_HEAD) {
+			/* the header announces the length of the body which isn't sent */
+			release_response_body(&response->body);
+			response->body.data = NULL;
+			response->body.len = 0;
+		}
+	}
+	if ((req->cache != NULL || req->flight != NULL) &&
+		share_response(req, status, client->keep_alive_header, req->streaming ? NULL : response->header,
+			response->header_len, &response->body) == LUAREST_SUCCESS) {
+		/* the response is written from the shared entry */
+		response->header_len = 0;
+	}
+	/* checked after sharing, the cache and other requests need the full response */
+	if (!req->streaming && status == LUAREST_SUCCESS && req->res_code == HTTP_RESPONSE_OK &&
+		request_not_modified(req, &req->etag, req->last_modified)) {
+		not_modified(client);
+	}
+	if (req->close_connection) {
+		client->should_keep_alive = 0;
+	}
+	client->head = NULL;
+	client->pending = 0;
+	if (client->upload != NULL) {
+		/* spooled files the callback didn't move away are removed */
+		upload_release(client->upload);
+		client->upload = NULL;
+		req->parts = NULL;
+	}
+	
+	/* reset for next request, all of its data lives in the arena */
+	arena_reset(&client->arena);
+	client->num_header_fields = 0;
+	client->num_header_values = 0;
+	client->req.headers = NULL;
+	client->req.num_headers = 0;
+
+	if (!client->should_keep_alive) {
+		/* close once everything queued so far has been written, the rest of
+		   a rejected request is discarded meanwhile */
+		client->closing = 1;
+		if (client->rejected) {
+			client->lingering = 1;
+		}
+		else {
+			uv_read_stop((uv_stream_t*)&client->handle);
+		}
+	}
+}
+/**
+ * Runs the application for the parsed request and queues the response,
+ * responses are only written by flush_responses. The response keeps its 
+ * place in the queue while the service-callback is suspended
+ *
+ */
+static void process_request(client_t* client)
+{ 
+	luarest_status res;
+	response_t* response;
+	const slice_t* value;
+
+	response = new_response(client->worker, true);
+	if (response == NULL) {
+		/* the request can't be answered, on_close releases its data */
+		close_client(client);
+		return;
+	}
+	ngx_queue_insert_tail(&client->responses, &response->queue);
+	client->head = response;
+	client->chunked = 0;
+	client->chunks_written = 0;
+	client->req.res_body = &response->body;
+	client->req.streaming = false;
+	client->req.stream_finished = false;
+	client->req.close_connection = false;
+	client->req.keep_alive = client->should_keep_alive != 0;
+	client->req.keep_alive_header = client->keep_alive_header != 0;
+	client->req.res_code = HTTP_RESPONSE_OK;
+	client->req.etag.len = 0;
+	client->req.last_modified = 0;
+	client->req.con_encoding = CONTENT_ENCODING_IDENTITY;
+	client->req.accept_encoding = CONTENT_ENCODING_IDENTITY;
+	client->req.vary_encoding = compress_level > 0;
+	client->req.mime = NULL;
+	client->req.res_headers.base = NULL;
+	client->req.res_headers.len = 0;
+	if (compress_level > 0) {
+		value = request_header(&client->req, "Accept-Encoding", sizeof("Accept-Encoding") - 1);
+		if (value != NULL) {
+			client->req.accept_encoding = compress_negotiate(value->base, value->len);
+		}
+	}
+	client->req.cache = NULL;
+	client->req.flight = NULL;
+
+	if (client->rejected) {
+		/* the rest of the request is never read, so the connection can't 
+		   be used for another one */
+		client->req.res_code = client->rejected;
+		client->keep_alive_header = 0;
+		client->should_keep_alive = 0;
+		client->in_message = 0;
+		request_add_header(&client->req, "Connection", sizeof("Connection") - 1, "close", sizeof("close") - 1);
+		finish_request(client, LUAREST_SUCCESS);
+		return;
+	}
+	if (client->upload != NULL) {
+		res = upload_finish(client->upload);
+		if (res == LUAREST_PENDING) {
+			/* the callback runs once the files are written, on_upload_write */
+			client->pending = 1;
+			client->upload_waiting = 1;
+			client->req.wait_cancel = NULL;
+			set_client_timeout(client, request_timeout_sec);
+			return;
+		}
+		if (res != LUAREST_SUCCESS) {
+			finish_request(client, res);
+			return;
+		}
+		client->req.parts = client->upload->parts;
+	}
+	
+	res = invoke_application(client->worker->apps, &client->req);
+	if (res == LUAREST_PENDING) {
+		/* no timer is running since the request was read, one is needed as 
+		   long as the request holds on to its callback and arena */
+		client->pending = 1;
+		set_client_timeout(client, request_timeout_sec);
+		return;
+	}
+	finish_request(client, res);
+}
+/**
+ * Parses and processes every complete request in data. When a request is 
+ * suspended the remaining input is kept until it has finished, so responses
+ * and chunks are always queued in the order of the requests
+ *
+ */
+static void parse_input(client_t* client, const char* data, size_t len)
+{
+	size_t parsed;
+	size_t offset = 0;
+
+	while (offset < len && !client->closing && !client->pending) {
+		parsed = http_parser_execute(&client->parser, &parser_settings, data + offset, len - offset);
+		offset += parsed;
+		
+		if (HTTP_PARSER_ERRNO(&client->parser) == HPE_PAUSED) {
+			/* on_message_complete paused the parser at the end of a request,
+			   start over for the next one */
+			http_parser_init(&client->parser, HTTP_REQUEST);
+			client->parser.data = client;
+			process_request(client);
+		}
+		else if (HTTP_PARSER_ERRNO(&client->parser) != HPE_OK || parsed == 0) {
+			LOG_ERROR("parse error");
+			client->closing = 1;
+		}
+	}
 
+	if (client->pending && offset < len && !client->closing) {
+		/* stop reading, the socket buffers whatever else the client sends */
+		client->backlog = (char*)malloc(len - offset);
+		if (client->backlog == NULL) {
+			client->closing = 1;
+			return;
+		}
+		memcpy(client->backlog, data + offset, len - offset);
+		client->backlog_len = len - offset;
+		uv_read_stop((uv_stream_t*)&client->handle);
+	}
+}
 /**
- * 
+ * This is called until every thing is read from the socket, every complete
+ * request in the buffer is processed before the queued responses are flushed
+ * together
  *
  */
-static void on_close(uv_handle_t* handle) {
-	client_t* client = (client_t*)handle->data;
-	
-	LOGF("[ %5d ] connection closed", client->conn_num);
+static void on_read(uv_stream_t* tcp, ssize_t nread, uv_buf_t buf) {
+	client_t* client = (client_t*) tcp->data;
+
+	if (client->lingering) {
+		if (buf.base) {
+			pool_put(&client->worker->read_buffers, buf.base);
+		}
+		if (nread < 0) {
+			/* the client is done sending, only the response has to get out */
+			uv_read_stop(tcp);
+			if (client->lingering == 2) {
+				close_client(client);
+			}
+			client->lingering = 0;
+		}
+		return;
+	}
+	if (nread <= 0) {
+		if (buf.base) {
+			pool_put(&client->worker->read_buffers, buf.base);
+		}
+		if (nread < 0) {
+			close_client(client);
+		}
+		return;
+	}
+
+	parse_input(client, buf.base, nread);
 	
-	DL_DELETE(connections, client);
+	pool_put(&client->worker->read_buffers, buf.base);
+
+	if (client->upload != NULL && !client->pending && !client->closing && upload_congested(client->upload)) {
+		/* the body arrives faster than it is written, on_upload_write reads on */
+		client->upload_stalled = 1;
+		uv_read_stop((uv_stream_t*)&client->handle);
+	}
 
-	free(client);
+	if (!client->in_message && !client->pending) {
+		set_client_timeout(client, idle_timeout_sec);
+	}
+
+	flush_responses(client);
 }
 /**
- * This timer goes off every 5s and increments the idle-time on all 
- * connections, once the specified KEEP-ALIVE timeout is reached 
- * the connection is closed by the server
+ * A suspended service-callback has finished, the input which arrived in the
+ * meantime is processed and reading continues
  *
  */
-static void on_timeout_timer(uv_timer_t* timer, int status)
+static void on_request_complete(request* req, luarest_status status)
 {
-	client_t* client;
-	CHECK(status, "timeout timer");
-	DL_FOREACH(connections, client) {
-		client->idle_time_sec += 5;
-		if (client->idle_time_sec >= HTTP_KEEP_ALIVE_TIMEOUT_SEC) {
-			printf("Keep-Alive timeout on connection %d, timeout %d\n", client->conn_num, client->idle_time_sec);
-			uv_close((uv_handle_t*) &client->handle, on_close);
+	client_t* client = (client_t*)((char*)req - offsetof(client_t, req));
+	char* backlog = client->backlog;
+
+	finish_request(client, status);
+
+	if (backlog != NULL) {
+		client->backlog = NULL;
+		parse_input(client, backlog, client->backlog_len);
+		free(backlog);
+	}
+	if (!client->closing && !client->pending) {
+		uv_read_start((uv_stream_t*)&client->handle, on_alloc, on_read);
+		if (!client->in_message) {
+			set_client_timeout(client, idle_timeout_sec);
 		}
 	}
-	uv_timer_start(timer, on_timeout_timer, 5000, 0);
+	flush_responses(client);
 }
 /**
- * 
+ * A write of a spooled body has completed, reading goes on once the disk 
+ * has caught up and the callback runs once the last file is written
  *
  */
-static uv_buf_t on_alloc(uv_handle_t* client, size_t suggested_size) {
-	uv_buf_t buf;
-	buf.base = (char*)malloc(suggested_size);
-	buf.len = suggested_size;
-	return(buf);
+static void on_upload_write(upload* upload)
+{
+	client_t* client = (client_t*)upload->data;
+	luarest_status res;
+
+	if (client->closing == 2) {
+		return;
+	}
+	if (client->upload_waiting) {
+		res = upload_finish(upload);
+		if (res == LUAREST_PENDING) {
+			return;
+		}
+		client->upload_waiting = 0;
+		if (res == LUAREST_SUCCESS) {
+			client->req.parts = upload->parts;
+			res = invoke_application(client->worker->apps, &client->req);
+			if (res == LUAREST_PENDING) {
+				return;
+			}
+		}
+		on_request_complete(&client->req, res);
+	}
+	else if (client->upload_stalled && !upload_congested(upload) && !client->closing) {
+		client->upload_stalled = 0;
+		set_client_timeout(client, body_timeout_sec);
+		uv_read_start((uv_stream_t*)&client->handle, on_alloc, on_read);
+	}
 }
 /**
  * 
  *
  */
-static void on_write(uv_write_t* req, int status) {
-	CHECK(status, "write");
+static void on_stream_start(request* req)
+{
+	client_t* client = (client_t*)((char*)req - offsetof(client_t, req));
+
+	render_header(client);
+	flush_responses(client);
 }
 /**
- * 
+ * Queues a chunk of a streamed response, a NULL chunk ends the stream
  *
  */
-static void process_request(client_t* client)
-{ 
-	luarest_status res = LUAREST_SUCCESS;
-	uv_buf_t buf;
-	int i;
-
-	UT_string* sbuf;
-	UT_string* resp;
-	luarest_response res_code;
-	luarest_content_type content_type;
-
-	utstring_new(resp);
-	
-	res = invoke_application(apps, client->path, client->req_method, &res_code, &content_type, resp);
+static void on_stream_write(request* req, response_body* chunk)
+{
+	client_t* client = (client_t*)((char*)req - offsetof(client_t, req));
+	response_t* response;
 
-	utstring_new(sbuf);
-	utstring_printf(sbuf, RESPONSE_HEADER);
-	utstring_printf(sbuf, RESPONSE_CONTENT_TYPE, luarest_content_type_str[content_type]);
-	utstring_printf(sbuf, RESPONSE_CONTENT_LENGTH, utstring_len(resp));
-	if (client->keep_alive_header) {
-		/* If its HTTP/1.0 and the Connection: Keep-Alive header is present we have to
-		   respond with the same header and make sure not to close the connection */
-		utstring_printf(sbuf, RESPONSE_CONNECTION_KEEP_ALIVE);
+	if (chunk == NULL) {
+		end_stream(client);
 	}
-	utstring_printf(sbuf, RESPONSE_HEADER_COMPLETE);
-	utstring_concat(sbuf, resp);
-
-	utstring_free(resp);
-	
-	buf.base = utstring_body(sbuf);
-	buf.len = utstring_len(sbuf);
-
-	uv_write(&client->write_req, (uv_stream_t*)&client->handle, &buf, 1, on_write);
-	client->idle_time_sec = 0;
-
-	utstring_free(sbuf);
-	
-	/* reset for next request */
-	utstring_free(client->url);
-	utstring_free(client->path);
-	utstring_free(client->query);
-	client->num_header_fields = 0;
-	client->num_header_values = 0;
-	for (i = 0; i < client->num_header_fields; i++) {
-		utstring_free(client->headers[i].field);
-		utstring_free(client->headers[i].value);
+	else if (req->method == HTTP_METHOD_HEAD) {
+		release_response_body(chunk);
+		return;
 	}
-	free(client->headers);
-
-	if (!client->should_keep_alive) {
-		uv_close((uv_handle_t*) &client->handle, on_close);
+	else {
+		response = new_response(client->worker, false);
+		if (response == NULL) {
+			release_response_body(chunk);
+			close_client(client);
+			return;
+		}
+		if (client->chunked) {
+			response->header_len = snprintf(response->header, RESPONSE_FRAME_MAX, 
+				client->chunks_written ? CHUNK_HEADER : CHUNK_HEADER_FIRST, (unsigned long)chunk->len);
+		}
+		response->body = *chunk;
+		response->ready = 1;
+		ngx_queue_insert_tail(&client->responses, &response->queue);
+		client->chunks_written++;
 	}
+	flush_responses(client);
 }
 /**
- * This is called until every thing is read from the socket
+ * Queues data which already carries its framing, the first data takes the
+ * place of the request's response
  *
  */
-static void on_read(uv_stream_t* tcp, ssize_t nread, uv_buf_t buf) {
-	ssize_t parsed;
-	client_t* client = (client_t*) tcp->data;
+static void on_send(request* req, response_body* data)
+{
+	client_t* client = (client_t*)((char*)req - offsetof(client_t, req));
+	response_t* response = client->head;
 
-	if (nread < 0) {
-		if (buf.base) {
-			free(buf.base);
+	if (response->ready) {
+		response = new_response(client->worker, false);
+		if (response == NULL) {
+			release_response_body(data);
+			close_client(client);
+			return;
 		}
-		uv_close((uv_handle_t*)tcp, on_close);
-		return;
+		ngx_queue_insert_tail(&client->responses, &response->queue);
 	}
+	response->body = *data;
+	response->ready = 1;
+	flush_responses(client);
+}
+/**
+ * 
+ *
+ */
+static bool on_stream_congested(request* req)
+{
+	client_t* client = (client_t*)((char*)req - offsetof(client_t, req));
+
+	return(client->handle.write_queue_size > STREAM_HIGH_WATER);
+}
 
-	client->idle_time_sec = 0;
+static const request_ops client_request_ops = {
+	on_request_complete,
+	on_stream_start,
+	on_stream_write,
+	on_send,
+	on_stream_congested
+};
+/**
+ *
+ *
+ */
+static void on_reject_close(uv_handle_t* handle)
+{
+	free(handle);
+}
+/**
+ * A connection which can't be served is accepted and closed right away, left
+ * in the backlog it would be reported again on every loop iteration
+ *
+ */
+static void reject_connection(uv_stream_t* server_handle)
+{
+	uv_tcp_t* handle = (uv_tcp_t*)malloc(sizeof(uv_tcp_t));
 
-	if (client->parser == NULL) {
-		client->parser = (http_parser*)malloc(sizeof(http_parser));
-		http_parser_init(client->parser, HTTP_REQUEST);
-		client->parser->data = client;
-	}
-	
-	parsed = http_parser_execute(client->parser, &parser_settings, buf.base, nread);
-	if (parsed < nread) {
-		LOG_ERROR("parse error");
-		uv_close((uv_handle_t*) &client->handle, on_close);
+	if (handle == NULL) {
+		return;
 	}
-	
-	free(buf.base);
-
-	if (client->message_complete) {
-		free(client->parser);
-		client->parser = NULL;
-		process_request(client);
+	uv_tcp_init(server_handle->loop, handle);
+	if (uv_accept(server_handle, (uv_stream_t*)handle) != 0) {
+		UVERR(uv_last_error(server_handle->loop), "accept");
 	}
+	uv_close((uv_handle_t*)handle, on_reject_close);
 }
 /**
  * 
@@ -219,32 +1441,59 @@ static void on_read(uv_stream_t* tcp, ssize_t nread, uv_buf_t buf) {
 static void on_connect(uv_stream_t* server_handle, int status) {
 	int r;
 	client_t* client;
+	worker_t* worker = (worker_t*)server_handle->data;
 
-	CHECK(status, "connect");
+	CHECK(worker->loop, status, "connect");
 
-	assert((uv_tcp_t*)server_handle == &server);
+	assert((uv_tcp_t*)server_handle == &worker->server);
 	
-	client = (client_t*)malloc(sizeof(client_t));
-	client->parser = NULL;
-	client->url = NULL;
+	client = (client_t*)pool_get(&worker->clients);
+	if (client == NULL) {
+		reject_connection(server_handle);
+		return;
+	}
+	if (client->arena.block_size == 0) {
+		/* fresh from the allocator, recycled ones still own their arena */
+		arena_init(&client->arena, REQUEST_ARENA_BLOCK_SIZE);
+	}
+	client->worker = worker;
+	http_parser_init(&client->parser, HTTP_REQUEST);
+	client->parser.data = client;
 	client->num_header_fields = 0;
 	client->num_header_values = 0;
-	client->conn_num = ++conn_counter;
+	client->conn_num = ++worker->conn_counter;
 	client->keep_alive_header = 0;
-	client->message_complete = 0;
 	client->should_keep_alive = 1;
-	client->idle_time_sec = 0;
-	client->headers = NULL;
+	client->closing = 0;
+	client->in_message = 0;
+	client->writes_in_flight = 0;
+	client->pending = 0;
+	client->backlog = NULL;
+	client->upload = NULL;
+	client->head = NULL;
+	client->sending = NULL;
+	client->writable = NULL;
+	client->lingering = 0;
+	client->req.ops = &client_request_ops;
+	client->req.co = NULL;
+	client->req.waiting = REQUEST_WAIT_NONE;
+	client->req.headers = NULL;
+	client->req.num_headers = 0;
+	client->req.arena = &client->arena;
+	ngx_queue_init(&client->responses);
 
 	LOGF("[ %5d ] new connection", client->conn_num);
 	
-	uv_tcp_init(uv_loop, &client->handle);
+	uv_tcp_init(worker->loop, &client->handle);
 	client->handle.data = client;
 	
 	r = uv_accept(server_handle, (uv_stream_t*)&client->handle);
-	CHECK(r, "accept");
+	CHECK(worker->loop, r, "accept");
+
+	DL_APPEND(worker->connections, client);
 
-	DL_APPEND(connections, client);
+	wheel_timer_init(&client->timeout, on_client_timeout, client);
+	set_client_timeout(client, idle_timeout_sec);
 	
 	uv_read_start((uv_stream_t*)&client->handle, on_alloc, on_read);
 }
@@ -278,6 +1527,90 @@ static luarest_status map_http_method(luarest_method* rm, char m)
 	}
 	return(LUAREST_SUCCESS);
 }
+/**
+ * Stops parsing the request, process_request answers it with code and the
+ * connection is closed
+ *
+ */
+static int reject_request(client_t* client, luarest_response code)
+{
+	client->rejected = code;
+	http_parser_pause(&client->parser, 1);
+	return(0);
+}
+/**
+ * Queues the interim response telling the client to send the body, it is
+ * flushed with the responses in front of it. Fails the parser if no memory
+ * is left
+ *
+ */
+static int send_continue(client_t* client)
+{
+	response_t* response = new_response(client->worker, false);
+	const header_template* t = &header_templates[HTTP_RESPONSE_CONTINUE][0][0];
+
+	if (response == NULL) {
+		return(-1);
+	}
+	memcpy(response->header, t->data, t->len);
+	memcpy(response->header + t->len, RESPONSE_HEADER_COMPLETE, sizeof(RESPONSE_HEADER_COMPLETE) - 1);
+	response->header_len = t->len + sizeof(RESPONSE_HEADER_COMPLETE) - 1;
+	response->ready = 1;
+	ngx_queue_insert_tail(&client->responses, &response->queue);
+	return(0);
+}
+/**
+ * Checks a request which announces a body against the limit of its route 
+ * before the body is read, its buffer is allocated at once if the length 
+ * is known
+ *
+ */
+static int accept_body(client_t* client)
+{
+	http_parser* parser = &client->parser;
+	uint64_t length = (uint64_t)parser->content_length;
+	bool has_length = !(parser->flags & F_CHUNKED) && length != ULLONG_MAX;
+	const slice_t* expect = request_header(&client->req, "Expect", sizeof("Expect") - 1);
+	const slice_t* content_type;
+	bool expect_continue = false;
+	bool upload = false;
+
+	if (expect != NULL && parser->http_minor > 0) {
+		if (expect->len != sizeof("100-continue") - 1 || strncasecmp(expect->base, "100-continue", expect->len) != 0) {
+			return(reject_request(client, HTTP_RESPONSE_EXPECTATION_FAILED));
+		}
+		expect_continue = true;
+	}
+	if ((has_length && length == 0) || (!has_length && !(parser->flags & F_CHUNKED))) {
+		/* no body */
+		return(0);
+	}
+	if (application_body_options(client->worker->apps, &client->req, &client->body_limit, &upload) != LUAREST_SUCCESS) {
+		/* nobody wants the body, it isn't buffered but discarded while the
+		   connection lingers, a client expecting 100-continue doesn't send it */
+		return(reject_request(client, HTTP_RESPONSE_NOT_FOUND));
+	}
+	if (has_length && length > client->body_limit) {
+		return(reject_request(client, HTTP_RESPONSE_PAYLOAD_TOO_LARGE));
+	}
+	content_type = request_header(&client->req, "Content-Type", sizeof("Content-Type") - 1);
+	if (upload && content_type != NULL) {
+		/* any other body of the route is read into memory */
+		client->upload = upload_new(client->worker->loop, upload_dir, content_type->base, content_type->len,
+			on_upload_write, client);
+	}
+	if (has_length && client->upload == NULL) {
+		client->req.body.base = (char*)arena_alloc(&client->arena, (size_t)length + 1);
+		if (client->req.body.base == NULL) {
+			return(reject_request(client, HTTP_RESPONSE_SERVER_ERROR));
+		}
+		client->body_cap = (size_t)length;
+	}
+	if (expect_continue) {
+		return(send_continue(client));
+	}
+	return(0);
+}
 /**
  *
  *
@@ -286,25 +1619,33 @@ static int on_headers_complete(http_parser* parser) {
 	luarest_method m;
 	luarest_status res = LUAREST_SUCCESS;
 	client_t* client = (client_t*)parser->data;
-	struct http_parser_url* hpu = (struct http_parser_url*)malloc(sizeof(struct http_parser_url));
+	struct http_parser_url hpu;
 
 	res = map_http_method(&m, parser->method);
-	client->req_method = m;
+	client->req.method = m;
+	client->req.num_headers = client->num_header_values;
+	client->req.http_minor = parser->http_minor;
 
 	if (parser->flags & F_CONNECTION_KEEP_ALIVE) {
 		client->keep_alive_header = 1;
 	}
 
-	http_parser_parse_url(utstring_body(client->url), utstring_len(client->url), 0, hpu);
-	if (hpu->field_set & (1 << (UF_PATH))) {
-		utstring_bincpy(client->path, utstring_body(client->url)+hpu->field_data[UF_PATH].off, hpu->field_data[UF_PATH].len);
+	set_client_timeout(client, body_timeout_sec);
+
+	/* path and query point into the url */
+	if (http_parser_parse_url(client->url.base, client->url.len, 0, &hpu) != 0) {
+		return(1);
 	}
-	if (hpu->field_set & (1 << (UF_QUERY))) {
-		utstring_bincpy(client->query, utstring_body(client->url)+hpu->field_data[UF_QUERY].off, hpu->field_data[UF_QUERY].len);
+	if (hpu.field_set & (1 << (UF_PATH))) {
+		client->req.path.base = client->url.base + hpu.field_data[UF_PATH].off;
+		client->req.path.len = hpu.field_data[UF_PATH].len;
+	}
+	if (hpu.field_set & (1 << (UF_QUERY))) {
+		client->req.query.base = client->url.base + hpu.field_data[UF_QUERY].off;
+		client->req.query.len = hpu.field_data[UF_QUERY].len;
 	}
-	free(hpu);
 
-	return(0);
+	return(accept_body(client));
 }
 /**
  *
@@ -314,8 +1655,53 @@ static int on_url(http_parser* parser, const char *at, size_t length)
 {
 	client_t* client = (client_t*)parser->data;
 	
-	utstring_bincpy(client->url, at, length);
-	
+	return(arena_append(&client->arena, &client->url, at, length) == LUAREST_SUCCESS ? 0 : 1);
+}
+/**
+ * Collects the body into its buffer in the arena, a body growing past the
+ * limit of its route is rejected
+ *
+ */
+static int on_body(http_parser* parser, const char* at, size_t length)
+{
+	client_t* client = (client_t*)parser->data;
+	slice_t* body = &client->req.body;
+	size_t cap = client->body_cap;
+	char* p;
+
+	if (length > client->body_limit - client->body_read) {
+		return(reject_request(client, HTTP_RESPONSE_PAYLOAD_TOO_LARGE));
+	}
+	client->body_read += length;
+	if (client->upload != NULL) {
+		if (upload_feed(client->upload, at, length) != LUAREST_SUCCESS) {
+			return(reject_request(client, client->upload->failed ? HTTP_RESPONSE_SERVER_ERROR : 
+				HTTP_RESPONSE_BAD_REQUEST));
+		}
+		return(0);
+	}
+	if (body->len + length > cap) {
+		/* only a body of unknown length grows */
+		cap = cap > 0 ? cap * 2 : REQUEST_BODY_INITIAL;
+		if (cap < body->len + length) {
+			cap = body->len + length;
+		}
+		if (cap > client->body_limit) {
+			cap = client->body_limit;
+		}
+		p = (char*)arena_alloc(&client->arena, cap + 1);
+		if (p == NULL) {
+			return(reject_request(client, HTTP_RESPONSE_SERVER_ERROR));
+		}
+		if (body->len > 0) {
+			memcpy(p, body->base, body->len);
+		}
+		body->base = p;
+		client->body_cap = cap;
+	}
+	memcpy(body->base + body->len, at, length);
+	body->len += length;
+	body->base[body->len] = '\0';
 	return(0);
 }
 /**
@@ -325,23 +1711,31 @@ static int on_url(http_parser* parser, const char *at, size_t length)
 static int on_header_field(http_parser* parser, const char* at, size_t lenght)
 {
 	client_t* client = (client_t*)parser->data;
+	header_t* headers;
+	header_t* header;
 
 	if (client->num_header_fields == client->num_header_values) {
-		if (client->num_header_fields == 0) {
-			client->headers = (header_t*)malloc(sizeof(header_t)*2);
-			client->headers_len = 2;
+		if (client->req.headers == NULL || client->num_header_fields == client->headers_len) {
+			/* the old array simply stays behind in the arena */
+			client->headers_len = client->req.headers ? client->headers_len * 2 : REQUEST_HEADERS_INITIAL;
+			headers = (header_t*)arena_alloc(&client->arena, sizeof(header_t)*client->headers_len);
+			if (headers == NULL) {
+				return(1);
+			}
+			if (client->num_header_fields > 0) {
+				memcpy(headers, client->req.headers, sizeof(header_t)*client->num_header_fields);
+			}
+			client->req.headers = headers;
 		}
-		else if (client->num_header_fields == client->headers_len) {
-			client->headers_len *= 2;
-			client->headers = (header_t*)realloc(client->headers, sizeof(header_t)*client->headers_len);
-		}
-		client->num_header_fields++;
-		utstring_new(client->headers[client->num_header_fields-1].field);
+		header = &client->req.headers[client->num_header_fields++];
+		header->field.base = NULL;
+		header->field.len = 0;
+		header->value.base = NULL;
+		header->value.len = 0;
 	}
 
-	utstring_bincpy(client->headers[client->num_header_fields-1].field, at, lenght);
-
-	return(0);
+	header = &client->req.headers[client->num_header_fields-1];
+	return(arena_append(&client->arena, &header->field, at, lenght) == LUAREST_SUCCESS ? 0 : 1);
 }
 /**
  *
@@ -353,12 +1747,9 @@ static int on_header_value(http_parser* parser, const char* at, size_t lenght)
 
 	if (client->num_header_fields != client->num_header_values) {
 		client->num_header_values++;
-		utstring_new(client->headers[client->num_header_values-1].value);
 	}
 
-	utstring_bincpy(client->headers[client->num_header_values-1].value, at, lenght);
-
-	return(0);
+	return(arena_append(&client->arena, &client->req.headers[client->num_header_values-1].value, at, lenght) == LUAREST_SUCCESS ? 0 : 1);
 }
 /**
  *
@@ -368,10 +1759,22 @@ static int on_message_begin(http_parser* parser)
 {
 	client_t* client = (client_t*)parser->data;
 
-	utstring_new(client->url);
-	utstring_new(client->path);
-	utstring_new(client->query);
-	client->message_complete = 0;
+	client->url.base = NULL;
+	client->url.len = 0;
+	client->req.path = client->url;
+	client->req.query = client->url;
+	client->req.body = client->url;
+	client->body_cap = 0;
+	client->body_read = 0;
+	client->body_limit = max_body_size;
+	client->upload_stalled = 0;
+	client->upload_waiting = 0;
+	client->req.parts = NULL;
+	client->rejected = (luarest_response)0;
+	client->keep_alive_header = 0;
+	client->in_message = 1;
+
+	set_client_timeout(client, header_timeout_sec);
 
 	return(0);
 }
@@ -383,9 +1786,12 @@ static int on_message_complete(http_parser* parser)
 {
 	client_t* client = (client_t*)parser->data;
 
-	client->should_keep_alive = http_should_keep_alive(client->parser);
+	client->should_keep_alive = http_should_keep_alive(parser);
+	client->in_message = 0;
+	timer_wheel_remove(&client->worker->timeouts, &client->timeout);
 
-	client->message_complete = 1;
+	/* hand the request to on_read before the next pipelined one is parsed */
+	http_parser_pause(parser, 1);
 
 	return(0);
 }
@@ -395,27 +1801,235 @@ static int on_message_complete(http_parser* parser)
  */
 static void usage()
 {
-	printf("Usage: luarest <app-dir>\n");
+	printf("Usage: luarest [-w <workers>] [-i <sec>] [-H <sec>] [-b <sec>] [-r <sec>] [-s <bytes>] [-t <dir>] [-z <level>] [-m <bytes>] <app-dir>\n");
+	printf("  -w <workers>  number of event loops, defaults to the number of online CPUs\n");
+	printf("  -i <sec>      keep-alive idle timeout, defaults to %d\n", HTTP_KEEP_ALIVE_TIMEOUT_SEC);
+	printf("  -H <sec>      timeout for reading the request headers, defaults to %d\n", HTTP_HEADER_TIMEOUT_SEC);
+	printf("  -b <sec>      timeout for reading the request body, defaults to %d\n", HTTP_BODY_TIMEOUT_SEC);
+	printf("  -r <sec>      timeout for answering a request, defaults to %d\n", HTTP_REQUEST_TIMEOUT_SEC);
+	printf("  -s <bytes>    maximum size of a request body, defaults to %d\n", HTTP_MAX_BODY_SIZE);
+	printf("  -t <dir>      directory uploads are spooled to, defaults to $TMPDIR or /tmp\n");
+	printf("  -z <level>    gzip/deflate level of responses (1-9, 0 is off), defaults to %d\n", COMPRESS_LEVEL);
+	printf("  -m <bytes>    minimum body size to compress, defaults to %d\n", COMPRESS_MIN_SIZE);
+}
+/**
+ * Returns the number of online CPUs, at least 1
+ *
+ */
+static int cpu_count()
+{
+	uv_cpu_info_t* cpu_infos;
+	int count = 0;
+	uv_err_t err = uv_cpu_info(&cpu_infos, &count);
+
+	if (err.code != UV_OK) {
+		return(1);
+	}
+	uv_free_cpu_info(cpu_infos, count);
+	return(MAX(count, 1));
 }
 /**
  *
  *
  */
-int main(int argc, char *argv[]) {
+static luarest_status parse_args(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-w") == 0 && i+1 < argc) {
+			num_workers = atoi(argv[++i]);
+			if (num_workers < 1) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+			idle_timeout_sec = atoi(argv[++i]);
+			if (idle_timeout_sec < 1) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-H") == 0 && i+1 < argc) {
+			header_timeout_sec = atoi(argv[++i]);
+			if (header_timeout_sec < 1) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+			body_timeout_sec = atoi(argv[++i]);
+			if (body_timeout_sec < 1) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+			request_timeout_sec = atoi(argv[++i]);
+			if (request_timeout_sec < 1) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+			if (atoi(argv[i+1]) < 1) {
+				return(LUAREST_ERROR);
+			}
+			max_body_size = (size_t)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+			upload_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-z") == 0 && i+1 < argc) {
+			compress_level = atoi(argv[++i]);
+			if (compress_level < 0 || compress_level > 9) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+			compress_min_size = atoi(argv[++i]);
+			if (compress_min_size < 0) {
+				return(LUAREST_ERROR);
+			}
+		}
+		else if (argv[i][0] == '-' || app_dir != NULL) {
+			return(LUAREST_ERROR);
+		}
+		else {
+			app_dir = argv[i];
+		}
+	}
+	if (app_dir == NULL) {
+		return(LUAREST_ERROR);
+	}
+	if (num_workers == 0) {
+		num_workers = cpu_count();
+	}
+	if (upload_dir == NULL) {
+		upload_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	}
+#ifndef SO_REUSEPORT
+	if (num_workers > 1) {
+		printf("SO_REUSEPORT is not supported on this platform, running a single worker\n");
+		num_workers = 1;
+	}
+#endif
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Binds the worker's server handle, with more than one worker the socket is 
+ * created up-front so SO_REUSEPORT can be set before the bind and the kernel 
+ * balances incoming connections across all listening workers
+ *
+ */
+static int bind_server(worker_t* worker, struct sockaddr_in address)
+{
+#ifdef SO_REUSEPORT
+	int on = 1;
+	int fd;
+
+	if (num_workers > 1) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1) {
+			perror("socket");
+			return(-1);
+		}
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			close(fd);
+			return(-1);
+		}
+		if (uv_tcp_open(&worker->server, fd) != 0) {
+			close(fd);
+			return(-1);
+		}
+	}
+#endif
+	return(uv_tcp_bind(&worker->server, address));
+}
+/**
+ * Creates the loop, the applications and the listening socket of a worker
+ *
+ */
+static luarest_status init_worker(worker_t* worker, int id)
+{
 	int ret;
 	luarest_status lret;
-	struct sockaddr_in address;
-	uv_timer_t timeout_timer;
+
+	worker->id = id;
+	worker->apps = NULL;
+	worker->connections = NULL;
+	worker->conn_counter = 0;
+	worker->date_time = 0;
+	update_date_header(worker);
+	pool_init(&worker->read_buffers, READ_BUFFER_SIZE, READ_BUFFER_POOL_MAX, false);
+	pool_init(&worker->responses, sizeof(response_t), RESPONSE_POOL_MAX, false);
+	pool_init(&worker->headers, RESPONSE_HEADER_MAX, RESPONSE_POOL_MAX, false);
+	pool_init(&worker->batches, sizeof(write_batch_t), RESPONSE_POOL_MAX, false);
+	/* on_connect tells fresh connections by their arena, which must be zero */
+	pool_init(&worker->clients, sizeof(client_t), CLIENT_POOL_MAX, true);
+	worker->loop = (id == 0) ? uv_default_loop() : uv_loop_new();
 	
-	if (argc < 2) {
-		usage();
-		return(1);
+	lret = create_applications(&worker->apps, app_dir, worker->loop);
+	if (lret != LUAREST_SUCCESS || worker->apps == NULL) {
+		return(LUAREST_ERROR);
 	}
 
-	lret = create_applications(&apps, argv[1]);
+	ret = uv_tcp_init(worker->loop, &worker->server);
+	CHECK(worker->loop, ret, "init");
+	worker->server.data = worker;
+
+	ret = bind_server(worker, uv_ip4_addr("0.0.0.0", LUAREST_PORT));
+	CHECK(worker->loop, ret, "bind");
+
+	ret = uv_listen((uv_stream_t*)&worker->server, 128, on_connect);
+	CHECK(worker->loop, ret, "listen");
+
+	/* setup the connection timeouts */
+	timer_wheel_init(&worker->timeouts, TIMER_WHEEL_TICK_MS);
+	worker->timeouts.current = (unsigned long)(uv_now(worker->loop) / TIMER_WHEEL_TICK_MS);
+	uv_timer_init(worker->loop, &worker->wheel_ticker);
+	worker->wheel_ticker.data = worker;
+	uv_timer_start(&worker->wheel_ticker, on_wheel_tick, TIMER_WHEEL_TICK_MS, TIMER_WHEEL_TICK_MS);
 
-	if (lret != LUAREST_SUCCESS || apps == NULL) {
-		printf("Error: No applications could be loaded can't start!\n");
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static void run_worker(void* arg)
+{
+	worker_t* worker = (worker_t*)arg;
+	client_t* client;
+
+	uv_run(worker->loop);
+
+	uv_timer_stop(&worker->wheel_ticker);
+	free_applications(worker->apps);
+
+	printf("worker %d read buffer pool: %lu hits, %lu misses\n", worker->id,
+		worker->read_buffers.hits, worker->read_buffers.misses);
+	printf("worker %d connection pool: %lu hits, %lu misses\n", worker->id,
+		worker->clients.hits, worker->clients.misses);
+	pool_destroy(&worker->read_buffers);
+	pool_destroy(&worker->responses);
+	pool_destroy(&worker->headers);
+	pool_destroy(&worker->batches);
+	while (worker->clients.num_free > 0) {
+		client = (client_t*)pool_get(&worker->clients);
+		arena_destroy(&client->arena);
+		free(client);
+	}
+	if (worker->id != 0) {
+		uv_loop_delete(worker->loop);
+	}
+}
+/**
+ *
+ *
+ */
+int main(int argc, char *argv[]) {
+	int i;
+	
+	if (parse_args(argc, argv) != LUAREST_SUCCESS) {
+		usage();
 		return(1);
 	}
 
@@ -423,30 +2037,32 @@ int main(int argc, char *argv[]) {
 	parser_settings.on_header_field = on_header_field;
 	parser_settings.on_header_value = on_header_value;
 	parser_settings.on_headers_complete = on_headers_complete;
+	parser_settings.on_body = on_body;
 	parser_settings.on_message_begin = on_message_begin;
 	parser_settings.on_message_complete = on_message_complete;
-	uv_loop = uv_default_loop();
-	
-	ret = uv_tcp_init(uv_loop, &server);
-	CHECK(ret, "init");
-	
-	address = uv_ip4_addr("0.0.0.0", 8000);
-	
-	ret = uv_tcp_bind(&server, address);
-	CHECK(ret, "bind");
-	
-	uv_listen((uv_stream_t*)&server, 128, on_connect);
-	
-	LOG("luarest is listening on port 8000");
+	init_header_templates();
 
-	/* setup time-out timer */
-	uv_timer_init(uv_loop, &timeout_timer);
-	uv_timer_start(&timeout_timer, on_timeout_timer, 5000, 0);
+	/* every worker loads its own copy of the applications */
+	workers = (worker_t*)calloc(num_workers, sizeof(worker_t));
+	for (i = 0; i < num_workers; i++) {
+		if (init_worker(&workers[i], i) != LUAREST_SUCCESS) {
+			printf("Error: No applications could be loaded can't start!\n");
+			return(1);
+		}
+	}
 	
-	uv_run(uv_loop);
+	LOGF("luarest is listening on port %d", LUAREST_PORT);
+	LOGF("running %d worker(s)", num_workers);
 
-	uv_timer_stop(&timeout_timer);
-	free_applications(apps);
+	/* worker 0 runs on the main thread */
+	for (i = 1; i < num_workers; i++) {
+		uv_thread_create(&workers[i].thread, run_worker, &workers[i]);
+	}
+	run_worker(&workers[0]);
+	for (i = 1; i < num_workers; i++) {
+		uv_thread_join(&workers[i].thread);
+	}
+	free(workers);
 
 	return(0);
-}
\ No newline at end of file
+}
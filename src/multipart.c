@@ -0,0 +1,352 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "multipart.h"
+
+/**
+ * Case-insensitive comparison of a length-bounded string with a literal
+ *
+ */
+static bool equals_nocase(const char* s, size_t len, const char* literal)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (literal[i] == '\0' || tolower((unsigned char)s[i]) != tolower((unsigned char)literal[i])) {
+			return(false);
+		}
+	}
+	return(literal[len] == '\0');
+}
+/**
+ * Moves p to the end of the next parameter of a header value, the ";"
+ * separated key=value pairs following the value itself. The quotes of a
+ * quoted value are not part of it, its escapes are kept. Returns false if
+ * there are no more parameters
+ *
+ */
+static bool next_param(const char** p, const char* end, const char** key, size_t* key_len,
+	const char** value, size_t* value_len, bool* quoted)
+{
+	const char* s = *p;
+
+	while (s < end && *s != ';') {
+		s++;
+	}
+	if (s == end) {
+		return(false);
+	}
+	s++;
+	while (s < end && (*s == ' ' || *s == '\t')) {
+		s++;
+	}
+	*key = s;
+	while (s < end && *s != '=' && *s != ';' && *s != ' ' && *s != '\t') {
+		s++;
+	}
+	*key_len = s - *key;
+	while (s < end && (*s == ' ' || *s == '\t')) {
+		s++;
+	}
+	*quoted = false;
+	*value = s;
+	*value_len = 0;
+	if (s < end && *s == '=') {
+		s++;
+		while (s < end && (*s == ' ' || *s == '\t')) {
+			s++;
+		}
+		if (s < end && *s == '"') {
+			*quoted = true;
+			*value = ++s;
+			while (s < end && *s != '"') {
+				if (*s == '\\' && s + 1 < end) {
+					s++;
+				}
+				s++;
+			}
+			*value_len = s - *value;
+			if (s < end) {
+				s++;
+			}
+		}
+		else {
+			*value = s;
+			while (s < end && *s != ';' && *s != ' ' && *s != '\t') {
+				s++;
+			}
+			*value_len = s - *value;
+		}
+	}
+	*p = s;
+	return(true);
+}
+/**
+ * Copies a parameter value NUL-terminated into target, resolving the
+ * escapes of a quoted one
+ *
+ */
+static luarest_status copy_value(char* target, size_t max, const char* value, size_t len, bool quoted)
+{
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (quoted && value[i] == '\\' && i + 1 < len) {
+			i++;
+		}
+		if (n + 1 >= max) {
+			return(LUAREST_ERROR);
+		}
+		target[n++] = value[i];
+	}
+	target[n] = '\0';
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Takes the boundary from the Content-Type of a multipart/form-data body
+ *
+ */
+luarest_status multipart_boundary(const char* content_type, size_t len, const char** boundary,
+	size_t* boundary_len)
+{
+	static const char media_type[] = "multipart/form-data";
+	const char* p = content_type;
+	const char* end = content_type + len;
+	const char* key;
+	size_t key_len;
+	bool quoted;
+
+	if (len < sizeof(media_type) - 1 || !equals_nocase(p, sizeof(media_type) - 1, media_type)) {
+		return(LUAREST_ERROR);
+	}
+	p += sizeof(media_type) - 1;
+	while (next_param(&p, end, &key, &key_len, boundary, boundary_len, &quoted)) {
+		if (equals_nocase(key, key_len, "boundary")) {
+			return(*boundary_len > 0 && *boundary_len <= MULTIPART_BOUNDARY_MAX ? LUAREST_SUCCESS : LUAREST_ERROR);
+		}
+	}
+	return(LUAREST_ERROR);
+}
+/**
+ * The body may start with the boundary right away, as if a CRLF came
+ * before it, which is why two bytes of the delimiter count as matched
+ *
+ */
+luarest_status multipart_init(multipart_parser* parser, const char* boundary, size_t len,
+	const multipart_callbacks* callbacks, void* data)
+{
+	if (len == 0 || len > MULTIPART_BOUNDARY_MAX) {
+		return(LUAREST_ERROR);
+	}
+	memcpy(parser->delimiter, "\r\n--", 4);
+	memcpy(parser->delimiter + 4, boundary, len);
+	parser->delimiter_len = len + 4;
+	parser->match = 2;
+	parser->state = MULTIPART_PREAMBLE;
+	parser->header_len = 0;
+	parser->callbacks = callbacks;
+	parser->data = data;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Takes name and filename from a Content-Disposition and the Content-Type
+ * of a part, other headers are ignored
+ *
+ */
+static luarest_status parse_part_header(multipart_parser* parser)
+{
+	const char* p = parser->header;
+	const char* end = p + parser->header_len;
+	const char* colon = (const char*)memchr(p, ':', parser->header_len);
+	const char* key;
+	const char* value;
+	size_t key_len;
+	size_t value_len;
+	bool quoted;
+
+	if (colon == NULL) {
+		return(LUAREST_ERROR);
+	}
+	if (equals_nocase(p, colon - p, "Content-Disposition")) {
+		/* form-data; name="field"; filename="file.txt" */
+		p = colon + 1;
+		while (next_param(&p, end, &key, &key_len, &value, &value_len, &quoted)) {
+			if (equals_nocase(key, key_len, "name")) {
+				if (copy_value(parser->name, MULTIPART_VALUE_MAX, value, value_len, quoted) != LUAREST_SUCCESS) {
+					return(LUAREST_ERROR);
+				}
+			}
+			else if (equals_nocase(key, key_len, "filename")) {
+				if (copy_value(parser->filename, MULTIPART_VALUE_MAX, value, value_len, quoted) != LUAREST_SUCCESS) {
+					return(LUAREST_ERROR);
+				}
+				parser->has_filename = true;
+			}
+		}
+	}
+	else if (equals_nocase(p, colon - p, "Content-Type")) {
+		value = colon + 1;
+		while (value < end && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+		while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+			end--;
+		}
+		return(copy_value(parser->content_type, MULTIPART_VALUE_MAX, value, end - value, false));
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Hands out the data of the current part up to the next delimiter, the
+ * preamble is skipped the same way. Bytes which may be the start of a
+ * delimiter are held back until the next call tells what they are
+ *
+ */
+static luarest_status scan_data(multipart_parser* parser, const char* data, size_t len, size_t* pos)
+{
+	const multipart_callbacks* cb = parser->callbacks;
+	bool emit = parser->state == MULTIPART_DATA;
+	/* the part of the match held back by earlier calls */
+	size_t carried = parser->match;
+	size_t start = *pos;
+	size_t i = start;
+	size_t end;
+	const char* p;
+
+	while (i < len) {
+		if (parser->match == 0) {
+			p = (const char*)memchr(data + i, parser->delimiter[0], len - i);
+			if (p == NULL) {
+				i = len;
+				break;
+			}
+			i = p - data;
+		}
+		if (data[i] == parser->delimiter[parser->match]) {
+			i++;
+			if (++parser->match < parser->delimiter_len) {
+				continue;
+			}
+			/* the data ends in front of the delimiter */
+			end = i - (parser->delimiter_len - carried);
+			parser->match = 0;
+			parser->state = MULTIPART_BOUNDARY_END;
+			*pos = i;
+			if (emit) {
+				if (end > start && cb->on_part_data(parser, data + start, end - start) != LUAREST_SUCCESS) {
+					return(LUAREST_ERROR);
+				}
+				return(cb->on_part_end(parser));
+			}
+			return(LUAREST_SUCCESS);
+		}
+		/* what matched so far was data after all, the current byte may
+		   start a delimiter itself */
+		if (carried > 0 && emit && cb->on_part_data(parser, parser->delimiter, carried) != LUAREST_SUCCESS) {
+			return(LUAREST_ERROR);
+		}
+		carried = 0;
+		parser->match = 0;
+	}
+
+	end = len - (parser->match - carried);
+	*pos = len;
+	if (emit && end > start) {
+		return(cb->on_part_data(parser, data + start, end - start));
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Feeds the next piece of the body to the parser
+ *
+ */
+luarest_status multipart_execute(multipart_parser* parser, const char* data, size_t len)
+{
+	size_t i = 0;
+	char c;
+
+	while (i < len) {
+		switch (parser->state) {
+			case MULTIPART_PREAMBLE:
+			case MULTIPART_DATA:
+				if (scan_data(parser, data, len, &i) != LUAREST_SUCCESS) {
+					return(LUAREST_ERROR);
+				}
+				break;
+			case MULTIPART_BOUNDARY_END:
+				c = data[i++];
+				if (c == '-') {
+					parser->state = MULTIPART_CLOSE_DASH;
+				}
+				else if (c == '\r') {
+					parser->state = MULTIPART_BOUNDARY_LF;
+				}
+				else if (c != ' ' && c != '\t') {
+					/* only transport padding may follow a delimiter */
+					return(LUAREST_ERROR);
+				}
+				break;
+			case MULTIPART_CLOSE_DASH:
+				if (data[i++] != '-') {
+					return(LUAREST_ERROR);
+				}
+				parser->state = MULTIPART_END;
+				break;
+			case MULTIPART_BOUNDARY_LF:
+				if (data[i++] != '\n') {
+					return(LUAREST_ERROR);
+				}
+				parser->header_len = 0;
+				parser->name[0] = '\0';
+				parser->filename[0] = '\0';
+				parser->content_type[0] = '\0';
+				parser->has_filename = false;
+				parser->state = MULTIPART_HEADER;
+				break;
+			case MULTIPART_HEADER:
+				c = data[i++];
+				if (c == '\r') {
+					parser->state = MULTIPART_HEADER_LF;
+				}
+				else if (parser->header_len < MULTIPART_HEADER_MAX) {
+					parser->header[parser->header_len++] = c;
+				}
+				else {
+					return(LUAREST_ERROR);
+				}
+				break;
+			case MULTIPART_HEADER_LF:
+				if (data[i++] != '\n') {
+					return(LUAREST_ERROR);
+				}
+				if (parser->header_len == 0) {
+					/* an empty line ends the headers */
+					if (parser->callbacks->on_part_begin(parser) != LUAREST_SUCCESS) {
+						return(LUAREST_ERROR);
+					}
+					parser->state = MULTIPART_DATA;
+					break;
+				}
+				if (parse_part_header(parser) != LUAREST_SUCCESS) {
+					return(LUAREST_ERROR);
+				}
+				parser->header_len = 0;
+				parser->state = MULTIPART_HEADER;
+				break;
+			case MULTIPART_END:
+				/* the epilogue is ignored */
+				i = len;
+				break;
+		}
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Whether the closing delimiter has been seen
+ *
+ */
+bool multipart_complete(const multipart_parser* parser)
+{
+	return(parser->state == MULTIPART_END);
+}
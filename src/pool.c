@@ -0,0 +1,82 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+/**
+ * Free blocks are chained through their first bytes
+ *
+ */
+typedef struct free_block {
+	struct free_block* next;
+} free_block;
+
+/**
+ *
+ *
+ */
+void pool_init(pool_t* pool, size_t block_size, int max_free, bool zeroed)
+{
+	assert(block_size >= sizeof(free_block));
+	pool->block_size = block_size;
+	pool->zeroed = zeroed;
+	pool->max_free = max_free;
+	pool->num_free = 0;
+	pool->free_list = NULL;
+	pool->hits = 0;
+	pool->misses = 0;
+}
+/**
+ * Takes a block from the freelist, only falls back to the system allocator
+ * if it is empty. Fresh blocks of a zeroed pool are cleared, recycled ones
+ * are left as they were handed back except for the first pointer-sized bytes
+ *
+ */
+void* pool_get(pool_t* pool)
+{
+	free_block* block = (free_block*)pool->free_list;
+
+	if (block != NULL) {
+		pool->free_list = block->next;
+		pool->num_free--;
+		pool->hits++;
+		return(block);
+	}
+	pool->misses++;
+	if (pool->zeroed) {
+		return(calloc(1, pool->block_size));
+	}
+	return(malloc(pool->block_size));
+}
+/**
+ *
+ *
+ */
+void pool_put(pool_t* pool, void* block)
+{
+	free_block* fb = (free_block*)block;
+
+	if (pool->num_free >= pool->max_free) {
+		free(block);
+		return;
+	}
+	fb->next = (free_block*)pool->free_list;
+	pool->free_list = fb;
+	pool->num_free++;
+}
+/**
+ *
+ *
+ */
+void pool_destroy(pool_t* pool)
+{
+	free_block* block = (free_block*)pool->free_list;
+	free_block* next;
+
+	while (block != NULL) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	pool->free_list = NULL;
+	pool->num_free = 0;
+}
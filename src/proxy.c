@@ -0,0 +1,893 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <http_parser.h>
+
+#include "proxy.h"
+#include "thirdparty/utlist.h"
+
+/* Size of the buffers upstream responses are read into, every buffer is
+   handed to the client connection as it is and goes back to the route's 
+   pool once it has been written. Idle buffers kept per route */
+#define PROXY_READ_SIZE (64 * 1024)
+#define PROXY_READ_POOL_MAX 16
+
+/* Room in front of the response header, where the rewritten header can 
+   take our Connection line. The header has to fit into the rest of a 
+   read buffer */
+#define PROXY_HEADER_RESERVE 32
+
+/* Headers which only concern a single connection and are not forwarded */
+/* Expect is answered by the server, the body is sent upstream in one piece */
+static const char* hop_by_hop[] = {
+	"connection", "keep-alive", "proxy-connection", "te", "trailer",
+	"transfer-encoding", "upgrade", "content-length", "expect", NULL
+};
+/* The body of a response is relayed as the upstream framed it */
+static const char* hop_by_hop_response[] = {
+	"connection", "keep-alive", "proxy-connection", "upgrade", NULL
+};
+
+static const char* method_str[] = {
+	"", /* Sentinel */
+	"GET", "POST", "PUT", "DELETE", "OPTIONS", "HEAD"
+};
+
+static const char bad_gateway[] =
+	"HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char gateway_timeout[] =
+	"HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+struct proxy_call;
+
+/* A connection to an upstream, either serving a call or idle in the pool
+   of its peer */
+typedef struct upstream_conn {
+	uv_tcp_t handle;
+	uv_timer_t timer;
+	uv_connect_t connect_req;
+	uv_write_t write_req;
+	http_parser parser;
+	proxy_route* route;
+	upstream_peer* peer;
+	struct proxy_call* call;
+	int connected;
+	int received;
+	int done;
+	int idle;
+	int reused;
+	int closing;
+	int handles_open;
+	struct upstream_conn* prev;
+	struct upstream_conn* next;
+} upstream_conn;
+
+/* A forwarded request, lives in the request's arena */
+typedef struct proxy_call {
+	request* req;
+	proxy_route* route;
+	upstream_conn* conn;
+	/* rendered for head_peer, the Host header depends on the peer */
+	char* head;
+	size_t head_len;
+	upstream_peer* head_peer;
+	/* the response header is read into a buffer of its own until it is 
+	   complete, PROXY_HEADER_RESERVE bytes after the start of res_head */
+	char* res_head;
+	size_t res_head_len;
+	int head_relayed;
+	/* the response body ends when the upstream closes the connection */
+	int until_close;
+	size_t relayed;
+	int tries;
+} proxy_call;
+
+static http_parser_settings response_settings;
+
+static void on_timer(uv_timer_t* timer, int status);
+static uv_buf_t on_alloc(uv_handle_t* handle, size_t suggested_size);
+static void on_read(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
+static void on_upstream_connect(uv_connect_t* connect_req, int status);
+static void on_upstream_write(uv_write_t* write_req, int status);
+static luarest_status render_request(proxy_call* call, upstream_peer* peer);
+static bool is_hop_by_hop(const char** list, const slice_t* field);
+
+/**
+ *
+ *
+ */
+static void on_conn_close(uv_handle_t* handle)
+{
+	upstream_conn* conn = (upstream_conn*)handle->data;
+
+	if (--conn->handles_open == 0) {
+		free(conn);
+	}
+}
+/**
+ * Closes the connection, safe to call more than once
+ *
+ */
+static void conn_close(upstream_conn* conn)
+{
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = 1;
+	if (conn->idle) {
+		DL_DELETE(conn->peer->idle, conn);
+		conn->peer->num_idle--;
+		conn->idle = 0;
+	}
+	uv_timer_stop(&conn->timer);
+	uv_close((uv_handle_t*)&conn->handle, on_conn_close);
+	uv_close((uv_handle_t*)&conn->timer, on_conn_close);
+}
+/**
+ *
+ *
+ */
+static upstream_conn* conn_new(proxy_route* route, upstream_peer* peer)
+{
+	upstream_conn* conn = (upstream_conn*)calloc(1, sizeof(upstream_conn));
+
+	if (conn == NULL) {
+		return(NULL);
+	}
+	conn->route = route;
+	conn->peer = peer;
+	uv_tcp_init(route->loop, &conn->handle);
+	uv_timer_init(route->loop, &conn->timer);
+	conn->handle.data = conn;
+	conn->timer.data = conn;
+	conn->handles_open = 2;
+	return(conn);
+}
+/**
+ * Puts a connection whose response is complete back into its peer's pool,
+ * it keeps reading so a close by the upstream is noticed
+ *
+ */
+static void conn_release(upstream_conn* conn, bool keep_alive)
+{
+	upstream_peer* peer = conn->peer;
+
+	conn->call = NULL;
+	if (!keep_alive || peer->num_idle >= PROXY_KEEPALIVE_POOL_SIZE) {
+		conn_close(conn);
+		return;
+	}
+	conn->idle = 1;
+	DL_APPEND(peer->idle, conn);
+	peer->num_idle++;
+	uv_timer_start(&conn->timer, on_timer, PROXY_KEEPALIVE_TIMEOUT_MS, 0);
+}
+/**
+ * Round-robin over the peers which are not ejected, if all of them are the
+ * next one is tried anyway
+ *
+ */
+static upstream_peer* pick_peer(proxy_route* route)
+{
+	uint64_t now = uv_now(route->loop);
+	upstream_peer* peer;
+	int i;
+
+	for (i = 0; i < route->num_peers; i++) {
+		peer = &route->peers[(route->next_peer + i) % route->num_peers];
+		if (peer->down_until <= now) {
+			route->next_peer = (route->next_peer + i + 1) % route->num_peers;
+			return(peer);
+		}
+	}
+	peer = &route->peers[route->next_peer];
+	route->next_peer = (route->next_peer + 1) % route->num_peers;
+	return(peer);
+}
+/**
+ *
+ *
+ */
+static void peer_failed(proxy_route* route, upstream_peer* peer)
+{
+	if (++peer->fails >= PROXY_MAX_FAILS) {
+		printf("Upstream %s failed %d times, ejected for %d ms\n", peer->name, peer->fails, PROXY_EJECT_MS);
+		peer->down_until = uv_now(route->loop) + PROXY_EJECT_MS;
+		peer->fails = 0;
+	}
+}
+/**
+ * Hands back the buffer of a response header which hasn't been relayed
+ *
+ */
+static void drop_head(proxy_call* call)
+{
+	if (call->res_head != NULL) {
+		pool_put(&call->route->buffers, call->res_head);
+		call->res_head = NULL;
+		call->res_head_len = 0;
+	}
+}
+/**
+ * The call is over, the client connection takes it from here
+ *
+ */
+static void finish_call(proxy_call* call, luarest_status status)
+{
+	request* req = call->req;
+
+	call->conn = NULL;
+	req->waiting = REQUEST_WAIT_NONE;
+	req->wait_cancel = NULL;
+	req->wait_resume = NULL;
+	req->wait_data = NULL;
+	req->ops->complete(req, status);
+}
+/**
+ * Answers the client with a canned error response
+ *
+ */
+static void send_error(proxy_call* call, const char* response, size_t len)
+{
+	request* req = call->req;
+	response_body body;
+
+	body.data = response;
+	body.len = len;
+	body.lua_state = NULL;
+	body.owned = NULL;
+	body.owned_pool = NULL;
+	body.cached = NULL;
+	body.file = NULL;
+	req->ops->send(req, &body);
+	req->stream_finished = true;
+	req->close_connection = true;
+}
+/**
+ * Writes the request to the upstream and reads its response, a connection
+ * from the pool is still reading. The request is rendered again if the
+ * call moved on to another peer
+ *
+ */
+static int send_request(upstream_conn* conn, proxy_call* call, int start_reading)
+{
+	request* req = call->req;
+	uv_buf_t bufs[2];
+	int n = 0;
+
+	conn->call = call;
+	conn->received = 0;
+	conn->done = 0;
+	call->conn = conn;
+	if (call->head_peer != conn->peer && render_request(call, conn->peer) != LUAREST_SUCCESS) {
+		return(-1);
+	}
+	http_parser_init(&conn->parser, HTTP_RESPONSE);
+	conn->parser.data = conn;
+
+	bufs[n++] = uv_buf_init(call->head, call->head_len);
+	if (req->body.len > 0) {
+		bufs[n++] = uv_buf_init(req->body.base, req->body.len);
+	}
+	conn->write_req.data = conn;
+	if (uv_write(&conn->write_req, (uv_stream_t*)&conn->handle, bufs, n, on_upstream_write) != 0) {
+		return(-1);
+	}
+	if (start_reading && uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read) != 0) {
+		return(-1);
+	}
+	uv_timer_start(&conn->timer, on_timer, conn->route->read_timeout_ms, 0);
+	return(0);
+}
+/**
+ * Hands the call to an idle connection of the next peer or connects to it,
+ * gives up once every peer has been tried
+ *
+ */
+static luarest_status start_call(proxy_call* call)
+{
+	proxy_route* route = call->route;
+	upstream_peer* peer;
+	upstream_conn* conn;
+
+	while (call->tries < route->num_peers) {
+		peer = pick_peer(route);
+		if (peer->idle != NULL) {
+			/* a stale connection doesn't count as a try, see conn_failed */
+			conn = peer->idle;
+			DL_DELETE(peer->idle, conn);
+			peer->num_idle--;
+			uv_timer_stop(&conn->timer);
+			conn->idle = 0;
+			conn->reused++;
+			if (send_request(conn, call, 0) == 0) {
+				return(LUAREST_SUCCESS);
+			}
+			conn->call = NULL;
+			call->conn = NULL;
+			conn_close(conn);
+			continue;
+		}
+
+		call->tries++;
+		conn = conn_new(route, peer);
+		if (conn == NULL) {
+			return(LUAREST_ERROR);
+		}
+		conn->call = call;
+		call->conn = conn;
+		conn->connect_req.data = conn;
+		if (uv_tcp_connect(&conn->connect_req, &conn->handle, peer->address, on_upstream_connect) != 0) {
+			peer_failed(route, peer);
+			conn->call = NULL;
+			call->conn = NULL;
+			conn_close(conn);
+			continue;
+		}
+		uv_timer_start(&conn->timer, on_timer, route->connect_timeout_ms, 0);
+		return(LUAREST_SUCCESS);
+	}
+	return(LUAREST_ERROR);
+}
+/**
+ * Something went wrong on the upstream connection. Before anything has
+ * been relayed the call is retried: on a stale keep-alive connection, or on
+ * the next peer if connecting failed. Otherwise the client gets an error,
+ * or its connection is closed when the response is already half way out
+ *
+ */
+static void conn_failed(upstream_conn* conn, int timed_out)
+{
+	proxy_call* call = conn->call;
+	int stale = conn->reused > 0 && !conn->received && !timed_out;
+	int connecting = !conn->connected;
+
+	conn->call = NULL;
+	call->conn = NULL;
+	if (!stale) {
+		peer_failed(conn->route, conn->peer);
+	}
+	conn_close(conn);
+	drop_head(call);
+
+	if (call->relayed > 0) {
+		call->req->close_connection = true;
+		finish_call(call, LUAREST_ERROR);
+		return;
+	}
+	if ((stale || connecting) && start_call(call) == LUAREST_SUCCESS) {
+		return;
+	}
+	if (timed_out) {
+		send_error(call, gateway_timeout, sizeof(gateway_timeout) - 1);
+	}
+	else {
+		send_error(call, bad_gateway, sizeof(bad_gateway) - 1);
+	}
+	finish_call(call, LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static void on_upstream_connect(uv_connect_t* connect_req, int status)
+{
+	upstream_conn* conn = (upstream_conn*)connect_req->data;
+
+	if (conn->call == NULL) {
+		return;
+	}
+	if (status) {
+		conn_failed(conn, 0);
+		return;
+	}
+	conn->connected = 1;
+	if (send_request(conn, conn->call, 1) != 0) {
+		conn_failed(conn, 0);
+	}
+}
+/**
+ *
+ *
+ */
+static void on_upstream_write(uv_write_t* write_req, int status)
+{
+	upstream_conn* conn = (upstream_conn*)write_req->data;
+
+	if (status && conn->call != NULL) {
+		conn_failed(conn, 0);
+	}
+}
+/**
+ *
+ *
+ */
+static void on_timer(uv_timer_t* timer, int status)
+{
+	upstream_conn* conn = (upstream_conn*)timer->data;
+
+	if (conn->call == NULL) {
+		/* idle for too long */
+		conn_close(conn);
+		return;
+	}
+	conn_failed(conn, 1);
+}
+/**
+ * Until the response header has been relayed it is read in one piece into
+ * res_head, after that every read gets a buffer of the route's pool
+ *
+ */
+static uv_buf_t on_alloc(uv_handle_t* handle, size_t suggested_size)
+{
+	upstream_conn* conn = (upstream_conn*)handle->data;
+	proxy_call* call = conn->call;
+	char* base;
+
+	if (call != NULL && !call->head_relayed) {
+		if (call->res_head == NULL) {
+			call->res_head = (char*)pool_get(&conn->route->buffers);
+			call->res_head_len = 0;
+			if (call->res_head == NULL) {
+				return(uv_buf_init(NULL, 0));
+			}
+		}
+		return(uv_buf_init(call->res_head + PROXY_HEADER_RESERVE + call->res_head_len,
+			PROXY_READ_SIZE - PROXY_HEADER_RESERVE - call->res_head_len));
+	}
+	base = (char*)pool_get(&conn->route->buffers);
+	return(uv_buf_init(base, base ? PROXY_READ_SIZE : 0));
+}
+/**
+ * The client's write queue drained, continue reading the response
+ *
+ */
+static void proxy_resume(request* req)
+{
+	proxy_call* call = (proxy_call*)req->wait_data;
+	upstream_conn* conn = call->conn;
+
+	if (conn != NULL) {
+		uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read);
+		uv_timer_start(&conn->timer, on_timer, conn->route->read_timeout_ms, 0);
+	}
+}
+/**
+ * The client went away, the upstream connection is in the middle of a
+ * response and can't be reused
+ *
+ */
+static void proxy_cancel(request* req)
+{
+	proxy_call* call = (proxy_call*)req->wait_data;
+
+	if (call->conn != NULL) {
+		call->conn->call = NULL;
+		conn_close(call->conn);
+		call->conn = NULL;
+	}
+	drop_head(call);
+}
+/**
+ * Hands len bytes at data to the client, block goes back to the route's
+ * pool once they have been written
+ *
+ */
+static void relay(proxy_call* call, const char* data, size_t len, char* block)
+{
+	response_body body;
+
+	body.data = data;
+	body.len = len;
+	body.lua_state = NULL;
+	body.owned = block;
+	body.owned_pool = block != NULL ? &call->route->buffers : NULL;
+	body.cached = NULL;
+	body.file = NULL;
+	call->req->ops->send(call->req, &body);
+	call->relayed += len;
+}
+/**
+ * Returns the length of the header in data up to and including the empty
+ * line, 0 while it is incomplete. The first from bytes have been searched
+ *
+ */
+static size_t find_header_end(const char* data, size_t len, size_t from)
+{
+	const char* p = data + (from > 2 ? from - 2 : 0);
+	const char* end = data + len;
+
+	while ((p = (const char*)memchr(p, '\n', end - p)) != NULL) {
+		if (end - p > 1 && p[1] == '\n') {
+			return(p + 2 - data);
+		}
+		if (end - p > 2 && p[1] == '\r' && p[2] == '\n') {
+			return(p + 3 - data);
+		}
+		p++;
+	}
+	return(0);
+}
+/**
+ * Rewrites the parsed response header of len bytes in place: the status 
+ * line speaks HTTP/1.1, the hop-by-hop lines are dropped and the client 
+ * connection's own Connection line is added. Lines only move towards the
+ * start of res_head, returns the length of the new header
+ *
+ */
+static size_t rewrite_head(proxy_call* call, size_t len)
+{
+	request* req = call->req;
+	char* out = call->res_head;
+	const char* in = call->res_head + PROXY_HEADER_RESERVE;
+	const char* in_end = in + len;
+	const char* eol;
+	const char* colon;
+	const char* connection = NULL;
+	slice_t field;
+	bool skip = false;
+
+	eol = (const char*)memchr(in, '\n', in_end - in) + 1;
+	memmove(out, in, eol - in);
+	memcpy(out, "HTTP/1.1", 8);
+	out += eol - in;
+	for (in = eol; *in != '\r' && *in != '\n'; in = eol) {
+		eol = (const char*)memchr(in, '\n', in_end - in) + 1;
+		/* a folded line belongs to the field before it */
+		if (*in != ' ' && *in != '\t') {
+			colon = (const char*)memchr(in, ':', eol - in);
+			field.base = (char*)in;
+			field.len = colon != NULL ? (size_t)(colon - in) : 0;
+			skip = is_hop_by_hop(hop_by_hop_response, &field);
+		}
+		if (!skip) {
+			memmove(out, in, eol - in);
+			out += eol - in;
+		}
+	}
+
+	if (call->until_close || !req->keep_alive) {
+		connection = "Connection: close\r\n";
+	}
+	else if (req->keep_alive_header) {
+		connection = "Connection: Keep-Alive\r\n";
+	}
+	if (connection != NULL) {
+		memcpy(out, connection, strlen(connection));
+		out += strlen(connection);
+	}
+	memcpy(out, "\r\n", 2);
+	out += 2;
+	return(out - call->res_head);
+}
+/**
+ * Relays everything up to the end of the response to the client. The 
+ * header is collected and rewritten first, body bytes are relayed in the
+ * read buffer they arrived in
+ *
+ */
+static void on_read(uv_stream_t* stream, ssize_t nread, uv_buf_t buf)
+{
+	upstream_conn* conn = (upstream_conn*)stream->data;
+	proxy_call* call = conn->call;
+	pool_t* buffers = &conn->route->buffers;
+	request* req;
+	char* block = buf.base;
+	char* data = buf.base;
+	size_t len = nread > 0 ? (size_t)nread : 0;
+	size_t parsed = 0;
+	size_t offset;
+	size_t end;
+	bool extra = false;
+	bool keep_alive;
+
+	if (call == NULL) {
+		if (buf.base != NULL) {
+			pool_put(buffers, buf.base);
+		}
+		if (nread != 0) {
+			/* an idle connection was closed or sent something unasked */
+			conn_close(conn);
+		}
+		return;
+	}
+	req = call->req;
+	if (nread <= 0) {
+		/* the buffer of a header which is being read stays with the call */
+		if (buf.base != NULL && call->head_relayed) {
+			pool_put(buffers, buf.base);
+		}
+		if (nread == 0) {
+			return;
+		}
+		/* a response without a length ends with the connection */
+		http_parser_execute(&conn->parser, &response_settings, NULL, 0);
+		if (conn->done) {
+			conn->call = NULL;
+			conn_close(conn);
+			req->stream_finished = true;
+			req->close_connection = true;
+			finish_call(call, LUAREST_SUCCESS);
+		}
+		else {
+			conn_failed(conn, 0);
+		}
+		return;
+	}
+
+	conn->received = 1;
+	uv_timer_start(&conn->timer, on_timer, conn->route->read_timeout_ms, 0);
+	if (!call->head_relayed) {
+		block = call->res_head;
+		data = block + PROXY_HEADER_RESERVE;
+		offset = call->res_head_len;
+		call->res_head_len += len;
+		end = find_header_end(data, call->res_head_len, offset);
+		if (end == 0) {
+			if (call->res_head_len >= PROXY_READ_SIZE - PROXY_HEADER_RESERVE) {
+				/* a header this large is not relayed */
+				conn_failed(conn, 0);
+			}
+			return;
+		}
+		http_parser_execute(&conn->parser, &response_settings, data, end);
+		if (HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK && HTTP_PARSER_ERRNO(&conn->parser) != HPE_PAUSED) {
+			conn_failed(conn, 0);
+			return;
+		}
+		/* without a length or chunks the body runs until the upstream closes */
+		call->until_close = !conn->done && !(conn->parser.flags & F_CHUNKED) &&
+			conn->parser.content_length == ULLONG_MAX;
+		len = call->res_head_len - end;
+		call->res_head = NULL;
+		call->res_head_len = 0;
+		call->head_relayed = 1;
+		offset = rewrite_head(call, end);
+		if (len > 0 && !conn->done) {
+			relay(call, block, offset, NULL);
+			data += end;
+		}
+		else {
+			relay(call, block, offset, block);
+			extra = len > 0;
+			block = NULL;
+		}
+	}
+
+	if (block != NULL) {
+		parsed = http_parser_execute(&conn->parser, &response_settings, data, len);
+		if (HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK && HTTP_PARSER_ERRNO(&conn->parser) != HPE_PAUSED) {
+			pool_put(buffers, block);
+			conn_failed(conn, 0);
+			return;
+		}
+		if (parsed > 0) {
+			relay(call, data, parsed, block);
+		}
+		else {
+			pool_put(buffers, block);
+		}
+		extra = parsed != len;
+	}
+
+	if (conn->done) {
+		/* anything after the response makes the connection unusable */
+		keep_alive = http_should_keep_alive(&conn->parser) && !extra;
+		conn->peer->fails = 0;
+		uv_timer_stop(&conn->timer);
+		conn_release(conn, keep_alive);
+		req->stream_finished = true;
+		finish_call(call, LUAREST_SUCCESS);
+	}
+	else if (req->ops->congested(req)) {
+		uv_read_stop(stream);
+		uv_timer_stop(&conn->timer);
+		req->waiting = REQUEST_WAIT_WRITE;
+		req->wait_resume = proxy_resume;
+	}
+}
+/**
+ *
+ *
+ */
+static int on_headers_complete(http_parser* parser)
+{
+	upstream_conn* conn = (upstream_conn*)parser->data;
+
+	/* the response to a HEAD request has no body */
+	return(conn->call->req->method == HTTP_METHOD_HEAD ? 1 : 0);
+}
+/**
+ *
+ *
+ */
+static int on_message_complete(http_parser* parser)
+{
+	upstream_conn* conn = (upstream_conn*)parser->data;
+
+	conn->done = 1;
+	http_parser_pause(parser, 1);
+	return(0);
+}
+/**
+ *
+ *
+ */
+static bool is_hop_by_hop(const char** list, const slice_t* field)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; list[i] != NULL; i++) {
+		if (strlen(list[i]) != field->len) {
+			continue;
+		}
+		for (j = 0; j < field->len; j++) {
+			if (tolower((unsigned char)field->base[j]) != list[i][j]) {
+				break;
+			}
+		}
+		if (j == field->len) {
+			return(true);
+		}
+	}
+	return(false);
+}
+/**
+ * Renders the request line and headers sent upstream into the request's
+ * arena. The path is the one below the application, hop-by-hop headers are
+ * dropped and the body length is set by us
+ *
+ */
+static luarest_status render_request(proxy_call* call, upstream_peer* peer)
+{
+	request* req = call->req;
+	char* path = req->path.base;
+	size_t path_len = req->path.len;
+	char* slash = (char*)memchr(path + 1, '/', path_len - 1);
+	size_t size;
+	char* p;
+	int has_host = 0;
+	int i;
+
+	path_len -= slash - path;
+	path = slash;
+
+	/* request line, Host, Content-Length and Connection fit in 128 bytes */
+	size = 128 + path_len + req->query.len + sizeof(peer->name);
+	for (i = 0; i < req->num_headers; i++) {
+		size += req->headers[i].field.len + req->headers[i].value.len + 4;
+	}
+	call->head = (char*)arena_alloc(req->arena, size);
+	if (call->head == NULL) {
+		return(LUAREST_ERROR);
+	}
+
+	p = call->head;
+	p += sprintf(p, "%s %.*s%s%.*s HTTP/1.%d\r\n", method_str[req->method], (int)path_len, path,
+		req->query.len ? "?" : "", (int)req->query.len, req->query.base, req->http_minor > 0 ? 1 : 0);
+	for (i = 0; i < req->num_headers; i++) {
+		if (is_hop_by_hop(hop_by_hop, &req->headers[i].field)) {
+			continue;
+		}
+		if (req->headers[i].field.len == 4 && strncasecmp(req->headers[i].field.base, "host", 4) == 0) {
+			has_host = 1;
+		}
+		memcpy(p, req->headers[i].field.base, req->headers[i].field.len);
+		p += req->headers[i].field.len;
+		*p++ = ':';
+		*p++ = ' ';
+		memcpy(p, req->headers[i].value.base, req->headers[i].value.len);
+		p += req->headers[i].value.len;
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	if (!has_host) {
+		p += sprintf(p, "Host: %s\r\n", peer->name);
+	}
+	if (req->body.len > 0 || req->method == HTTP_METHOD_POST || req->method == HTTP_METHOD_PUT) {
+		p += sprintf(p, "Content-Length: %lu\r\n", (unsigned long)req->body.len);
+	}
+	if (req->http_minor == 0) {
+		p += sprintf(p, "Connection: keep-alive\r\n");
+	}
+	*p++ = '\r';
+	*p++ = '\n';
+	call->head_len = p - call->head;
+	call->head_peer = peer;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Forwards the request to one of the route's upstreams, the response is
+ * relayed to the client through req->ops->send without ever entering Lua
+ *
+ */
+luarest_status proxy_request(proxy_route* route, request* req)
+{
+	proxy_call* call = (proxy_call*)arena_alloc(req->arena, sizeof(proxy_call));
+
+	if (call == NULL) {
+		return(LUAREST_ERROR);
+	}
+	memset(call, 0, sizeof(proxy_call));
+	call->req = req;
+	call->route = route;
+
+	/* the response is sent as the upstream framed it */
+	req->streaming = true;
+	if (start_call(call) != LUAREST_SUCCESS) {
+		send_error(call, bad_gateway, sizeof(bad_gateway) - 1);
+		return(LUAREST_SUCCESS);
+	}
+	req->waiting = REQUEST_WAIT_EVENT;
+	req->wait_cancel = proxy_cancel;
+	req->wait_resume = NULL;
+	req->wait_data = call;
+	return(LUAREST_PENDING);
+}
+/**
+ * Creates a route for the "a.b.c.d:port" upstreams
+ *
+ */
+proxy_route* proxy_route_new(uv_loop_t* loop, const char** upstreams, int num_upstreams)
+{
+	proxy_route* route;
+	upstream_peer* peer;
+	const char* colon;
+	char host[PROXY_UPSTREAM_NAME_MAX];
+	int port;
+	int i;
+
+	if (response_settings.on_message_complete == NULL) {
+		response_settings.on_headers_complete = on_headers_complete;
+		response_settings.on_message_complete = on_message_complete;
+	}
+	if (num_upstreams < 1) {
+		return(NULL);
+	}
+	route = (proxy_route*)calloc(1, sizeof(proxy_route));
+	route->peers = (upstream_peer*)calloc(num_upstreams, sizeof(upstream_peer));
+	route->num_peers = num_upstreams;
+	route->loop = loop;
+	route->connect_timeout_ms = PROXY_CONNECT_TIMEOUT_MS;
+	route->read_timeout_ms = PROXY_READ_TIMEOUT_MS;
+	pool_init(&route->buffers, PROXY_READ_SIZE, PROXY_READ_POOL_MAX, false);
+
+	for (i = 0; i < num_upstreams; i++) {
+		peer = &route->peers[i];
+		colon = strrchr(upstreams[i], ':');
+		if (colon == NULL || (size_t)(colon - upstreams[i]) >= sizeof(host) ||
+			strlen(upstreams[i]) >= sizeof(peer->name)) {
+			break;
+		}
+		memcpy(host, upstreams[i], colon - upstreams[i]);
+		host[colon - upstreams[i]] = '\0';
+		port = atoi(colon + 1);
+		if (port <= 0 || port > 65535) {
+			break;
+		}
+		peer->address = uv_ip4_addr(host, port);
+		if (peer->address.sin_addr.s_addr == INADDR_NONE) {
+			break;
+		}
+		strcpy(peer->name, upstreams[i]);
+	}
+	if (i < num_upstreams) {
+		proxy_route_free(route);
+		return(NULL);
+	}
+	return(route);
+}
+/**
+ * Frees a route which no service refers to, it has never forwarded a request
+ *
+ */
+void proxy_route_free(proxy_route* route)
+{
+	pool_destroy(&route->buffers);
+	free(route->peers);
+	free(route);
+}
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+/**
+ *
+ *
+ */
+static router_node* new_node(const char* prefix, size_t prefix_len)
+{
+	router_node* node = (router_node*)calloc(1, sizeof(router_node));
+
+	if (prefix_len > 0) {
+		node->prefix = (char*)malloc(prefix_len);
+		memcpy(node->prefix, prefix, prefix_len);
+		node->prefix_len = prefix_len;
+	}
+	return(node);
+}
+/**
+ *
+ *
+ */
+static void add_child(router_node* node, router_node* child)
+{
+	node->children = (router_node**)realloc(node->children, sizeof(router_node*) * (node->num_children + 1));
+	node->children[node->num_children++] = child;
+}
+/**
+ *
+ *
+ */
+static router_node* find_child(router_node* node, char c)
+{
+	int i;
+
+	for (i = 0; i < node->num_children; i++) {
+		if (node->children[i]->prefix[0] == c) {
+			return(node->children[i]);
+		}
+	}
+	return(NULL);
+}
+/**
+ * Splits node after the first len bytes of its prefix, the tail with all of
+ * the node's children and data becomes its only child
+ *
+ */
+static void split_node(router_node* node, size_t len)
+{
+	router_node* tail = new_node(node->prefix + len, node->prefix_len - len);
+
+	tail->children = node->children;
+	tail->num_children = node->num_children;
+	tail->param = node->param;
+	tail->wildcard = node->wildcard;
+	tail->data = node->data;
+
+	node->prefix_len = len;
+	node->children = NULL;
+	node->num_children = 0;
+	node->param = NULL;
+	node->wildcard = NULL;
+	node->data = NULL;
+	add_child(node, tail);
+}
+/**
+ * ':' and '*' only start a capture at the beginning of a segment
+ *
+ */
+static size_t static_run(const char* pattern, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((pattern[i] == ':' || pattern[i] == '*') && i > 0 && pattern[i-1] == '/') {
+			break;
+		}
+	}
+	return(i);
+}
+/**
+ *
+ *
+ */
+static luarest_status insert(router_node* node, const char* pattern, size_t len, void* data)
+{
+	const char* start = pattern;
+	router_node* child;
+	size_t run;
+	size_t name_len;
+	size_t common;
+
+	while (len > 0) {
+		if (pattern > start && pattern[-1] == '/' && *pattern == ':') {
+			for (name_len = 1; name_len < len && pattern[name_len] != '/'; name_len++);
+			if (node->param == NULL) {
+				node->param = new_node(NULL, 0);
+				node->param->name = (char*)malloc(name_len - 1);
+				memcpy(node->param->name, pattern + 1, name_len - 1);
+				node->param->name_len = name_len - 1;
+			}
+			else if (node->param->name_len != name_len - 1 || 
+				memcmp(node->param->name, pattern + 1, name_len - 1) != 0) {
+				/* the same position can't be captured under two names */
+				return(LUAREST_ERROR);
+			}
+			node = node->param;
+			pattern += name_len;
+			len -= name_len;
+			continue;
+		}
+		if (pattern > start && pattern[-1] == '/' && *pattern == '*') {
+			if (node->wildcard != NULL) {
+				return(LUAREST_ERROR);
+			}
+			node->wildcard = new_node(NULL, 0);
+			node->wildcard->name = (char*)malloc(len > 1 ? len - 1 : 1);
+			memcpy(node->wildcard->name, len > 1 ? pattern + 1 : "*", len > 1 ? len - 1 : 1);
+			node->wildcard->name_len = len > 1 ? len - 1 : 1;
+			node->wildcard->data = data;
+			return(LUAREST_SUCCESS);
+		}
+
+		run = static_run(pattern, len);
+		child = find_child(node, *pattern);
+		if (child == NULL) {
+			child = new_node(pattern, run);
+			add_child(node, child);
+		}
+		else {
+			for (common = 0; common < run && common < child->prefix_len && 
+				child->prefix[common] == pattern[common]; common++);
+			if (common < child->prefix_len) {
+				split_node(child, common);
+			}
+			run = common;
+		}
+		node = child;
+		pattern += run;
+		len -= run;
+	}
+
+	if (node->data != NULL) {
+		return(LUAREST_ERROR);
+	}
+	node->data = data;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * The prefix of node has already been consumed, static children take
+ * precedence over the parameter which takes precedence over the wildcard
+ *
+ */
+static void* match_node(router_node* node, const char* path, size_t len, route_match* match)
+{
+	router_node* child;
+	route_param* param;
+	size_t seg;
+	void* data;
+
+	if (len == 0 && node->data != NULL) {
+		return(node->data);
+	}
+	if (len > 0) {
+		child = find_child(node, *path);
+		if (child != NULL && child->prefix_len <= len && memcmp(child->prefix, path, child->prefix_len) == 0) {
+			data = match_node(child, path + child->prefix_len, len - child->prefix_len, match);
+			if (data != NULL) {
+				return(data);
+			}
+		}
+	}
+	if (node->param != NULL && len > 0 && *path != '/' && match->num_params < ROUTER_MAX_PARAMS) {
+		for (seg = 0; seg < len && path[seg] != '/'; seg++);
+		param = &match->params[match->num_params++];
+		param->name.base = node->param->name;
+		param->name.len = node->param->name_len;
+		param->value.base = (char*)path;
+		param->value.len = seg;
+		data = match_node(node->param, path + seg, len - seg, match);
+		if (data != NULL) {
+			return(data);
+		}
+		match->num_params--;
+	}
+	if (node->wildcard != NULL && match->num_params < ROUTER_MAX_PARAMS) {
+		param = &match->params[match->num_params++];
+		param->name.base = node->wildcard->name;
+		param->name.len = node->wildcard->name_len;
+		param->value.base = (char*)path;
+		param->value.len = len;
+		return(node->wildcard->data);
+	}
+	return(NULL);
+}
+/**
+ *
+ *
+ */
+static void free_node(router_node* node)
+{
+	int i;
+
+	if (node == NULL) {
+		return;
+	}
+	for (i = 0; i < node->num_children; i++) {
+		free_node(node->children[i]);
+	}
+	free_node(node->param);
+	free_node(node->wildcard);
+	free(node->children);
+	free(node->prefix);
+	free(node->name);
+	free(node);
+}
+/**
+ *
+ *
+ */
+void router_init(router* r)
+{
+	memset(r, 0, sizeof(router));
+}
+/**
+ * Adds a route like "/users/:id" or "/files/" followed by a wildcard, fails
+ * if the method is unknown or the pattern is already taken
+ *
+ */
+luarest_status router_add(router* r, int method, const char* pattern, void* data)
+{
+	if (method <= 0 || method >= ROUTER_MAX_METHODS) {
+		return(LUAREST_ERROR);
+	}
+	if (r->roots[method] == NULL) {
+		r->roots[method] = new_node(NULL, 0);
+	}
+	return(insert(r->roots[method], pattern, strlen(pattern), data));
+}
+/**
+ * Doesn't allocate, the captured parameters are written to match
+ *
+ */
+void* router_lookup(router* r, int method, const char* path, size_t len, route_match* match)
+{
+	match->num_params = 0;
+	if (method <= 0 || method >= ROUTER_MAX_METHODS || r->roots[method] == NULL) {
+		return(NULL);
+	}
+	return(match_node(r->roots[method], path, len, match));
+}
+/**
+ *
+ *
+ */
+void router_free(router* r)
+{
+	int i;
+
+	for (i = 0; i < ROUTER_MAX_METHODS; i++) {
+		free_node(r->roots[i]);
+		r->roots[i] = NULL;
+	}
+}
@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "static_files.h"
+#include "escape.h"
+#include "http_date.h"
+
+#ifdef WIN32
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+typedef struct _stati64 file_stat;
+#else
+typedef struct stat file_stat;
+#endif
+
+#define GZ_SUFFIX ".gz"
+#define MIME_DEFAULT "application/octet-stream"
+
+/* Room for the value of a Content-Range header */
+#define CONTENT_RANGE_MAX 72
+
+/*-----------------------------------------------------------------------------
+ * Data structures
+ *----------------------------------------------------------------------------*/
+
+/* A directory files were served from, watched for changes */
+typedef struct static_dir {
+	char* path;
+	size_t path_len;
+	uv_fs_event_t watch;
+	bool watching;
+	static_route* route;
+	UT_hash_handle hh;
+} static_dir;
+
+typedef struct mime_type {
+	const char* ext;
+	const char* type;
+} mime_type;
+
+static const mime_type mime_types[] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"css", "text/css"},
+	{"js", "application/javascript"},
+	{"json", "application/json"},
+	{"txt", "text/plain"},
+	{"xml", "application/xml"},
+	{"svg", "image/svg+xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"ico", "image/x-icon"},
+	{"webp", "image/webp"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{"pdf", "application/pdf"},
+	{"wasm", "application/wasm"},
+	{NULL, NULL} /* sentinel */
+};
+
+/**
+ *
+ *
+ */
+static const char* find_mime_type(const char* path, size_t len)
+{
+	const char* ext = path + len;
+	int i;
+
+	while (ext > path && ext[-1] != '.' && ext[-1] != '/') {
+		ext--;
+	}
+	if (ext == path || ext[-1] != '.') {
+		return(MIME_DEFAULT);
+	}
+	for (i = 0; mime_types[i].ext != NULL; i++) {
+		if (strcmp(ext, mime_types[i].ext) == 0) {
+			return(mime_types[i].type);
+		}
+	}
+	return(MIME_DEFAULT);
+}
+/**
+ *
+ *
+ */
+static_route* static_route_new(uv_loop_t* loop, const char* root)
+{
+	static_route* route = (static_route*)malloc(sizeof(static_route));
+	size_t len = strlen(root);
+
+	if (route == NULL) {
+		return(NULL);
+	}
+	while (len > 1 && root[len - 1] == '/') {
+		len--;
+	}
+	route->root = (char*)malloc(len + 1);
+	if (route->root == NULL) {
+		free(route);
+		return(NULL);
+	}
+	memcpy(route->root, root, len);
+	route->root[len] = '\0';
+	route->root_len = len;
+	route->loop = loop;
+	route->files = NULL;
+	route->num_files = 0;
+	route->dirs = NULL;
+	return(route);
+}
+/**
+ * Frees a route which no service refers to, it has never served a file
+ *
+ */
+void static_route_free(static_route* route)
+{
+	free(route->root);
+	free(route);
+}
+/**
+ *
+ *
+ */
+static void close_file(uv_loop_t* loop, uv_file fd)
+{
+	uv_fs_t fs;
+
+	uv_fs_close(loop, &fs, fd, NULL);
+	uv_fs_req_cleanup(&fs);
+}
+/**
+ * Drops a reference, the last one closes the file
+ *
+ */
+void static_file_release(static_file* file)
+{
+	if (--file->refs > 0) {
+		return;
+	}
+	close_file(file->loop, file->fd);
+	if (file->gz != NULL) {
+		static_file_release(file->gz);
+	}
+	free(file);
+}
+/**
+ * Opens a regular file or a directory, is_dir tells which. These are the
+ * only blocking calls of a request for a static file, the cache of open
+ * files keeps them off the path of most requests
+ *
+ */
+static uv_file open_file(uv_loop_t* loop, const char* path, uint64_t* size, time_t* mtime, bool* is_dir)
+{
+	uv_fs_t fs;
+	uv_file fd;
+	file_stat* st;
+	bool ok;
+
+	uv_fs_open(loop, &fs, path, O_RDONLY, 0, NULL);
+	fd = (uv_file)fs.result;
+	uv_fs_req_cleanup(&fs);
+	if (fd < 0) {
+		return(-1);
+	}
+	uv_fs_fstat(loop, &fs, fd, NULL);
+	st = (file_stat*)fs.ptr;
+	ok = fs.result == 0 && (S_ISREG(st->st_mode) || S_ISDIR(st->st_mode));
+	if (ok) {
+		*is_dir = S_ISDIR(st->st_mode);
+		*size = (uint64_t)st->st_size;
+		*mtime = st->st_mtime;
+	}
+	uv_fs_req_cleanup(&fs);
+	if (!ok) {
+		close_file(loop, fd);
+		return(-1);
+	}
+	return(fd);
+}
+/**
+ *
+ *
+ */
+static static_file* new_file(uv_loop_t* loop, const char* path, size_t len, uv_file fd, uint64_t size, time_t mtime)
+{
+	static_file* file = (static_file*)malloc(sizeof(static_file) + len + 1);
+
+	if (file == NULL) {
+		return(NULL);
+	}
+	file->loop = loop;
+	file->path = (char*)(file + 1);
+	memcpy(file->path, path, len);
+	file->path[len] = '\0';
+	file->path_len = len;
+	file->fd = fd;
+	file->size = size;
+	file->mtime = mtime;
+	file->gz = NULL;
+	file->refs = 1;
+	return(file);
+}
+/**
+ * Drops the cache's reference of the file
+ *
+ */
+static void drop_file(static_route* route, static_file* file)
+{
+	HASH_DELETE(hh, route->files, file);
+	route->num_files--;
+	static_file_release(file);
+}
+/**
+ * Something in the directory changed. Everything of the directory is
+ * dropped if it isn't known what, otherwise the file which changed and the
+ * file a changed .gz is the sibling of
+ *
+ */
+static void on_dir_change(uv_fs_event_t* handle, const char* filename, int events, int status)
+{
+	static_dir* dir = (static_dir*)handle->data;
+	static_route* route = dir->route;
+	static_file* file;
+	static_file* tmp;
+	const char* name;
+	size_t name_len = filename ? strlen(filename) : 0;
+	size_t len;
+
+	HASH_ITER(hh, route->files, file, tmp) {
+		if (file->path_len <= dir->path_len || file->path[dir->path_len] != '/' ||
+			memcmp(file->path, dir->path, dir->path_len) != 0) {
+			continue;
+		}
+		name = file->path + dir->path_len + 1;
+		len = file->path_len - dir->path_len - 1;
+		if (filename == NULL || status != 0 || (events & UV_RENAME) ||
+			(name_len == len && memcmp(name, filename, len) == 0) ||
+			(name_len == len + sizeof(GZ_SUFFIX) - 1 && memcmp(name, filename, len) == 0 &&
+			strcmp(filename + len, GZ_SUFFIX) == 0)) {
+			drop_file(route, file);
+		}
+	}
+}
+/**
+ * Returns whether changes of the directory of len bytes of path are
+ * noticed, it is watched from the first time a file of it is opened
+ *
+ */
+static bool watch_dir(static_route* route, const char* path, size_t len)
+{
+	static_dir* dir = NULL;
+
+	HASH_FIND(hh, route->dirs, path, len, dir);
+	if (dir != NULL) {
+		return(dir->watching);
+	}
+	dir = (static_dir*)malloc(sizeof(static_dir) + len + 1);
+	if (dir == NULL) {
+		return(false);
+	}
+	dir->path = (char*)(dir + 1);
+	memcpy(dir->path, path, len);
+	dir->path[len] = '\0';
+	dir->path_len = len;
+	dir->route = route;
+	dir->watching = uv_fs_event_init(route->loop, &dir->watch, dir->path, on_dir_change, 0) == 0;
+	dir->watch.data = dir;
+	HASH_ADD_KEYPTR(hh, route->dirs, dir->path, dir->path_len, dir);
+	return(dir->watching);
+}
+/**
+ * Returns the file with a reference taken for the caller, NULL if it
+ * doesn't exist or is a directory (is_dir). path has room for GZ_SUFFIX
+ *
+ */
+static static_file* open_static(static_route* route, char* path, size_t len, bool* is_dir)
+{
+	static_file* file = NULL;
+	uint64_t size;
+	time_t mtime;
+	uv_file fd;
+	bool gz_is_dir;
+	char* slash;
+
+	*is_dir = false;
+	HASH_FIND(hh, route->files, path, len, file);
+	if (file != NULL) {
+		/* most recently used ones go to the end */
+		HASH_DELETE(hh, route->files, file);
+		HASH_ADD_KEYPTR(hh, route->files, file->path, file->path_len, file);
+		file->refs++;
+		return(file);
+	}
+
+	fd = open_file(route->loop, path, &size, &mtime, is_dir);
+	if (fd >= 0 && *is_dir) {
+		close_file(route->loop, fd);
+		return(NULL);
+	}
+	if (fd < 0) {
+		return(NULL);
+	}
+	file = new_file(route->loop, path, len, fd, size, mtime);
+	if (file == NULL) {
+		close_file(route->loop, fd);
+		return(NULL);
+	}
+
+	memcpy(path + len, GZ_SUFFIX, sizeof(GZ_SUFFIX));
+	fd = open_file(route->loop, path, &size, &mtime, &gz_is_dir);
+	if (fd >= 0) {
+		if (!gz_is_dir) {
+			file->gz = new_file(route->loop, path, len + sizeof(GZ_SUFFIX) - 1, fd, size, mtime);
+		}
+		if (file->gz == NULL) {
+			close_file(route->loop, fd);
+		}
+	}
+	path[len] = '\0';
+
+	/* cached only if it is noticed when the file changes */
+	slash = strrchr(path, '/');
+	if (slash != NULL && watch_dir(route, path, slash - path)) {
+		if (route->num_files >= STATIC_CACHE_MAX) {
+			/* the head of the hash is the least recently used */
+			drop_file(route, route->files);
+		}
+		file->refs++;
+		HASH_ADD_KEYPTR(hh, route->files, file->path, file->path_len, file);
+		route->num_files++;
+	}
+	return(file);
+}
+/**
+ * Maps the part of the request path below the route's prefix to a path
+ * below the route's root, NULL if it leaves the root. It lives in the
+ * request's arena and has room for appending GZ_SUFFIX
+ *
+ */
+static char* resolve_path(static_route* route, request* req, size_t* len)
+{
+	slice_t rel = { NULL, 0 };
+	char* unescaped;
+	char* path;
+	char* p;
+	char* segment;
+	size_t rel_len;
+	size_t size;
+
+	if (req->match.num_params > 0) {
+		/* the wildcard is always the last capture */
+		rel = req->match.params[req->match.num_params - 1].value;
+	}
+	unescaped = (char*)arena_alloc(req->arena, rel.len + 1);
+	if (unescaped == NULL) {
+		return(NULL);
+	}
+	memcpy(unescaped, rel.base, rel.len);
+	unescaped[rel.len] = '\0';
+	url_unescape(unescaped, unescaped);
+	rel_len = strlen(unescaped);
+
+	for (segment = unescaped; segment != NULL; segment = p ? p + 1 : NULL) {
+		p = strchr(segment, '/');
+		if ((p ? (size_t)(p - segment) : strlen(segment)) == 2 && segment[0] == '.' && segment[1] == '.') {
+			return(NULL);
+		}
+	}
+	if (strchr(unescaped, '\\') != NULL) {
+		return(NULL);
+	}
+
+	size = route->root_len + rel_len + sizeof("/" STATIC_INDEX) + sizeof(GZ_SUFFIX);
+	if (size > STATIC_PATH_MAX) {
+		return(NULL);
+	}
+	path = (char*)arena_alloc(req->arena, size);
+	if (path == NULL) {
+		return(NULL);
+	}
+	*len = sprintf(path, "%s/%s%s", route->root, unescaped,
+		rel_len == 0 || unescaped[rel_len - 1] == '/' ? STATIC_INDEX : "");
+	return(path);
+}
+/**
+ * Parses a decimal number of at most 18 digits, so it can't overflow
+ *
+ */
+static const char* parse_offset(const char* p, const char* end, uint64_t* value)
+{
+	int digits = 0;
+
+	*value = 0;
+	while (p < end && *p >= '0' && *p <= '9' && digits < 18) {
+		*value = *value * 10 + (*p - '0');
+		p++;
+		digits++;
+	}
+	return(digits > 0 && (p == end || *p < '0' || *p > '9') ? p : NULL);
+}
+/**
+ * Parses a Range header for a file of size bytes. Returns 1 for a range
+ * which can be satisfied, -1 for one which can't and 0 if the header is to
+ * be ignored. Only a single range is supported, a request for several gets
+ * the whole file
+ *
+ */
+static int parse_range(const slice_t* value, uint64_t size, uint64_t* first, uint64_t* last)
+{
+	const char* p = value->base;
+	const char* end = p + value->len;
+	uint64_t n;
+
+	if (value->len < 6 || memcmp(p, "bytes=", 6) != 0 || memchr(p, ',', value->len) != NULL) {
+		return(0);
+	}
+	p += 6;
+	if (p < end && *p == '-') {
+		/* the last n bytes */
+		if (parse_offset(p + 1, end, &n) == NULL) {
+			return(0);
+		}
+		if (n == 0 || size == 0) {
+			return(-1);
+		}
+		*first = n >= size ? 0 : size - n;
+		*last = size - 1;
+		return(1);
+	}
+	p = parse_offset(p, end, first);
+	if (p == NULL || p == end || *p != '-') {
+		return(0);
+	}
+	p++;
+	*last = size - 1;
+	if (p < end) {
+		if (parse_offset(p, end, &n) == NULL) {
+			return(0);
+		}
+		if (n < *first) {
+			return(0);
+		}
+		if (n < *last) {
+			*last = n;
+		}
+	}
+	return(*first < size ? 1 : -1);
+}
+/**
+ * A Range is only applied if If-Range is absent or names the current
+ * entity-tag (strong comparison) or modification date
+ *
+ */
+static bool if_range_matches(request* req, time_t mtime)
+{
+	const slice_t* value = request_header(req, "If-Range", sizeof("If-Range") - 1);
+	time_t t;
+
+	if (value == NULL) {
+		return(true);
+	}
+	if (value->len > 0 && value->base[0] == '"') {
+		return(value->len == req->etag.len && memcmp(value->base, req->etag.base, value->len) == 0);
+	}
+	return(http_date_parse(value->base, value->len, &t) == LUAREST_SUCCESS && t == mtime);
+}
+/**
+ * Answers a GET or HEAD request for a file below the route's root without
+ * involving Lua. The body refers to the open file, the server sends it with
+ * sendfile, so its data is never copied through user space
+ *
+ */
+luarest_status static_request(static_route* route, request* req)
+{
+	response_body* body = req->res_body;
+	static_file* file;
+	static_file* variant;
+	const slice_t* value;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	char content_range[CONTENT_RANGE_MAX];
+	char* path;
+	char* dir;
+	size_t len;
+	bool is_dir;
+	int range = 0;
+#ifdef WIN32
+	uv_fs_t fs;
+#endif
+
+	path = resolve_path(route, req, &len);
+	file = path ? open_static(route, path, len, &is_dir) : NULL;
+	if (file == NULL && path != NULL && is_dir) {
+		/* a directory requested without the trailing slash */
+		dir = path;
+		path = (char*)arena_alloc(req->arena, len + sizeof("/" STATIC_INDEX) + sizeof(GZ_SUFFIX));
+		if (path != NULL) {
+			len = sprintf(path, "%s/" STATIC_INDEX, dir);
+			file = open_static(route, path, len, &is_dir);
+		}
+	}
+	if (file == NULL) {
+		req->res_code = HTTP_RESPONSE_NOT_FOUND;
+		return(LUAREST_SUCCESS);
+	}
+
+	variant = file;
+	if (file->gz != NULL) {
+		req->vary_encoding = true;
+		value = request_header(req, "Accept-Encoding", sizeof("Accept-Encoding") - 1);
+		if (value != NULL && compress_negotiate(value->base, value->len) == CONTENT_ENCODING_GZIP) {
+			variant = file->gz;
+			req->con_encoding = CONTENT_ENCODING_GZIP;
+		}
+	}
+	req->mime = find_mime_type(file->path, file->path_len);
+	req->last_modified = file->mtime;
+	req->etag.base = (char*)arena_alloc(req->arena, 40);
+	if (req->etag.base != NULL) {
+		req->etag.len = sprintf(req->etag.base, "\"%lx-%llx\"", (unsigned long)variant->mtime,
+			(unsigned long long)variant->size);
+	}
+	if (request_not_modified(req, &req->etag, req->last_modified)) {
+		req->res_code = HTTP_RESPONSE_NOT_MODIFIED;
+		static_file_release(file);
+		return(LUAREST_SUCCESS);
+	}
+
+	if (request_add_header(req, "Accept-Ranges", sizeof("Accept-Ranges") - 1, "bytes", 
+		sizeof("bytes") - 1) != LUAREST_SUCCESS) {
+		static_file_release(file);
+		return(LUAREST_ERROR);
+	}
+	value = request_header(req, "Range", sizeof("Range") - 1);
+	if (value != NULL && req->method == HTTP_METHOD_GET && if_range_matches(req, file->mtime)) {
+		range = parse_range(value, variant->size, &first, &last);
+	}
+	if (range < 0) {
+		req->res_code = HTTP_RESPONSE_RANGE_NOT_SATISFIABLE;
+		len = sprintf(content_range, "bytes */%llu", (unsigned long long)variant->size);
+		request_add_header(req, "Content-Range", sizeof("Content-Range") - 1, content_range, len);
+		static_file_release(file);
+		return(LUAREST_SUCCESS);
+	}
+	if (range > 0) {
+		req->res_code = HTTP_RESPONSE_PARTIAL_CONTENT;
+		len = sprintf(content_range, "bytes %llu-%llu/%llu", (unsigned long long)first, 
+			(unsigned long long)last, (unsigned long long)variant->size);
+		request_add_header(req, "Content-Range", sizeof("Content-Range") - 1, content_range, len);
+	}
+	else {
+		first = 0;
+		last = variant->size - 1;
+	}
+
+	body->len = variant->size > 0 ? (size_t)(last - first + 1) : 0;
+	if (body->len == 0) {
+		static_file_release(file);
+		return(LUAREST_SUCCESS);
+	}
+#ifdef WIN32
+	/* sockets aren't CRT file descriptors, the range is read into memory */
+	body->owned = (char*)malloc(body->len + 1);
+	uv_fs_read(route->loop, &fs, variant->fd, body->owned, body->len, (int64_t)first, NULL);
+	if (body->owned == NULL || fs.result != (ssize_t)body->len) {
+		body->len = 0;
+	}
+	uv_fs_req_cleanup(&fs);
+	body->data = body->owned;
+#else
+	variant->refs++;
+	body->file = variant;
+	body->fd = variant->fd;
+	body->offset = (int64_t)first;
+#endif
+	static_file_release(file);
+	return(LUAREST_SUCCESS);
+}
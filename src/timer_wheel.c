@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "thirdparty/utlist.h"
+
+#include "timer_wheel.h"
+
+#define L0_MASK (TIMER_WHEEL_L0_SLOTS - 1)
+#define L1_MASK (TIMER_WHEEL_L1_SLOTS - 1)
+
+/**
+ * Puts the timer into the slot matching its expiry, relative to the 
+ * current tick of the wheel
+ *
+ */
+static void insert_timer(timer_wheel* wheel, wheel_timer* timer)
+{
+	unsigned long delta;
+
+	if (timer->expires < wheel->current) {
+		timer->expires = wheel->current;
+	}
+	delta = timer->expires - wheel->current;
+	if (delta > TIMER_WHEEL_MAX_TICKS) {
+		timer->expires = wheel->current + TIMER_WHEEL_MAX_TICKS;
+		delta = TIMER_WHEEL_MAX_TICKS;
+	}
+
+	if (delta < TIMER_WHEEL_L0_SLOTS) {
+		timer->slot = &wheel->level0[timer->expires & L0_MASK];
+	}
+	else {
+		timer->slot = &wheel->level1[(timer->expires >> TIMER_WHEEL_L0_BITS) & L1_MASK];
+	}
+	DL_APPEND(*timer->slot, timer);
+}
+/**
+ * Moves the timers of the second level slot which is due into the first level
+ *
+ */
+static void cascade(timer_wheel* wheel)
+{
+	wheel_timer** slot = &wheel->level1[(wheel->current >> TIMER_WHEEL_L0_BITS) & L1_MASK];
+	wheel_timer* list = *slot;
+	wheel_timer* timer;
+	wheel_timer* tmp;
+
+	*slot = NULL;
+	DL_FOREACH_SAFE(list, timer, tmp) {
+		timer->prev = NULL;
+		timer->next = NULL;
+		insert_timer(wheel, timer);
+	}
+}
+/**
+ *
+ *
+ */
+void timer_wheel_init(timer_wheel* wheel, unsigned int tick_ms)
+{
+	memset(wheel, 0, sizeof(timer_wheel));
+	wheel->tick_ms = tick_ms;
+}
+/**
+ *
+ *
+ */
+void wheel_timer_init(wheel_timer* timer, wheel_timer_cb cb, void* data)
+{
+	timer->cb = cb;
+	timer->data = data;
+	timer->slot = NULL;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+/**
+ * (Re-)arms the timer, O(1)
+ *
+ */
+void timer_wheel_add(timer_wheel* wheel, wheel_timer* timer, unsigned int timeout_ms)
+{
+	unsigned long ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+
+	timer_wheel_remove(wheel, timer);
+	/* never into the slot which is being expired right now */
+	timer->expires = wheel->current + MAX(ticks, 1);
+	insert_timer(wheel, timer);
+}
+/**
+ * O(1), does nothing if the timer isn't armed
+ *
+ */
+void timer_wheel_remove(timer_wheel* wheel, wheel_timer* timer)
+{
+	if (timer->slot == NULL) {
+		return;
+	}
+	DL_DELETE(*timer->slot, timer);
+	timer->slot = NULL;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+/**
+ * Advances the wheel by the given number of ticks and runs the callbacks of 
+ * all expired timers, the work done only depends on the number of timers
+ * which expire or cascade
+ *
+ */
+void timer_wheel_advance(timer_wheel* wheel, unsigned long ticks)
+{
+	wheel_timer* timer;
+	wheel_timer** slot;
+
+	while (ticks-- > 0) {
+		if ((wheel->current & L0_MASK) == 0) {
+			cascade(wheel);
+		}
+		slot = &wheel->level0[wheel->current & L0_MASK];
+		/* callbacks may re-arm or remove other timers of this slot */
+		while ((timer = *slot) != NULL) {
+			DL_DELETE(*slot, timer);
+			timer->slot = NULL;
+			timer->prev = NULL;
+			timer->next = NULL;
+			timer->cb(timer);
+		}
+		wheel->current++;
+	}
+}
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "upload.h"
+
+/* A buffer of file data, written at offset once it is full or its part
+   has ended. Finished ones are kept as spares for the next */
+typedef struct upload_write {
+	uv_fs_t fs;
+	upload* upload;
+	upload_part* part;
+	size_t len;
+	struct upload_write* next;
+	char data[UPLOAD_BUFFER_SIZE];
+} upload_write;
+
+/**
+ *
+ *
+ */
+static char* copy_string(const char* s)
+{
+	size_t len = strlen(s);
+	char* copy = (char*)malloc(len + 1);
+
+	if (copy != NULL) {
+		memcpy(copy, s, len + 1);
+	}
+	return(copy);
+}
+/**
+ *
+ *
+ */
+static void close_part(upload* upload, upload_part* part)
+{
+	uv_fs_t fs;
+
+	if (part->fd >= 0) {
+		uv_fs_close(upload->loop, &fs, part->fd, NULL);
+		uv_fs_req_cleanup(&fs);
+		part->fd = -1;
+	}
+}
+/**
+ * Called once no write is in flight anymore
+ *
+ */
+static void free_upload(upload* upload)
+{
+	upload_part* part;
+	upload_write* w;
+
+	while ((part = upload->parts) != NULL) {
+		upload->parts = part->next;
+		close_part(upload, part);
+		free(part->name);
+		free(part->filename);
+		free(part->content_type);
+		free(part->path);
+		free(part->value);
+		free(part);
+	}
+	while ((w = upload->spare) != NULL) {
+		upload->spare = w->next;
+		free(w);
+	}
+	free(upload->current);
+	free(upload);
+}
+/**
+ * A buffer has been written, its part is closed after its last write
+ *
+ */
+static void on_write_done(uv_fs_t* fs)
+{
+	upload_write* w = (upload_write*)fs->data;
+	upload* upload = w->upload;
+	upload_part* part = w->part;
+
+	if (fs->result != (ssize_t)w->len) {
+		upload->failed = true;
+	}
+	uv_fs_req_cleanup(fs);
+	upload->writes--;
+	if (--part->writes == 0 && part->ended) {
+		close_part(upload, part);
+	}
+	w->next = upload->spare;
+	upload->spare = w;
+
+	if (upload->released) {
+		if (upload->writes == 0) {
+			free_upload(upload);
+		}
+		return;
+	}
+	if (upload->on_write != NULL) {
+		upload->on_write(upload);
+	}
+}
+/**
+ * Starts the write of the buffer being filled, it goes right behind the
+ * data of its part written before
+ *
+ */
+static luarest_status submit_buffer(upload* upload)
+{
+	upload_write* w = upload->current;
+	upload_part* part;
+	int ret;
+
+	if (w == NULL || w->len == 0) {
+		return(LUAREST_SUCCESS);
+	}
+	upload->current = NULL;
+	part = w->part;
+	w->fs.data = w;
+	ret = uv_fs_write(upload->loop, &w->fs, part->fd, w->data, w->len, (int64_t)(part->size - w->len),
+		on_write_done);
+	if (ret != 0) {
+		upload->failed = true;
+		w->next = upload->spare;
+		upload->spare = w;
+		return(LUAREST_ERROR);
+	}
+	upload->writes++;
+	part->writes++;
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Creates the file of a file part, this is the only blocking call of an
+ * upload
+ *
+ */
+static luarest_status open_part(upload* upload, upload_part* part)
+{
+	uv_fs_t fs;
+	int len;
+
+	part->path = (char*)malloc(UPLOAD_PATH_MAX);
+	if (part->path == NULL) {
+		return(LUAREST_ERROR);
+	}
+	len = snprintf(part->path, UPLOAD_PATH_MAX, "%s/luarest-%llx-%p", upload->dir,
+		(unsigned long long)uv_hrtime(), (void*)part);
+	if (len < 0 || len >= UPLOAD_PATH_MAX) {
+		free(part->path);
+		part->path = NULL;
+		return(LUAREST_ERROR);
+	}
+	uv_fs_open(upload->loop, &fs, part->path, O_WRONLY | O_CREAT | O_EXCL, 0600, NULL);
+	part->fd = (uv_file)fs.result;
+	uv_fs_req_cleanup(&fs);
+	if (part->fd < 0) {
+		/* not ours to remove */
+		free(part->path);
+		part->path = NULL;
+		return(LUAREST_ERROR);
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status on_part_begin(multipart_parser* parser)
+{
+	upload* upload = (struct upload*)parser->data;
+	upload_part* part = (upload_part*)calloc(1, sizeof(upload_part));
+
+	if (part == NULL) {
+		return(LUAREST_ERROR);
+	}
+	part->fd = -1;
+	if (upload->last != NULL) {
+		upload->last->next = part;
+	}
+	else {
+		upload->parts = part;
+	}
+	upload->last = part;
+
+	part->name = copy_string(parser->name);
+	if (part->name == NULL) {
+		return(LUAREST_ERROR);
+	}
+	if (parser->content_type[0] != '\0') {
+		part->content_type = copy_string(parser->content_type);
+		if (part->content_type == NULL) {
+			return(LUAREST_ERROR);
+		}
+	}
+	if (parser->has_filename) {
+		part->filename = copy_string(parser->filename);
+		if (part->filename == NULL || open_part(upload, part) != LUAREST_SUCCESS) {
+			upload->failed = true;
+			return(LUAREST_ERROR);
+		}
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ * Copies file data into the buffer being filled, a field's value is kept
+ * in memory as long as the fields stay below UPLOAD_FIELDS_MAX
+ *
+ */
+static luarest_status on_part_data(multipart_parser* parser, const char* data, size_t len)
+{
+	upload* upload = (struct upload*)parser->data;
+	upload_part* part = upload->last;
+	upload_write* w;
+	char* value;
+	size_t n;
+
+	if (part->path == NULL) {
+		if (len > UPLOAD_FIELDS_MAX - upload->fields_size) {
+			return(LUAREST_ERROR);
+		}
+		value = (char*)realloc(part->value, part->size + len + 1);
+		if (value == NULL) {
+			return(LUAREST_ERROR);
+		}
+		memcpy(value + part->size, data, len);
+		part->value = value;
+		part->size += len;
+		part->value[part->size] = '\0';
+		upload->fields_size += len;
+		return(LUAREST_SUCCESS);
+	}
+
+	while (len > 0) {
+		if (upload->current == NULL) {
+			w = upload->spare;
+			if (w != NULL) {
+				upload->spare = w->next;
+			}
+			else if ((w = (upload_write*)malloc(sizeof(upload_write))) == NULL) {
+				return(LUAREST_ERROR);
+			}
+			w->upload = upload;
+			w->part = part;
+			w->len = 0;
+			upload->current = w;
+		}
+		w = upload->current;
+		n = UPLOAD_BUFFER_SIZE - w->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->data + w->len, data, n);
+		w->len += n;
+		part->size += n;
+		data += n;
+		len -= n;
+		if (w->len == UPLOAD_BUFFER_SIZE && submit_buffer(upload) != LUAREST_SUCCESS) {
+			return(LUAREST_ERROR);
+		}
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status on_part_end(multipart_parser* parser)
+{
+	upload* upload = (struct upload*)parser->data;
+	upload_part* part = upload->last;
+
+	part->ended = true;
+	if (part->path == NULL) {
+		return(LUAREST_SUCCESS);
+	}
+	if (submit_buffer(upload) != LUAREST_SUCCESS) {
+		return(LUAREST_ERROR);
+	}
+	if (part->writes == 0) {
+		close_part(upload, part);
+	}
+	return(LUAREST_SUCCESS);
+}
+
+static const multipart_callbacks upload_callbacks = {
+	on_part_begin,
+	on_part_data,
+	on_part_end
+};
+/**
+ * Returns NULL if content_type is not multipart/form-data with a boundary.
+ * Files are spooled to dir, which has to outlive the upload
+ *
+ */
+upload* upload_new(uv_loop_t* loop, const char* dir, const char* content_type, size_t len,
+	void (*on_write)(upload* upload), void* data)
+{
+	upload* u;
+	const char* boundary;
+	size_t boundary_len;
+
+	if (multipart_boundary(content_type, len, &boundary, &boundary_len) != LUAREST_SUCCESS) {
+		return(NULL);
+	}
+	u = (upload*)calloc(1, sizeof(upload));
+	if (u == NULL) {
+		return(NULL);
+	}
+	multipart_init(&u->parser, boundary, boundary_len, &upload_callbacks, u);
+	u->loop = loop;
+	u->dir = dir;
+	u->on_write = on_write;
+	u->data = data;
+	return(u);
+}
+/**
+ * Parses the next piece of the body, fails on a malformed body, a field
+ * exceeding the limit or a file which can't be written
+ *
+ */
+luarest_status upload_feed(upload* upload, const char* data, size_t len)
+{
+	if (upload->failed || multipart_execute(&upload->parser, data, len) != LUAREST_SUCCESS) {
+		return(LUAREST_ERROR);
+	}
+	return(upload->failed ? LUAREST_ERROR : LUAREST_SUCCESS);
+}
+/**
+ * Called once the body has been read, LUAREST_PENDING while files are
+ * still being written, on_write tells when to ask again
+ *
+ */
+luarest_status upload_finish(upload* upload)
+{
+	if (upload->failed || !multipart_complete(&upload->parser)) {
+		return(LUAREST_ERROR);
+	}
+	return(upload->writes > 0 ? LUAREST_PENDING : LUAREST_SUCCESS);
+}
+/**
+ * Whether the body arrives faster than it is written
+ *
+ */
+bool upload_congested(const upload* upload)
+{
+	return(upload->writes >= UPLOAD_MAX_WRITES);
+}
+/**
+ * Removes the spooled files which haven't been moved away and frees the
+ * upload once its writes have completed, on_write isn't called anymore
+ *
+ */
+void upload_release(upload* upload)
+{
+	upload_part* part;
+	uv_fs_t fs;
+
+	upload->released = true;
+	upload->on_write = NULL;
+	for (part = upload->parts; part != NULL; part = part->next) {
+		if (part->path != NULL) {
+			uv_fs_unlink(upload->loop, &fs, part->path, NULL);
+			uv_fs_req_cleanup(&fs);
+		}
+	}
+	if (upload->writes == 0) {
+		free_upload(upload);
+	}
+}
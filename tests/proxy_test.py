@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Runs luarest with a proxy route in front of two stand-in upstreams and a
+# third peer nobody listens on, then checks that every forwarded request
+# reaches an upstream with the path below the application and a Host header
+# naming the peer which answered it, also after a failed connect. The
+# upstreams' hop-by-hop headers must not reach the client, which gets a
+# Connection line of luarest's own.
+#
+# Usage: proxy_test.py <path to luarest>
+
+import http.server
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+LUAREST_PORT = 8000
+UPSTREAM_PORTS = (19000, 19001)
+DEAD_PORT = 19002
+
+APP = """
+function luarest_init(app)
+  app:proxy(luarest.HTTP_METHOD_GET, "/api",
+    { "127.0.0.1:%d", "127.0.0.1:%d", "127.0.0.1:%d" },
+    { connect_timeout = 1000, read_timeout = 2000 })
+end
+""" % (UPSTREAM_PORTS[0], DEAD_PORT, UPSTREAM_PORTS[1])
+
+
+class Upstream(http.server.BaseHTTPRequestHandler):
+    """Answers with its port, the Host header it got and the path"""
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        body = ("%d %s %s" % (self.server.server_port, self.headers.get("Host", "-"),
+                              self.path)).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Keep-Alive", "timeout=5")
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, fmt, *args):
+        pass
+
+
+def start_upstream(port):
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", port), Upstream)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    return server
+
+
+def wait_for_port(port, timeout):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def get(path, host=None):
+    """Sends an HTTP/1.0 request, without a Host header unless one is given,
+    returns the status, the header lines and the body"""
+    sock = socket.create_connection(("127.0.0.1", LUAREST_PORT), 5)
+    request = "GET %s HTTP/1.0\r\n" % path
+    if host is not None:
+        request += "Host: %s\r\n" % host
+    sock.sendall((request + "\r\n").encode())
+    data = b""
+    while True:
+        chunk = sock.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+        head, sep, body = data.partition(b"\r\n\r\n")
+        if sep:
+            for line in head.split(b"\r\n")[1:]:
+                name, _, value = line.partition(b":")
+                if name.strip().lower() == b"content-length" and len(body) >= int(value):
+                    sock.close()
+                    return parse(head, body)
+    sock.close()
+    head, _, body = data.partition(b"\r\n\r\n")
+    return parse(head, body)
+
+
+def parse(head, body):
+    lines = head.decode().split("\r\n")
+    status = lines[0].split(" ")[1] if head else ""
+    return status, [line.lower() for line in lines[1:]], body.decode()
+
+
+def check(cond, msg):
+    if not cond:
+        raise AssertionError(msg)
+
+
+def run():
+    seen = set()
+    for _ in range(9):
+        status, headers, body = get("/proxy/api/echo?x=1")
+        check(status == "200", "expected 200, got %r %r" % (status, body))
+        check(not any(line.startswith("keep-alive:") for line in headers),
+              "hop-by-hop header relayed: %r" % headers)
+        check(headers.count("connection: close") == 1, "no Connection line: %r" % headers)
+        port, host, path = body.split(" ")
+        check(int(port) in UPSTREAM_PORTS, "answered by %s" % port)
+        check(host == "127.0.0.1:%s" % port, "peer %s got Host %s" % (port, host))
+        check(path == "/api/echo?x=1", "upstream got path %s" % path)
+        seen.add(int(port))
+    check(seen == set(UPSTREAM_PORTS), "not every upstream was used: %r" % seen)
+
+    status, headers, body = get("/proxy/api/echo", "example.org")
+    check(status == "200", "expected 200, got %r" % status)
+    check(body.split(" ")[1] == "example.org", "client Host was replaced: %s" % body)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: proxy_test.py <path to luarest>")
+        return 2
+    app_dir = tempfile.mkdtemp()
+    os.mkdir(os.path.join(app_dir, "proxy"))
+    with open(os.path.join(app_dir, "proxy", "main.lua"), "w") as f:
+        f.write(APP)
+    upstreams = [start_upstream(port) for port in UPSTREAM_PORTS]
+    server = subprocess.Popen([sys.argv[1], "-w", "1", app_dir], stdout=subprocess.DEVNULL)
+    try:
+        check(wait_for_port(LUAREST_PORT, 10), "luarest is not listening")
+        run()
+    except AssertionError as e:
+        print("FAIL: %s" % e)
+        return 1
+    finally:
+        server.terminate()
+        server.wait()
+        for upstream in upstreams:
+            upstream.shutdown()
+        shutil.rmtree(app_dir)
+    print("OK")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,20 @@
+#ifndef __LUAREST_TEST_H__
+#define __LUAREST_TEST_H__
+
+#include <stdio.h>
+
+/* Minimal checks for the unit tests, a failed check is reported and the
+   test goes on, the exit status of the test is the number of failures */
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? 0 : 1)
+
+#endif
@@ -0,0 +1,138 @@
+#include <string.h>
+
+#include "escape.h"
+#include "test.h"
+
+/**
+ * Decodes src and compares the result with expected, which may contain
+ * NUL bytes
+ *
+ */
+static bool decodes(const char* src, const char* expected, size_t expected_len)
+{
+	char buf[256];
+	size_t len = url_decode(src, strlen(src), buf);
+
+	return(len == expected_len && memcmp(buf, expected, len) == 0);
+}
+/**
+ *
+ *
+ */
+static void test_decode(void)
+{
+	char buf[16];
+
+	CHECK(decodes("", "", 0));
+	CHECK(decodes("abc", "abc", 3));
+	CHECK(decodes("a+b", "a b", 3));
+	CHECK(decodes("%41%62%2b", "Ab+", 3));
+	CHECK(decodes("%e2%82%AC", "\xe2\x82\xac", 3));
+	CHECK(decodes("a%00b", "a\0b", 3));
+
+	/* a "%" without two hex digits is kept as it is */
+	CHECK(decodes("%", "%", 1));
+	CHECK(decodes("a%", "a%", 2));
+	CHECK(decodes("%4", "%4", 2));
+	CHECK(decodes("a%4", "a%4", 3));
+	CHECK(decodes("%zz", "%zz", 3));
+	CHECK(decodes("%4g", "%4g", 3));
+	CHECK(decodes("%%41", "%A", 2));
+
+	/* only len bytes are read */
+	CHECK(url_decode("%41%42", 4, buf) == 2 && memcmp(buf, "A%4", 2) == 0);
+
+	/* in place */
+	strcpy(buf, "x%3Dy+z");
+	CHECK(url_decode(buf, strlen(buf), buf) == 5 && memcmp(buf, "x=y z", 5) == 0);
+}
+/**
+ *
+ *
+ */
+static void test_decoded_equals(void)
+{
+	CHECK(url_decoded_equals("", 0, "", 0));
+	CHECK(url_decoded_equals("abc", 3, "abc", 3));
+	CHECK(url_decoded_equals("first%20name", 12, "first name", 10));
+	CHECK(url_decoded_equals("first+name", 10, "first name", 10));
+	CHECK(url_decoded_equals("%41%", 4, "A%", 2));
+	CHECK(url_decoded_equals("a%00b", 5, "a\0b", 3));
+	CHECK(!url_decoded_equals("first%20name", 12, "first%20name", 12));
+	CHECK(!url_decoded_equals("abc", 3, "ab", 2));
+	CHECK(!url_decoded_equals("ab", 2, "abc", 3));
+	CHECK(!url_decoded_equals("%41", 3, "B", 1));
+}
+/**
+ *
+ *
+ */
+static void test_count_pairs(void)
+{
+	CHECK(url_count_pairs("", 0) == 0);
+	CHECK(url_count_pairs("a", 1) == 1);
+	CHECK(url_count_pairs("a=1&b=2", 7) == 2);
+	CHECK(url_count_pairs("&&", 2) == 3);
+	CHECK(url_count_pairs("a=1&b=2", 3) == 1);
+}
+/**
+ * Splits src into pairs, joined as "key:value;" into out
+ *
+ */
+static void split(const char* src, char* out)
+{
+	const char* p = src;
+	const char* end = src + strlen(src);
+	const char* key;
+	const char* value;
+	size_t key_len;
+	size_t value_len;
+	size_t n = 0;
+
+	while (url_next_pair(&p, end, &key, &key_len, &value, &value_len)) {
+		memcpy(out + n, key, key_len);
+		n += key_len;
+		out[n++] = ':';
+		memcpy(out + n, value, value_len);
+		n += value_len;
+		out[n++] = ';';
+	}
+	out[n] = 0;
+	CHECK(p == end);
+}
+/**
+ *
+ *
+ */
+static void test_next_pair(void)
+{
+	char out[256];
+
+	split("", out);
+	CHECK(strcmp(out, "") == 0);
+	split("a=1&b=2", out);
+	CHECK(strcmp(out, "a:1;b:2;") == 0);
+
+	/* repeated keys are all returned, in order */
+	split("a=1&a=2&a=", out);
+	CHECK(strcmp(out, "a:1;a:2;a:;") == 0);
+
+	/* empty pairs are skipped, a key without "=" has an empty value */
+	split("&&a&&b=&", out);
+	CHECK(strcmp(out, "a:;b:;") == 0);
+	split("=1&==", out);
+	CHECK(strcmp(out, ":1;:=;") == 0);
+
+	/* key and value are left escaped */
+	split("k%3D=v%26w+x", out);
+	CHECK(strcmp(out, "k%3D:v%26w+x;") == 0);
+}
+
+int main(void)
+{
+	test_decode();
+	test_decoded_equals();
+	test_count_pairs();
+	test_next_pair();
+	return(TEST_RESULT());
+}
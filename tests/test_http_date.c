@@ -0,0 +1,107 @@
+#include <string.h>
+#include <time.h>
+
+#include "http_date.h"
+#include "test.h"
+
+/**
+ *
+ *
+ */
+static bool parses(const char* src, time_t* t)
+{
+	return(http_date_parse(src, strlen(src), t) == LUAREST_SUCCESS);
+}
+/**
+ * Dates of RFC 7231 and the edges of the calendar arithmetic
+ *
+ */
+static void test_known_dates(void)
+{
+	static const struct {
+		time_t t;
+		const char* date;
+	} dates[] = {
+		{ 0, "Thu, 01 Jan 1970 00:00:00 GMT" },
+		{ 784111777, "Sun, 06 Nov 1994 08:49:37 GMT" },
+		{ 951782400, "Tue, 29 Feb 2000 00:00:00 GMT" },
+		{ 978307199, "Sun, 31 Dec 2000 23:59:59 GMT" },
+		{ 2147483647, "Tue, 19 Jan 2038 03:14:07 GMT" },
+		{ -86400, "Wed, 31 Dec 1969 00:00:00 GMT" }
+	};
+	char buf[HTTP_DATE_LEN + 1];
+	time_t t;
+	size_t i;
+
+	for (i = 0; i < sizeof(dates) / sizeof(dates[0]); i++) {
+		http_date_format(dates[i].t, buf);
+		CHECK(strcmp(buf, dates[i].date) == 0);
+		CHECK(parses(dates[i].date, &t) && t == dates[i].t);
+	}
+}
+/**
+ * Formatting and parsing are inverse, and agree with gmtime and strftime
+ * in the C locale
+ *
+ */
+static void test_round_trip(void)
+{
+	char buf[HTTP_DATE_LEN + 1];
+	char expected[64];
+	time_t t;
+	time_t parsed;
+	struct tm* tm;
+
+	for (t = 0; t < (time_t)4102444800LL; t += 86399 * 7 + 1234) {
+		http_date_format(t, buf);
+		CHECK(strlen(buf) == HTTP_DATE_LEN);
+		CHECK(parses(buf, &parsed) && parsed == t);
+		tm = gmtime(&t);
+		strftime(expected, sizeof(expected), "%a, %d %b %Y %H:%M:%S GMT", tm);
+		CHECK(strcmp(buf, expected) == 0);
+	}
+}
+/**
+ * Only IMF-fixdate is accepted
+ *
+ */
+static void test_malformed(void)
+{
+	static const char* dates[] = {
+		"",
+		"Sun, 06 Nov 1994 08:49:37 GM",
+		"Sun, 06 Nov 1994 08:49:37 GMT ",
+		"Sun, 06 Nov 1994 08:49:37 UTC",
+		"Sunday, 06-Nov-94 08:49:37 GMT",
+		"Sun Nov  6 08:49:37 1994",
+		"Sun, 06 Foo 1994 08:49:37 GMT",
+		"Sun, 06 nov 1994 08:49:37 GMT",
+		"Sun, 0x Nov 1994 08:49:37 GMT",
+		"Sun, 06 Nov 19a4 08:49:37 GMT",
+		"Sun, 00 Nov 1994 08:49:37 GMT",
+		"Sun, 32 Nov 1994 08:49:37 GMT",
+		"Sun, 06 Nov 1994 24:49:37 GMT",
+		"Sun, 06 Nov 1994 08:60:37 GMT",
+		"Sun, 06 Nov 1994 08:49:61 GMT",
+		"Sun, 06 Nov 1994 08-49-37 GMT",
+		"Sun,-06 Nov 1994 08:49:37 GMT",
+		"Sun, 06 Nov 1994 -8:49:37 GMT"
+	};
+	time_t t = 42;
+	size_t i;
+
+	for (i = 0; i < sizeof(dates) / sizeof(dates[0]); i++) {
+		CHECK(!parses(dates[i], &t));
+	}
+	CHECK(t == 42);
+	/* the length is the one given, not up to a terminator */
+	CHECK(http_date_parse("Sun, 06 Nov 1994 08:49:37 GMT", 28, &t) == LUAREST_ERROR);
+}
+
+int main(void)
+{
+	test_known_dates();
+	test_round_trip();
+	test_malformed();
+	return(TEST_RESULT());
+}
@@ -0,0 +1,359 @@
+#include <string.h>
+
+#include "multipart.h"
+#include "test.h"
+
+#define MAX_PARTS 8
+#define MAX_PART_DATA 4096
+
+typedef struct part {
+	char name[MULTIPART_VALUE_MAX];
+	char filename[MULTIPART_VALUE_MAX];
+	char content_type[MULTIPART_VALUE_MAX];
+	bool has_filename;
+	char data[MAX_PART_DATA];
+	size_t len;
+	bool ended;
+} part;
+
+/* What the callbacks saw */
+typedef struct result {
+	part parts[MAX_PARTS];
+	int num_parts;
+	int fail_at_part;
+} result;
+
+static const char boundary[] = "----luarest42";
+
+/**
+ *
+ *
+ */
+static luarest_status on_part_begin(multipart_parser* parser)
+{
+	result* res = (result*)parser->data;
+	part* p;
+
+	if (res->num_parts == MAX_PARTS || res->num_parts + 1 == res->fail_at_part) {
+		return(LUAREST_ERROR);
+	}
+	p = &res->parts[res->num_parts++];
+	strcpy(p->name, parser->name);
+	strcpy(p->filename, parser->filename);
+	strcpy(p->content_type, parser->content_type);
+	p->has_filename = parser->has_filename;
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status on_part_data(multipart_parser* parser, const char* data, size_t len)
+{
+	result* res = (result*)parser->data;
+	part* p = &res->parts[res->num_parts - 1];
+
+	if (len == 0 || p->ended || p->len + len > MAX_PART_DATA) {
+		return(LUAREST_ERROR);
+	}
+	memcpy(p->data + p->len, data, len);
+	p->len += len;
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status on_part_end(multipart_parser* parser)
+{
+	result* res = (result*)parser->data;
+
+	res->parts[res->num_parts - 1].ended = true;
+	return(LUAREST_SUCCESS);
+}
+
+static const multipart_callbacks callbacks = {
+	on_part_begin,
+	on_part_data,
+	on_part_end
+};
+
+/**
+ * Parses body in pieces split at the given offsets, which are ascending
+ *
+ */
+static luarest_status parse_split(const char* body, size_t len, const size_t* splits, int num_splits,
+	result* res, bool* complete)
+{
+	multipart_parser parser;
+	size_t from = 0;
+	int i;
+
+	memset(res, 0, sizeof(result));
+	if (multipart_init(&parser, boundary, sizeof(boundary) - 1, &callbacks, res) != LUAREST_SUCCESS) {
+		return(LUAREST_ERROR);
+	}
+	for (i = 0; i <= num_splits; i++) {
+		size_t to = i < num_splits ? splits[i] : len;
+		if (multipart_execute(&parser, body + from, to - from) != LUAREST_SUCCESS) {
+			return(LUAREST_ERROR);
+		}
+		from = to;
+	}
+	*complete = multipart_complete(&parser);
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static luarest_status parse(const char* body, result* res, bool* complete)
+{
+	return(parse_split(body, strlen(body), NULL, 0, res, complete));
+}
+/**
+ *
+ *
+ */
+static bool part_is(const part* p, const char* name, const char* filename, const char* data, size_t len)
+{
+	return(strcmp(p->name, name) == 0 && strcmp(p->filename, filename) == 0 &&
+		p->has_filename == (filename[0] != '\0') && p->len == len && memcmp(p->data, data, len) == 0 &&
+		p->ended);
+}
+/**
+ *
+ *
+ */
+static bool same_result(const result* a, const result* b)
+{
+	int i;
+
+	if (a->num_parts != b->num_parts) {
+		return(false);
+	}
+	for (i = 0; i < a->num_parts; i++) {
+		if (!part_is(&b->parts[i], a->parts[i].name, a->parts[i].filename, a->parts[i].data, a->parts[i].len) ||
+			strcmp(a->parts[i].content_type, b->parts[i].content_type) != 0) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/* Data which resembles the delimiter without being one: CRLFs, dashes, a
+   prefix of the boundary and the boundary without the CRLF in front */
+static const char tricky_data[] =
+	"line 1\r\nline 2\r\n\r\n--\r\n-\r\r\n--------luarest4\r\n------luarest4X"
+	"------luarest42 \r\n--\r";
+
+static const char body[] =
+	"preamble, ignored\r\n"
+	"------luarest42\r\n"
+	"Content-Disposition: form-data; name=\"title\"\r\n"
+	"\r\n"
+	"hello world\r\n"
+	"------luarest42\r\n"
+	"content-disposition: form-data; name=\"file\"; filename=\"a \\\"b\\\".txt\"\r\n"
+	"Content-Type:  text/plain \r\n"
+	"\r\n"
+	"line 1\r\nline 2\r\n\r\n--\r\n-\r\r\n--------luarest4\r\n------luarest4X"
+	"------luarest42 \r\n--\r"
+	"\r\n"
+	"------luarest42\r\n"
+	"Content-Disposition: form-data; name=empty\r\n"
+	"\r\n"
+	"\r\n"
+	"------luarest42--\r\n"
+	"epilogue, ignored\r\n";
+
+/**
+ * The boundary parameter of the Content-Type
+ *
+ */
+static void test_boundary(void)
+{
+	const char* b;
+	size_t len;
+	char too_long[128];
+
+	CHECK(multipart_boundary("multipart/form-data; boundary=abc", 33, &b, &len) == LUAREST_SUCCESS);
+	CHECK(len == 3 && memcmp(b, "abc", 3) == 0);
+	CHECK(multipart_boundary("Multipart/Form-Data; charset=utf-8;BOUNDARY=\"a b\"", 50, &b, &len) == LUAREST_SUCCESS);
+	CHECK(len == 3 && memcmp(b, "a b", 3) == 0);
+	CHECK(multipart_boundary("multipart/form-data", 19, &b, &len) == LUAREST_ERROR);
+	CHECK(multipart_boundary("multipart/form-data; boundary=", 30, &b, &len) == LUAREST_ERROR);
+	CHECK(multipart_boundary("text/plain; boundary=abc", 24, &b, &len) == LUAREST_ERROR);
+	CHECK(multipart_boundary("multipart/form", 14, &b, &len) == LUAREST_ERROR);
+	/* the length given counts, not a terminator */
+	CHECK(multipart_boundary("multipart/form-data; boundary=abc", 31, &b, &len) == LUAREST_SUCCESS);
+	CHECK(len == 1);
+
+	memset(too_long, 'x', sizeof(too_long));
+	memcpy(too_long, "multipart/form-data; boundary=", 30);
+	CHECK(multipart_boundary(too_long, 30 + MULTIPART_BOUNDARY_MAX, &b, &len) == LUAREST_SUCCESS);
+	CHECK(multipart_boundary(too_long, 30 + MULTIPART_BOUNDARY_MAX + 1, &b, &len) == LUAREST_ERROR);
+}
+/**
+ * A body with fields, a file, quoted names and data resembling delimiters
+ *
+ */
+static void test_parts(void)
+{
+	result res;
+	bool complete;
+
+	CHECK(parse(body, &res, &complete) == LUAREST_SUCCESS);
+	CHECK(complete);
+	CHECK(res.num_parts == 3);
+	CHECK(part_is(&res.parts[0], "title", "", "hello world", 11));
+	CHECK(res.parts[0].content_type[0] == '\0');
+	CHECK(part_is(&res.parts[1], "file", "a \"b\".txt", tricky_data, sizeof(tricky_data) - 1));
+	CHECK(strcmp(res.parts[1].content_type, "text/plain") == 0);
+	CHECK(part_is(&res.parts[2], "empty", "", "", 0));
+}
+/**
+ * Every split of the body into two and into three pieces, and feeding it
+ * byte by byte, gives the same parts. Most of the splits cut a delimiter
+ * so that its start is held back at the end of a buffer
+ *
+ */
+static void test_splits(void)
+{
+	static result whole;
+	static result split;
+	size_t len = sizeof(body) - 1;
+	size_t splits[sizeof(body)];
+	bool complete;
+	size_t i;
+	size_t j;
+
+	CHECK(parse(body, &whole, &complete) == LUAREST_SUCCESS);
+	for (i = 0; i <= len; i++) {
+		splits[0] = i;
+		CHECK(parse_split(body, len, splits, 1, &split, &complete) == LUAREST_SUCCESS);
+		CHECK(complete && same_result(&whole, &split));
+	}
+	for (i = 0; i <= len; i += 7) {
+		for (j = i; j <= len; j++) {
+			splits[0] = i;
+			splits[1] = j;
+			CHECK(parse_split(body, len, splits, 2, &split, &complete) == LUAREST_SUCCESS);
+			CHECK(complete && same_result(&whole, &split));
+		}
+	}
+	for (i = 0; i < len; i++) {
+		splits[i] = i + 1;
+	}
+	CHECK(parse_split(body, len, splits, (int)len - 1, &split, &complete) == LUAREST_SUCCESS);
+	CHECK(complete && same_result(&whole, &split));
+}
+/**
+ * A buffer ending in a partial delimiter, the rest shows whether it was one
+ *
+ */
+static void test_partial_delimiter(void)
+{
+	static const char data_after[] =
+		"------luarest42\r\n"
+		"Content-Disposition: form-data; name=\"a\"\r\n"
+		"\r\n"
+		"abc\r\n------luar"
+		"est!\r\n------luarest42--";
+	static const char delimiter_after[] =
+		"------luarest42\r\n"
+		"Content-Disposition: form-data; name=\"a\"\r\n"
+		"\r\n"
+		"abc\r\n------luar"
+		"est42--";
+	size_t splits[1];
+	result res;
+	bool complete;
+
+	/* the split follows "abc\r\n------luar" */
+	splits[0] = strstr(strstr(data_after, "abc"), "luar") + 4 - data_after;
+	CHECK(parse_split(data_after, sizeof(data_after) - 1, splits, 1, &res, &complete) == LUAREST_SUCCESS);
+	CHECK(complete && res.num_parts == 1);
+	CHECK(part_is(&res.parts[0], "a", "", "abc\r\n------luarest!", 19));
+
+	splits[0] = strstr(strstr(delimiter_after, "abc"), "luar") + 4 - delimiter_after;
+	CHECK(parse_split(delimiter_after, sizeof(delimiter_after) - 1, splits, 1, &res, &complete) == LUAREST_SUCCESS);
+	CHECK(complete && res.num_parts == 1);
+	CHECK(part_is(&res.parts[0], "a", "", "abc", 3));
+
+	/* the body ends in the middle of a delimiter */
+	CHECK(parse_split(delimiter_after, splits[0], NULL, 0, &res, &complete) == LUAREST_SUCCESS);
+	CHECK(!complete && res.num_parts == 1 && !res.parts[0].ended && res.parts[0].len == 3);
+}
+/**
+ * Broken framing and headers stop the parser
+ *
+ */
+static void test_malformed(void)
+{
+	static const char* bodies[] = {
+		/* header line without a colon */
+		"------luarest42\r\nContent-Disposition form-data\r\n\r\nx\r\n------luarest42--",
+		/* CR without LF in the headers */
+		"------luarest42\r\nContent-Disposition: form-data; name=a\r\r\n\r\nx\r\n------luarest42--",
+		/* something other than padding, CRLF or "--" after a delimiter */
+		"------luarest42X\r\n\r\nx\r\n------luarest42--",
+		"------luarest42\r\n\r\nx\r\n------luarest42-x",
+		"------luarest42\rX",
+		/* a name longer than MULTIPART_VALUE_MAX */
+		"------luarest42\r\nContent-Disposition: form-data; name=\""
+		"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+		"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+		"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\"\r\n\r\nx\r\n------luarest42--"
+	};
+	char header[MULTIPART_HEADER_MAX + 64];
+	multipart_parser parser;
+	result res;
+	bool complete;
+	size_t i;
+
+	for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+		CHECK(parse(bodies[i], &res, &complete) == LUAREST_ERROR);
+	}
+
+	/* a header line longer than MULTIPART_HEADER_MAX */
+	strcpy(header, "------luarest42\r\nX-Long: ");
+	memset(header + strlen(header), 'y', MULTIPART_HEADER_MAX);
+	header[sizeof(header) - 1] = '\0';
+	CHECK(parse(header, &res, &complete) == LUAREST_ERROR);
+
+	/* a boundary the parser can't take */
+	CHECK(multipart_init(&parser, "", 0, &callbacks, NULL) == LUAREST_ERROR);
+
+	/* no closing delimiter, the body is incomplete */
+	CHECK(parse("------luarest42\r\n\r\nx\r\n------luarest42\r\n\r\ny", &res, &complete) == LUAREST_SUCCESS);
+	CHECK(!complete && res.num_parts == 2);
+	CHECK(parse("no delimiter at all", &res, &complete) == LUAREST_SUCCESS);
+	CHECK(!complete && res.num_parts == 0);
+}
+/**
+ * A callback failing stops the parser
+ *
+ */
+static void test_callback_error(void)
+{
+	multipart_parser parser;
+	result res;
+
+	memset(&res, 0, sizeof(res));
+	res.fail_at_part = 2;
+	CHECK(multipart_init(&parser, boundary, sizeof(boundary) - 1, &callbacks, &res) == LUAREST_SUCCESS);
+	CHECK(multipart_execute(&parser, body, sizeof(body) - 1) == LUAREST_ERROR);
+	CHECK(res.num_parts == 1);
+}
+
+int main(void)
+{
+	test_boundary();
+	test_parts();
+	test_splits();
+	test_partial_delimiter();
+	test_malformed();
+	test_callback_error();
+	return(TEST_RESULT());
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "upload.h"
+#include "test.h"
+
+static const char content_type[] = "multipart/form-data; boundary=xyz";
+
+/* Larger than a few write buffers, so writes overlap and a buffer ends
+   in the middle of a line */
+#define FILE_SIZE (3 * UPLOAD_BUFFER_SIZE + 1234)
+
+static int writes_done = 0;
+
+/**
+ *
+ *
+ */
+static void on_write(upload* upload)
+{
+	writes_done++;
+}
+/**
+ * File data which contains CRLFs and prefixes of the delimiter
+ *
+ */
+static char* make_file(void)
+{
+	static const char pattern[] = "data\r\n--xy\r\n-\r\n--x";
+	char* file = (char*)malloc(FILE_SIZE);
+	size_t i;
+
+	for (i = 0; i < FILE_SIZE; i++) {
+		file[i] = pattern[i % (sizeof(pattern) - 1)];
+	}
+	return(file);
+}
+/**
+ *
+ *
+ */
+static char* make_body(const char* file, size_t* len)
+{
+	static const char head[] =
+		"--xyz\r\n"
+		"Content-Disposition: form-data; name=\"title\"\r\n"
+		"\r\n"
+		"a title\r\n"
+		"--xyz\r\n"
+		"Content-Disposition: form-data; name=\"upload\"; filename=\"data.bin\"\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n";
+	static const char tail[] = "\r\n--xyz--\r\n";
+	char* body = (char*)malloc(sizeof(head) + FILE_SIZE + sizeof(tail));
+
+	memcpy(body, head, sizeof(head) - 1);
+	memcpy(body + sizeof(head) - 1, file, FILE_SIZE);
+	memcpy(body + sizeof(head) - 1 + FILE_SIZE, tail, sizeof(tail) - 1);
+	*len = sizeof(head) - 1 + FILE_SIZE + sizeof(tail) - 1;
+	return(body);
+}
+/**
+ * Feeds body in pieces of size bytes, waiting for writes while the upload
+ * is congested as the server does
+ *
+ */
+static luarest_status feed(upload* u, const char* body, size_t len, size_t size)
+{
+	size_t i;
+	size_t n;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i < size ? len - i : size;
+		if (upload_feed(u, body + i, n) != LUAREST_SUCCESS) {
+			return(LUAREST_ERROR);
+		}
+		while (upload_congested(u)) {
+			uv_run_once(u->loop);
+		}
+	}
+	return(LUAREST_SUCCESS);
+}
+/**
+ *
+ *
+ */
+static bool file_equals(const char* path, const char* data, size_t len)
+{
+	FILE* f = fopen(path, "rb");
+	char* buf = (char*)malloc(len + 1);
+	size_t n;
+
+	if (f == NULL) {
+		free(buf);
+		return(false);
+	}
+	n = fread(buf, 1, len + 1, f);
+	fclose(f);
+	n = n == len && memcmp(buf, data, len) == 0;
+	free(buf);
+	return(n != 0);
+}
+/**
+ * A field is kept in memory, the file is spooled to disk while the body
+ * arrives in pieces of any size
+ *
+ */
+static void test_spool(uv_loop_t* loop, const char* dir, const char* file, const char* body, size_t len,
+	size_t piece)
+{
+	upload* u = upload_new(loop, dir, content_type, sizeof(content_type) - 1, on_write, NULL);
+	upload_part* part;
+	luarest_status status;
+	char path[UPLOAD_PATH_MAX];
+
+	CHECK(u != NULL);
+	if (u == NULL) {
+		return;
+	}
+	writes_done = 0;
+	CHECK(feed(u, body, len, piece) == LUAREST_SUCCESS);
+	while ((status = upload_finish(u)) == LUAREST_PENDING) {
+		uv_run_once(loop);
+	}
+	CHECK(status == LUAREST_SUCCESS);
+	CHECK(writes_done >= FILE_SIZE / UPLOAD_BUFFER_SIZE);
+
+	part = u->parts;
+	CHECK(part != NULL && strcmp(part->name, "title") == 0 && part->path == NULL);
+	CHECK(part != NULL && part->size == 7 && strcmp(part->value, "a title") == 0);
+	part = part ? part->next : NULL;
+	CHECK(part != NULL && strcmp(part->name, "upload") == 0 && strcmp(part->filename, "data.bin") == 0);
+	CHECK(part != NULL && strcmp(part->content_type, "application/octet-stream") == 0);
+	CHECK(part != NULL && part->size == FILE_SIZE && part->path != NULL);
+	CHECK(part != NULL && part->next == NULL);
+	if (part == NULL || part->path == NULL) {
+		upload_release(u);
+		return;
+	}
+	CHECK(file_equals(part->path, file, FILE_SIZE));
+
+	/* files which haven't been moved away are removed */
+	strcpy(path, part->path);
+	upload_release(u);
+	uv_run(loop);
+	CHECK(access(path, F_OK) != 0);
+}
+/**
+ * Broken bodies fail, the upload can be released at any point
+ *
+ */
+static void test_broken(uv_loop_t* loop, const char* dir, const char* body, size_t len)
+{
+	char* fields = (char*)malloc(UPLOAD_FIELDS_MAX + 64);
+	size_t n;
+	upload* u;
+
+	CHECK(upload_new(loop, dir, "text/plain; boundary=xyz", 24, on_write, NULL) == NULL);
+	CHECK(upload_new(loop, dir, "multipart/form-data", 19, on_write, NULL) == NULL);
+
+	/* the body ends before the closing delimiter */
+	u = upload_new(loop, dir, content_type, sizeof(content_type) - 1, on_write, NULL);
+	CHECK(feed(u, body, len / 2, 4096) == LUAREST_SUCCESS);
+	CHECK(upload_finish(u) == LUAREST_ERROR);
+	upload_release(u);
+	uv_run(loop);
+
+	/* a malformed part header */
+	u = upload_new(loop, dir, content_type, sizeof(content_type) - 1, on_write, NULL);
+	CHECK(upload_feed(u, "--xyz\r\nno colon\r\n\r\n", 19) == LUAREST_ERROR);
+	upload_release(u);
+
+	/* fields above the limit */
+	strcpy(fields, "--xyz\r\nContent-Disposition: form-data; name=\"big\"\r\n\r\n");
+	n = strlen(fields);
+	memset(fields + n, 'x', UPLOAD_FIELDS_MAX + 1);
+	u = upload_new(loop, dir, content_type, sizeof(content_type) - 1, on_write, NULL);
+	CHECK(upload_feed(u, fields, n + UPLOAD_FIELDS_MAX + 1) == LUAREST_ERROR);
+	upload_release(u);
+
+	/* a directory which doesn't exist */
+	u = upload_new(loop, "/nonexistent/luarest", content_type, sizeof(content_type) - 1, on_write, NULL);
+	CHECK(feed(u, body, len, len) == LUAREST_ERROR);
+	upload_release(u);
+	free(fields);
+}
+
+int main(void)
+{
+	uv_loop_t* loop = uv_default_loop();
+	char dir[] = "/tmp/luarest-test-XXXXXX";
+	char* file = make_file();
+	char* body;
+	size_t len;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return(1);
+	}
+	body = make_body(file, &len);
+	test_spool(loop, dir, file, body, len, len);
+	test_spool(loop, dir, file, body, len, 1000);
+	test_spool(loop, dir, file, body, len, 7);
+	test_broken(loop, dir, body, len);
+	rmdir(dir);
+	free(body);
+	free(file);
+	return(TEST_RESULT());
+}